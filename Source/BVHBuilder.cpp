@@ -1,24 +1,28 @@
 #include "BVHBuilder.h"
+#include "TaskScheduler.h"
+
+#include <Rush/UtilLog.h>
 
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
 #include <xmmintrin.h>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 namespace
 {
+// Nodes of the tree being built. Leaves occupy the beginning of the array, one per primitive reference.
+// Data that is only needed by a single build stage is kept in separate arrays owned by that stage.
 struct TempNode : BVHNode
 {
-	u32 visitOrder = InvalidMask;
 	u32 parent = InvalidMask;
 
 	u32 left;
 	u32 right;
-
-	Vec3 bboxCenter;
-
-	float primArea = 0.0f;
-
-	float surfaceAreaLeft = 0.0f;
-	float surfaceAreaRight = 0.0f;
 };
 
 inline float bboxSurfaceArea(const Vec3& bboxMin, const Vec3& bboxMax)
@@ -32,6 +36,11 @@ inline float bboxSurfaceArea(const Box3& bbox)
 	return bboxSurfaceArea(bbox.m_min, bbox.m_max);
 }
 
+inline Vec3 getCenter(const BVHNode& node)
+{
+	return (node.bboxMin + node.bboxMax) * 0.5f;
+}
+
 inline void setBounds(BVHNode& node, const Vec3& min, const Vec3& max)
 {
 	node.bboxMin[0] = min.x;
@@ -50,7 +59,7 @@ inline Vec3 extractVec3(__m128 v)
 	return Vec3(temp);
 }
 
-Box3 calculateBounds(std::vector<TempNode>& nodes, u32 begin, u32 end)
+Box3 calculateBounds(const std::vector<TempNode>& nodes, u32 begin, u32 end)
 {
 	Box3 bounds;
 	if (begin == end)
@@ -75,100 +84,146 @@ Box3 calculateBounds(std::vector<TempNode>& nodes, u32 begin, u32 end)
 	return bounds;
 }
 
-u32 split(std::vector<TempNode>& nodes, u32 begin, u32 end, const Box3& nodeBounds)
+// Working set of the top-down builder. Leaf nodes are never moved: primitive ranges are sorted and partitioned
+// as a permutation of leaf indices, with centroids stored in a separate array. Sorting moves 32 bit indices
+// instead of whole nodes.
+struct BuildContext
 {
-	u32 count = end - begin;
-	u32 bestSplit = begin;
+	std::vector<TempNode>& nodes;
+	const BVHBuilderSettings& settings;
+	TaskScheduler* scheduler;
+	u32 primCount;
 
-	if (count <= 1000000)
+	std::vector<u32> prims; // Leaf indices, subtree over [begin, end) owns prims[begin, end)
+	std::vector<Vec3> centroids; // Indexed by leaf
+
+	struct SortKey
 	{
-		u32 bestAxis = 0;
-		u32 globalBestSplit = begin;
-		float globalBestCost = FLT_MAX;
+		float position;
+		u32 prim;
+	};
 
-		for (u32 axis = 0; axis < 3; ++axis)
+	// Scratch data is indexed by position in prims, which is disjoint between subtrees.
+	// Sort keys are only used by sweep splits, binned builds leave them empty.
+	std::vector<float> surfaceAreaRight;
+	std::vector<SortKey> sortKeys;
+
+	BuildContext(std::vector<TempNode>& inNodes, const BVHBuilderSettings& inSettings, TaskScheduler* inScheduler, u32 inPrimCount)
+		: nodes(inNodes), settings(inSettings), scheduler(inScheduler), primCount(inPrimCount)
+		, prims(inPrimCount), centroids(inPrimCount), surfaceAreaRight(inPrimCount)
+		, sortKeys(inSettings.splitMode == BVHSplitMode::Binned ? 0 : inPrimCount)
+	{
+		parallelFor(scheduler, primCount, 65536, [&](u32 begin, u32 end)
 		{
-			// TODO: just sort into N buckets
-			std::sort(nodes.begin() + begin, nodes.begin() + end,
-				[&](const TempNode& a, const TempNode& b)
+			for (u32 i = begin; i < end; ++i)
 			{
-				return a.bboxCenter[axis] < b.bboxCenter[axis];
-			});
+				prims[i] = i;
+				centroids[i] = getCenter(nodes[i]);
+			}
+		});
+	}
+
+	// Centroid coordinates are gathered next to the indices, so that sorting does not access centroids indirectly
+	void sortPrims(u32 begin, u32 end, u32 axis)
+	{
+		SortKey* keys = sortKeys.data();
 
-			Box3 boundsLeft;
-			boundsLeft.expandInit();
+		for (u32 i = begin; i < end; ++i)
+		{
+			keys[i].position = centroids[prims[i]][axis];
+			keys[i].prim = prims[i];
+		}
 
-			Box3 boundsRight;
-			boundsRight.expandInit();
+		std::sort(keys + begin, keys + end,
+			[](const SortKey& a, const SortKey& b)
+		{
+			return a.position < b.position;
+		});
 
-			for (u32 indexLeft = 0; indexLeft < count; ++indexLeft)
-			{
-				u32 indexRight = count - indexLeft - 1;
+		for (u32 i = begin; i < end; ++i)
+		{
+			prims[i] = keys[i].prim;
+		}
+	}
+};
+
+Box3 calculateBounds(const BuildContext& context, u32 begin, u32 end)
+{
+	__m128 bboxMin = _mm_set1_ps(FLT_MAX);
+	__m128 bboxMax = _mm_set1_ps(-FLT_MAX);
+	for (u32 i = begin; i < end; ++i)
+	{
+		const TempNode& node = context.nodes[context.prims[i]];
+		bboxMin = _mm_min_ps(bboxMin, _mm_loadu_ps(&node.bboxMin.x));
+		bboxMax = _mm_max_ps(bboxMax, _mm_loadu_ps(&node.bboxMax.x));
+	}
+	return Box3(extractVec3(bboxMin), extractVec3(bboxMax));
+}
+
+u32 splitSweep(BuildContext& context, u32 begin, u32 end, const Box3& nodeBounds)
+{
+	const std::vector<TempNode>& nodes = context.nodes;
+	const u32* prims = context.prims.data();
 
-				boundsLeft.expand(nodes[begin + indexLeft].bboxMin);
-				boundsLeft.expand(nodes[begin + indexLeft].bboxMax);
+	u32 count = end - begin;
 
-				boundsRight.expand(nodes[begin + indexRight].bboxMin);
-				boundsRight.expand(nodes[begin + indexRight].bboxMax);
+	if (count <= 1000000)
+	{
+		u32 bestAxis = 0;
+		u32 bestSplit = begin;
+		float bestCost = FLT_MAX;
 
-				float surfaceAreaLeft = bboxSurfaceArea(boundsLeft);
-				float surfaceAreaRight = bboxSurfaceArea(boundsRight);
+		for (u32 axis = 0; axis < 3; ++axis)
+		{
+			context.sortPrims(begin, end, axis);
 
-				nodes[begin + indexLeft].surfaceAreaLeft = surfaceAreaLeft;
-				nodes[begin + indexRight].surfaceAreaRight = surfaceAreaRight;
+			__m128 bboxMin = _mm_set1_ps(FLT_MAX);
+			__m128 bboxMax = _mm_set1_ps(-FLT_MAX);
+			for (u32 i = end - 1; i > begin; --i)
+			{
+				const TempNode& node = nodes[prims[i]];
+				bboxMin = _mm_min_ps(bboxMin, _mm_loadu_ps(&node.bboxMin.x));
+				bboxMax = _mm_max_ps(bboxMax, _mm_loadu_ps(&node.bboxMax.x));
+				context.surfaceAreaRight[i] = bboxSurfaceArea(extractVec3(bboxMin), extractVec3(bboxMax));
 			}
 
-			float bestCost = FLT_MAX;
+			bboxMin = _mm_set1_ps(FLT_MAX);
+			bboxMax = _mm_set1_ps(-FLT_MAX);
 			for (u32 mid = begin + 1; mid < end; ++mid)
 			{
-				float surfaceAreaLeft = nodes[mid - 1].surfaceAreaLeft;
-				float surfaceAreaRight = nodes[mid].surfaceAreaRight;
+				const TempNode& node = nodes[prims[mid - 1]];
+				bboxMin = _mm_min_ps(bboxMin, _mm_loadu_ps(&node.bboxMin.x));
+				bboxMax = _mm_max_ps(bboxMax, _mm_loadu_ps(&node.bboxMax.x));
 
-				u32 countLeft = mid - begin;
-				u32 countRight = end - mid;
-
-				float costLeft = surfaceAreaLeft * (float)countLeft;
-				float costRight = surfaceAreaRight * (float)countRight;
-
-				float cost = costLeft + costRight;
+				float surfaceAreaLeft = bboxSurfaceArea(extractVec3(bboxMin), extractVec3(bboxMax));
+				float cost = surfaceAreaLeft * (float)(mid - begin) + context.surfaceAreaRight[mid] * (float)(end - mid);
 				if (cost < bestCost)
 				{
-					bestSplit = mid;
 					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = mid;
 				}
 			}
-
-			if (bestCost < globalBestCost)
-			{
-				globalBestSplit = bestSplit;
-				globalBestCost = bestCost;
-				bestAxis = axis;
-			}
 		}
 
-		std::sort(nodes.begin() + begin, nodes.begin() + end,
-			[&](const TempNode& a, const TempNode& b)
+		if (bestAxis != 2)
 		{
-			return a.bboxCenter[bestAxis] < b.bboxCenter[bestAxis];
-		});
+			context.sortPrims(begin, end, bestAxis);
+		}
 
-		return globalBestSplit;
+		return bestSplit;
 	}
 	else
 	{
 		Vec3 extents = nodeBounds.dimensions();
 		int majorAxis = (int)std::distance(extents.begin(), std::max_element(extents.begin(), extents.end()));
 
-		std::sort(nodes.begin() + begin, nodes.begin() + end,
-			[&](const TempNode& a, const TempNode& b)
-		{
-			return a.bboxCenter[majorAxis] < b.bboxCenter[majorAxis];
-		});
+		context.sortPrims(begin, end, majorAxis);
 
 		float splitPos = (nodeBounds.m_min[majorAxis] + nodeBounds.m_max[majorAxis]) * 0.5f;
 		for (u32 mid = begin + 1; mid < end; ++mid)
 		{
-			if (nodes[mid].bboxCenter[majorAxis] >= splitPos)
+			if (context.centroids[prims[mid]][majorAxis] >= splitPos)
 			{
 				return mid;
 			}
@@ -178,191 +233,3521 @@ u32 split(std::vector<TempNode>& nodes, u32 begin, u32 end, const Box3& nodeBoun
 	};
 }
 
-u32 buildInternal(std::vector<TempNode>& nodes, u32 begin, u32 end)
+u32 splitMedian(BuildContext& context, u32 begin, u32 end, u32 axis)
 {
-	u32 count = end - begin;
+	u32 mid = begin + (end - begin) / 2;
 
-	if (count == 1)
+	const std::vector<Vec3>& centroids = context.centroids;
+	std::nth_element(context.prims.begin() + begin, context.prims.begin() + mid, context.prims.begin() + end,
+		[&](u32 a, u32 b)
 	{
-		return begin;
-	}
+		return centroids[a][axis] < centroids[b][axis];
+	});
+
+	return mid;
+}
 
-	Box3 bounds = calculateBounds(nodes, begin, end);
+struct Bin
+{
+	__m128 bboxMin;
+	__m128 bboxMax;
+	u32 count;
+};
 
-	u32 mid = split(nodes, begin, end, bounds);
+struct BinMapping
+{
+	Vec3 origin;
+	Vec3 scale;
+	u32 binCount;
 
-	u32 nodeId = (u32)nodes.size();
-	nodes.push_back(TempNode());
+	BinMapping(const Box3& centroidBounds, u32 inBinCount)
+		: origin(centroidBounds.m_min), binCount(inBinCount)
+	{
+		const Vec3 centroidExtents = centroidBounds.dimensions();
+		for (u32 axis = 0; axis < 3; ++axis)
+		{
+			scale[axis] = centroidExtents[axis] > 0.0f ? (float)binCount / centroidExtents[axis] : 0.0f;
+		}
+	}
 
-	TempNode node;
+	u32 getBinIndex(const Vec3& centroid, u32 axis) const
+	{
+		float offset = (centroid[axis] - origin[axis]) * scale[axis];
+		return min<u32>((u32)offset, binCount - 1);
+	}
+};
 
-	node.left = buildInternal(nodes, begin, mid);
-	node.right = buildInternal(nodes, mid, end);
+Box3 calculateCentroidBounds(const BuildContext& context, u32 begin, u32 end)
+{
+	Box3 centroidBounds;
+	centroidBounds.expandInit();
+	for (u32 i = begin; i < end; ++i)
+	{
+		centroidBounds.expand(context.centroids[context.prims[i]]);
+	}
+	return centroidBounds;
+}
 
-	float surfaceAreaLeft = bboxSurfaceArea(nodes[node.left].bboxMin, nodes[node.left].bboxMax);
-	float surfaceAreaRight = bboxSurfaceArea(nodes[node.right].bboxMin, nodes[node.right].bboxMax);
+// Bins for all 3 axes are stored sequentially
+void resetBins(Bin* bins, u32 binCount)
+{
+	for (u32 binIndex = 0; binIndex < binCount * 3; ++binIndex)
+	{
+		Bin& bin = bins[binIndex];
+		bin.bboxMin = _mm_set1_ps(FLT_MAX);
+		bin.bboxMax = _mm_set1_ps(-FLT_MAX);
+		bin.count = 0;
+	}
+}
 
-	if (surfaceAreaRight > surfaceAreaLeft)
+void accumulateBins(const BuildContext& context, u32 begin, u32 end, const BinMapping& mapping, Bin* bins)
+{
+	for (u32 i = begin; i < end; ++i)
 	{
-		std::swap(node.left, node.right);
+		const u32 prim = context.prims[i];
+		const TempNode& node = context.nodes[prim];
+		__m128 nodeBoundsMin = _mm_loadu_ps(&node.bboxMin.x);
+		__m128 nodeBoundsMax = _mm_loadu_ps(&node.bboxMax.x);
+		for (u32 axis = 0; axis < 3; ++axis)
+		{
+			Bin& bin = bins[axis * mapping.binCount + mapping.getBinIndex(context.centroids[prim], axis)];
+			bin.bboxMin = _mm_min_ps(bin.bboxMin, nodeBoundsMin);
+			bin.bboxMax = _mm_max_ps(bin.bboxMax, nodeBoundsMax);
+			bin.count++;
+		}
 	}
+}
 
-	setBounds(node, bounds.m_min, bounds.m_max);
-	node.bboxCenter = bounds.center();
-	node.prim = BVHNode::InvalidMask;
+void mergeBins(Bin* bins, const Bin* otherBins, u32 binCount)
+{
+	for (u32 binIndex = 0; binIndex < binCount * 3; ++binIndex)
+	{
+		bins[binIndex].bboxMin = _mm_min_ps(bins[binIndex].bboxMin, otherBins[binIndex].bboxMin);
+		bins[binIndex].bboxMax = _mm_max_ps(bins[binIndex].bboxMax, otherBins[binIndex].bboxMax);
+		bins[binIndex].count += otherBins[binIndex].count;
+	}
+}
+
+// Returns false if there is no split candidate with primitives on both sides
+bool findBestBinnedSplit(const Bin* bins, const BinMapping& mapping, u32& outAxis, u32& outBin)
+{
+	const u32 binCount = mapping.binCount;
 
-	nodes[node.left].parent = nodeId;
-	nodes[node.right].parent = nodeId;
+	float surfaceAreaRight[BVHBuilderSettings::MaxBinCount];
+	u32 countRight[BVHBuilderSettings::MaxBinCount];
 
-	nodes[nodeId] = node;
+	float bestCost = FLT_MAX;
+	outAxis = 0;
+	outBin = BVHNode::InvalidMask;
 
-	return nodeId;
+	for (u32 axis = 0; axis < 3; ++axis)
+	{
+		if (mapping.scale[axis] == 0.0f)
+		{
+			continue;
+		}
+
+		const Bin* axisBins = bins + axis * binCount;
+
+		__m128 bboxMin = _mm_set1_ps(FLT_MAX);
+		__m128 bboxMax = _mm_set1_ps(-FLT_MAX);
+		u32 count = 0;
+
+		for (u32 binIndex = binCount - 1; binIndex > 0; --binIndex)
+		{
+			const Bin& bin = axisBins[binIndex];
+			bboxMin = _mm_min_ps(bboxMin, bin.bboxMin);
+			bboxMax = _mm_max_ps(bboxMax, bin.bboxMax);
+			count += bin.count;
+			surfaceAreaRight[binIndex] = count ? bboxSurfaceArea(extractVec3(bboxMin), extractVec3(bboxMax)) : 0.0f;
+			countRight[binIndex] = count;
+		}
+
+		bboxMin = _mm_set1_ps(FLT_MAX);
+		bboxMax = _mm_set1_ps(-FLT_MAX);
+		count = 0;
+
+		// Candidate split planes are placed between bin N and N+1
+		for (u32 binIndex = 0; binIndex < binCount - 1; ++binIndex)
+		{
+			const Bin& bin = axisBins[binIndex];
+			bboxMin = _mm_min_ps(bboxMin, bin.bboxMin);
+			bboxMax = _mm_max_ps(bboxMax, bin.bboxMax);
+			count += bin.count;
+
+			if (count == 0 || countRight[binIndex + 1] == 0)
+			{
+				continue;
+			}
+
+			float surfaceAreaLeft = bboxSurfaceArea(extractVec3(bboxMin), extractVec3(bboxMax));
+
+			float costLeft = surfaceAreaLeft * (float)count;
+			float costRight = surfaceAreaRight[binIndex + 1] * (float)countRight[binIndex + 1];
+
+			float cost = costLeft + costRight;
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				outAxis = axis;
+				outBin = binIndex;
+			}
+		}
+	}
+
+	return outBin != BVHNode::InvalidMask;
 }
 
-void setDepthFirstVisitOrder(std::vector<TempNode>& nodes, u32 nodeId, u32 nextId, u32& order)
+u32 getMajorAxis(const Vec3& extents)
 {
-	TempNode& node = nodes[nodeId];
+	return (u32)std::distance(extents.begin(), std::max_element(extents.begin(), extents.end()));
+}
+
+u32 splitBinned(BuildContext& context, u32 begin, u32 end, u32 binCount)
+{
+	Bin bins[BVHBuilderSettings::MaxBinCount * 3];
 
-	node.visitOrder = order++;
-	node.next = nextId;
+	const Box3 centroidBounds = calculateCentroidBounds(context, begin, end);
+	const BinMapping mapping(centroidBounds, binCount);
 
-	if (node.left != BVHNode::InvalidMask)
+	resetBins(bins, binCount);
+	accumulateBins(context, begin, end, mapping, bins);
+
+	u32 bestAxis, bestBin;
+	if (!findBestBinnedSplit(bins, mapping, bestAxis, bestBin))
 	{
-		setDepthFirstVisitOrder(nodes, node.left, node.right, order);
+		// All centroids are coincident or fall into a single bin
+		return splitMedian(context, begin, end, getMajorAxis(centroidBounds.dimensions()));
 	}
 
-	if (node.right != BVHNode::InvalidMask)
+	auto it = std::partition(context.prims.begin() + begin, context.prims.begin() + end,
+		[&](u32 prim)
+	{
+		return mapping.getBinIndex(context.centroids[prim], bestAxis) <= bestBin;
+	});
+
+	u32 mid = (u32)std::distance(context.prims.begin(), it);
+	if (mid == begin || mid == end)
 	{
-		setDepthFirstVisitOrder(nodes, node.right, nextId, order);
+		return splitMedian(context, begin, end, bestAxis);
 	}
+
+	return mid;
 }
 
-void setDepthFirstVisitOrder(std::vector<TempNode>& nodes, u32 root)
+// Binned split for large ranges, where binning and partitioning are distributed across threads.
+// Work is divided into fixed-size chunks, so the result does not depend on the number of threads.
+u32 splitBinnedParallel(BuildContext& context, u32 begin, u32 end)
 {
-	u32 order = 0;
-	setDepthFirstVisitOrder(nodes, root, BVHNode::InvalidMask, order);
-}
+	static const u32 ChunkSize = 65536;
 
-}
+	std::vector<u32>& prims = context.prims;
+	TaskScheduler* scheduler = context.scheduler;
 
-void BVHBuilder::build(const float* vertices, u32 stride, const u32* indices, u32 primCount)
-{
-	auto getVertex = [vertices, stride](u32 vertexId)
+	const u32 binCount = context.settings.binCount;
+	const u32 chunkCount = divUp(end - begin, ChunkSize);
+
+	auto getChunkBegin = [&](u32 chunkIndex) { return begin + chunkIndex * ChunkSize; };
+	auto getChunkEnd = [&](u32 chunkIndex) { return min<u32>(begin + (chunkIndex + 1) * ChunkSize, end); };
+
+	std::vector<Box3> chunkCentroidBounds(chunkCount);
+	parallelFor(scheduler, chunkCount, 1, [&](u32 chunkBegin, u32 chunkEnd)
 	{
-		return Vec3(vertices + stride*vertexId);
+		for (u32 chunkIndex = chunkBegin; chunkIndex < chunkEnd; ++chunkIndex)
+		{
+			chunkCentroidBounds[chunkIndex] = calculateCentroidBounds(context, getChunkBegin(chunkIndex), getChunkEnd(chunkIndex));
+		}
+	});
+
+	Box3 centroidBounds;
+	centroidBounds.expandInit();
+	for (const Box3& bounds : chunkCentroidBounds)
+	{
+		centroidBounds.expand(bounds.m_min);
+		centroidBounds.expand(bounds.m_max);
+	}
+
+	const BinMapping mapping(centroidBounds, binCount);
+
+	std::vector<Bin> chunkBins(chunkCount * binCount * 3);
+	parallelFor(scheduler, chunkCount, 1, [&](u32 chunkBegin, u32 chunkEnd)
+	{
+		for (u32 chunkIndex = chunkBegin; chunkIndex < chunkEnd; ++chunkIndex)
+		{
+			Bin* bins = &chunkBins[chunkIndex * binCount * 3];
+			resetBins(bins, binCount);
+			accumulateBins(context, getChunkBegin(chunkIndex), getChunkEnd(chunkIndex), mapping, bins);
+		}
+	});
+
+	for (u32 chunkIndex = 1; chunkIndex < chunkCount; ++chunkIndex)
+	{
+		mergeBins(&chunkBins[0], &chunkBins[chunkIndex * binCount * 3], binCount);
+	}
+
+	u32 bestAxis, bestBin;
+	if (!findBestBinnedSplit(chunkBins.data(), mapping, bestAxis, bestBin))
+	{
+		return splitMedian(context, begin, end, getMajorAxis(centroidBounds.dimensions()));
+	}
+
+	// Partition each chunk independently, then merge neighboring partitioned ranges pairwise.
+	// Merging [L0 R0][L1 R1] into [L0 L1][R0 R1] is a rotation of R0 L1, done as three reversals.
+
+	struct PartitionedRange
+	{
+		u32 begin;
+		u32 mid;
+		u32 end;
 	};
 
-	m_nodes.clear();
-	m_nodes.reserve(primCount * 2 - 1);
+	std::vector<PartitionedRange> ranges(chunkCount);
+	parallelFor(scheduler, chunkCount, 1, [&](u32 chunkBegin, u32 chunkEnd)
+	{
+		for (u32 chunkIndex = chunkBegin; chunkIndex < chunkEnd; ++chunkIndex)
+		{
+			PartitionedRange& range = ranges[chunkIndex];
+			range.begin = getChunkBegin(chunkIndex);
+			range.end = getChunkEnd(chunkIndex);
+			auto it = std::partition(prims.begin() + range.begin, prims.begin() + range.end,
+				[&](u32 prim)
+			{
+				return mapping.getBinIndex(context.centroids[prim], bestAxis) <= bestBin;
+			});
+			range.mid = (u32)std::distance(prims.begin(), it);
+		}
+	});
 
-	std::vector<TempNode> tempNodes;
-	tempNodes.reserve(primCount * 2 - 1);
+	auto reverse = [&](u32 reverseBegin, u32 reverseEnd)
+	{
+		const u32 swapCount = (reverseEnd - reverseBegin) / 2;
+		parallelFor(scheduler, swapCount, ChunkSize, [&](u32 swapBegin, u32 swapEnd)
+		{
+			for (u32 i = swapBegin; i < swapEnd; ++i)
+			{
+				std::swap(prims[reverseBegin + i], prims[reverseEnd - i - 1]);
+			}
+		});
+	};
 
-	for (u32 primId = 0; primId < primCount; ++primId)
+	while (ranges.size() > 1)
 	{
-		TempNode node;
-		Box3 box;
-		box.expandInit();
+		std::vector<PartitionedRange> mergedRanges;
+		mergedRanges.reserve(divUp((u32)ranges.size(), 2));
 
-		Vec3 v0 = getVertex(indices[primId * 3 + 0]);
-		Vec3 v1 = getVertex(indices[primId * 3 + 1]);
-		Vec3 v2 = getVertex(indices[primId * 3 + 2]);
+		for (size_t i = 0; i < ranges.size(); i += 2)
+		{
+			if (i + 1 == ranges.size())
+			{
+				mergedRanges.push_back(ranges[i]);
+				continue;
+			}
 
-		box.expand(v0);
-		box.expand(v1);
-		box.expand(v2);
+			const PartitionedRange& a = ranges[i];
+			const PartitionedRange& b = ranges[i + 1];
 
-		node.primArea = Triangle::calculateArea(v0, v1, v2);
+			reverse(a.mid, a.end);
+			reverse(b.begin, b.mid);
+			reverse(a.mid, b.mid);
 
-		setBounds(node, box.m_min, box.m_max);
+			PartitionedRange merged;
+			merged.begin = a.begin;
+			merged.mid = a.mid + (b.mid - b.begin);
+			merged.end = b.end;
+			mergedRanges.push_back(merged);
+		}
 
-		node.bboxCenter = box.center();
-		node.prim = primId;
-		node.left = BVHNode::InvalidMask;
-		node.right = BVHNode::InvalidMask;
-		tempNodes.push_back(node);
+		ranges.swap(mergedRanges);
 	}
 
-	const u32 rootIndex = buildInternal(tempNodes, 0, (u32)tempNodes.size());
+	u32 mid = ranges[0].mid;
+	if (mid == begin || mid == end)
+	{
+		return splitMedian(context, begin, end, bestAxis);
+	}
+
+	return mid;
+}
 
-	setDepthFirstVisitOrder(tempNodes, rootIndex);
+Box3 calculateBoundsParallel(const BuildContext& context, u32 begin, u32 end)
+{
+	static const u32 ChunkSize = 65536;
 
-	m_nodes.resize(tempNodes.size());
+	const u32 chunkCount = divUp(end - begin, ChunkSize);
 
-	for (u32 oldIndex = 0; oldIndex < (u32)tempNodes.size(); ++oldIndex)
+	std::vector<Box3> chunkBounds(chunkCount);
+	parallelFor(context.scheduler, chunkCount, 1, [&](u32 chunkBegin, u32 chunkEnd)
 	{
-		const TempNode& oldNode = tempNodes[oldIndex];
+		for (u32 chunkIndex = chunkBegin; chunkIndex < chunkEnd; ++chunkIndex)
+		{
+			chunkBounds[chunkIndex] = calculateBounds(context,
+				begin + chunkIndex * ChunkSize,
+				min<u32>(begin + (chunkIndex + 1) * ChunkSize, end));
+		}
+	});
 
-		BVHNode& newNode = m_nodes[oldNode.visitOrder];
+	Box3 bounds = chunkBounds[0];
+	for (const Box3& it : chunkBounds)
+	{
+		bounds.expand(it.m_min);
+		bounds.expand(it.m_max);
+	}
 
-		Vec3 bboxMin(oldNode.bboxMin);
-		Vec3 bboxMax(oldNode.bboxMax);
-		setBounds(newNode, bboxMin, bboxMax);
+	return bounds;
+}
 
-		newNode.prim = oldNode.prim;
-		newNode.next = oldNode.next == BVHNode::InvalidMask
-			? BVHNode::InvalidMask
-			: tempNodes[oldNode.next].visitOrder;
-	}
+u32 split(BuildContext& context, u32 begin, u32 end, const Box3& nodeBounds)
+{
+	const BVHBuilderSettings& settings = context.settings;
 
-	m_packedNodes.reserve(m_nodes.size() + primCount);
+	// Sweep splits keep their own handling of large ranges, so that the default tree does not change
+	if (settings.splitMode == BVHSplitMode::Binned && end - begin > settings.parallelBinningThreshold)
+	{
+		return splitBinnedParallel(context, begin, end);
+	}
 
-	for (u32 i = 0; i < (u32)tempNodes.size(); ++i)
+	switch (settings.splitMode)
 	{
-		const BVHNode& node = m_nodes[i];
+	case BVHSplitMode::Binned:
+		return splitBinned(context, begin, end, settings.binCount);
+	case BVHSplitMode::Sweep:
+	case BVHSplitMode::PresortedSweep: // Presorted lists are only maintained by buildPresorted()
+	default:
+		return splitSweep(context, begin, end, nodeBounds);
+	}
+}
 
-		if (node.isLeaf())
+// Subtree to be built over primitive range [begin, end). Index of its root node is written to link,
+// which points to a child link of the parent node.
+struct BuildItem
+{
+	u32 begin;
+	u32 end;
+	u32 parent;
+	u32* link;
+};
+
+// Places the child with the larger surface area on the left for internal nodes in [begin, end) once all nodes are built
+void orderChildren(std::vector<TempNode>& nodes, u32 begin, u32 end, TaskScheduler* scheduler)
+{
+	parallelFor(scheduler, end - begin, 65536, [&](u32 first, u32 last)
+	{
+		for (u32 i = begin + first; i < begin + last; ++i)
 		{
-			struct BVHPrimitiveNode
+			TempNode& node = nodes[i];
+
+			if (node.isLeaf())
+			{
+				continue;
+			}
+
+			float surfaceAreaLeft = bboxSurfaceArea(nodes[node.left].bboxMin, nodes[node.left].bboxMax);
+			float surfaceAreaRight = bboxSurfaceArea(nodes[node.right].bboxMin, nodes[node.right].bboxMax);
+
+			if (surfaceAreaRight > surfaceAreaLeft)
 			{
-				Vec3 edge0;
-				u32 prim;
-				Vec3 edge1;
-				u32 next;
-			};
+				std::swap(node.left, node.right);
+			}
+		}
+	});
+}
 
-			BVHPrimitiveNode packedNode;
+// Builds subtrees using an explicit work stack, so that depth of the tree is not limited by the call stack.
+// Large subtrees are spawned as tasks, which process their own work stacks.
+void buildSubtrees(BuildContext& context, const BuildItem& rootItem, TaskScheduler::TaskGroup& taskGroup)
+{
+	std::vector<TempNode>& nodes = context.nodes;
+
+	const bool spawnTasks = context.scheduler && context.scheduler->getThreadCount() > 1;
 
-			Vec3 v0 = getVertex(indices[node.prim * 3 + 0]);
-			Vec3 v1 = getVertex(indices[node.prim * 3 + 1]);
-			Vec3 v2 = getVertex(indices[node.prim * 3 + 2]);
+	std::vector<BuildItem> stack;
+	stack.push_back(rootItem);
 
-			packedNode.edge0 = v1 - v0;
-			packedNode.prim = node.prim + (u32)tempNodes.size() * 2;
+	while (!stack.empty())
+	{
+		const BuildItem item = stack.back();
+		stack.pop_back();
 
-			packedNode.edge1 = v2 - v0;
-			packedNode.next = node.next;
+		const u32 count = item.end - item.begin;
 
-			BVHPackedNode data0, data1;
-			memcpy(&data0, &packedNode.edge0, sizeof(BVHPackedNode));
-			memcpy(&data1, &packedNode.edge1, sizeof(BVHPackedNode));
+		u32 nodeId;
 
-			m_packedNodes.push_back(data0);
-			m_packedNodes.push_back(data1);
+		if (count == 1)
+		{
+			nodeId = context.prims[item.begin];
 		}
 		else
 		{
-			BVHNode packedNode;
+			Box3 bounds = count > context.settings.parallelBinningThreshold
+				? calculateBoundsParallel(context, item.begin, item.end)
+				: calculateBounds(context, item.begin, item.end);
 
-			packedNode.bboxMin = node.bboxMin;
-			packedNode.prim = node.prim;
-			packedNode.bboxMax = node.bboxMax;
-			packedNode.next = node.next;
+			const u32 mid = split(context, item.begin, item.end, bounds);
 
-			BVHPackedNode data0, data1;
-			memcpy(&data0, &packedNode.bboxMin, sizeof(BVHPackedNode));
-			memcpy(&data1, &packedNode.bboxMax, sizeof(BVHPackedNode));
+			nodeId = context.primCount + mid - 1;
 
-			m_packedNodes.push_back(data0);
-			m_packedNodes.push_back(data1);
+			TempNode& node = nodes[nodeId];
+			setBounds(node, bounds.m_min, bounds.m_max);
+			node.prim = BVHNode::InvalidMask;
+
+			const BuildItem leftItem = { item.begin, mid, nodeId, &node.left };
+			const BuildItem rightItem = { mid, item.end, nodeId, &node.right };
+
+			stack.push_back(rightItem);
+
+			if (spawnTasks && count >= context.settings.parallelBuildThreshold)
+			{
+				context.scheduler->run(taskGroup, [&context, &taskGroup, leftItem]()
+				{
+					buildSubtrees(context, leftItem, taskGroup);
+				});
+			}
+			else
+			{
+				stack.push_back(leftItem);
+			}
 		}
+
+		nodes[nodeId].parent = item.parent;
+		*item.link = nodeId;
 	}
+}
 
-	for (u32 primId = 0; primId < primCount; ++primId)
+// Leaf nodes occupy slots [0, primCount) and internal nodes occupy [primCount, primCount*2-1).
+// Subtree over primitive range [begin, end) owns internal node slots [primCount+begin, primCount+end-1),
+// which lets independent subtrees be built concurrently without synchronizing node allocation.
+u32 buildInternal(BuildContext& context, u32 begin, u32 end)
+{
+	std::vector<TempNode>& nodes = context.nodes;
+
+	u32 rootId = BVHNode::InvalidMask;
+
+	TaskScheduler::TaskGroup taskGroup;
+	buildSubtrees(context, { begin, end, BVHNode::InvalidMask, &rootId }, taskGroup);
+	if (context.scheduler)
 	{
-		Vec3 v0 = getVertex(indices[primId * 3 + 0]);
-		BVHPackedNode data;
-		memcpy(&data, &v0, sizeof(BVHPackedNode));
-		m_packedNodes.push_back(data);
+		context.scheduler->wait(taskGroup);
 	}
+
+	// Every split position owns one internal node slot, so the subtree uses all of its slots
+
+	orderChildren(nodes, context.primCount + begin, context.primCount + end - 1, context.scheduler);
+
+	return rootId;
+}
+
+// Assigns depth-first visit order and skip pointers using an explicit stack.
+// Returns the number of nodes reachable from the root. Unreachable nodes keep InvalidMask visit order.
+u32 setDepthFirstVisitOrder(std::vector<TempNode>& nodes, u32 root, std::vector<u32>& visitOrder)
+{
+	visitOrder.assign(nodes.size(), u32(BVHNode::InvalidMask));
+
+	struct VisitItem
+	{
+		u32 nodeId;
+		u32 nextId;
+	};
+
+	std::vector<VisitItem> stack;
+	stack.push_back({ root, BVHNode::InvalidMask });
+
+	u32 order = 0;
+
+	while (!stack.empty())
+	{
+		const VisitItem item = stack.back();
+		stack.pop_back();
+
+		TempNode& node = nodes[item.nodeId];
+
+		visitOrder[item.nodeId] = order++;
+		node.next = item.nextId;
+
+		if (node.right != BVHNode::InvalidMask)
+		{
+			stack.push_back({ node.right, item.nextId });
+		}
+
+		if (node.left != BVHNode::InvalidMask)
+		{
+			stack.push_back({ node.left, node.right });
+		}
+	}
+
+	return order;
+}
+
+// Replaces depth-first visit order with an order where treelets of up to treeletSize nodes are stored contiguously.
+// Treelet is grown from its root by adding the candidate with the largest surface area, which is the node most likely
+// to be visited by a ray. Left child must directly follow its parent for stackless traversal, so the whole chain of
+// left children is added with every node. Candidates that did not fit become roots of later treelets, which are laid
+// out in depth-first order of their roots. Skip pointers set by setDepthFirstVisitOrder() remain valid.
+void setTreeletVisitOrder(const std::vector<TempNode>& nodes, u32 root, u32 treeletSize, std::vector<u32>& visitOrder)
+{
+	const std::vector<u32> depthFirstOrder = visitOrder;
+
+	struct Candidate
+	{
+		float surfaceArea;
+		u32 nodeId;
+
+		bool operator < (const Candidate& other) const
+		{
+			return surfaceArea < other.surfaceArea || (surfaceArea == other.surfaceArea && nodeId > other.nodeId);
+		}
+	};
+
+	std::vector<u8> inTreelet(nodes.size(), 0);
+	std::vector<u32> treeletRoots;
+	std::vector<Candidate> candidates;
+	std::vector<u32> stack;
+
+	treeletRoots.push_back(root);
+
+	u32 order = 0;
+
+	while (!treeletRoots.empty())
+	{
+		const u32 treeletRoot = treeletRoots.back();
+		treeletRoots.pop_back();
+
+		candidates.clear();
+		candidates.push_back({ 0.0f, treeletRoot });
+
+		u32 memberCount = 0;
+		while (!candidates.empty() && memberCount < treeletSize)
+		{
+			std::pop_heap(candidates.begin(), candidates.end());
+			const u32 candidateId = candidates.back().nodeId;
+			candidates.pop_back();
+
+			for (u32 nodeId = candidateId; nodeId != BVHNode::InvalidMask; nodeId = nodes[nodeId].left)
+			{
+				inTreelet[nodeId] = 1;
+				++memberCount;
+
+				const u32 right = nodes[nodeId].right;
+				if (right != BVHNode::InvalidMask)
+				{
+					candidates.push_back({ bboxSurfaceArea(nodes[right].bboxMin, nodes[right].bboxMax), right });
+					std::push_heap(candidates.begin(), candidates.end());
+				}
+			}
+		}
+
+		// Remaining roots are popped from the back, so new ones are sorted by decreasing depth-first order
+		const size_t firstNewRoot = treeletRoots.size();
+		for (const Candidate& candidate : candidates)
+		{
+			treeletRoots.push_back(candidate.nodeId);
+		}
+		std::sort(treeletRoots.begin() + firstNewRoot, treeletRoots.end(), [&](u32 a, u32 b)
+		{
+			return depthFirstOrder[a] > depthFirstOrder[b];
+		});
+
+		// Nodes within the treelet are stored in depth-first order
+		stack.push_back(treeletRoot);
+		while (!stack.empty())
+		{
+			const u32 nodeId = stack.back();
+			stack.pop_back();
+
+			visitOrder[nodeId] = order++;
+
+			const TempNode& node = nodes[nodeId];
+
+			if (node.right != BVHNode::InvalidMask && inTreelet[node.right])
+			{
+				stack.push_back(node.right);
+			}
+
+			if (node.left != BVHNode::InvalidMask)
+			{
+				stack.push_back(node.left);
+			}
+		}
+	}
+}
+
+// Computes internal node bounds from its children and places the child with larger surface area on the left
+void setInternalNode(std::vector<TempNode>& nodes, u32 nodeId, u32 left, u32 right)
+{
+	TempNode& node = nodes[nodeId];
+	const TempNode& leftNode = nodes[left];
+	const TempNode& rightNode = nodes[right];
+
+	__m128 bboxMin = _mm_min_ps(_mm_loadu_ps(&leftNode.bboxMin.x), _mm_loadu_ps(&rightNode.bboxMin.x));
+	__m128 bboxMax = _mm_max_ps(_mm_loadu_ps(&leftNode.bboxMax.x), _mm_loadu_ps(&rightNode.bboxMax.x));
+
+	Box3 bounds(extractVec3(bboxMin), extractVec3(bboxMax));
+
+	float surfaceAreaLeft = bboxSurfaceArea(leftNode.bboxMin, leftNode.bboxMax);
+	float surfaceAreaRight = bboxSurfaceArea(rightNode.bboxMin, rightNode.bboxMax);
+
+	node.left = left;
+	node.right = right;
+
+	if (surfaceAreaRight > surfaceAreaLeft)
+	{
+		std::swap(node.left, node.right);
+	}
+
+	setBounds(node, bounds.m_min, bounds.m_max);
+	node.prim = BVHNode::InvalidMask;
+
+	nodes[left].parent = nodeId;
+	nodes[right].parent = nodeId;
+}
+
+inline u32 countLeadingZeros(u64 v)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	return _BitScanReverse64(&index, v) ? 63 - index : 64;
+#else
+	return v ? __builtin_clzll(v) : 64;
+#endif
+}
+
+inline u64 expandBits10(u64 v)
+{
+	v &= 0x3ff;
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+inline u64 expandBits21(u64 v)
+{
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffffull;
+	v = (v | v << 16) & 0x1f0000ff0000ffull;
+	v = (v | v << 8) & 0x100f00f00f00f00full;
+	v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+	v = (v | v << 2) & 0x1249249249249249ull;
+	return v;
+}
+
+// Position must be normalized to [0, 1] range
+inline u64 calculateMortonCode(const Vec3& position, u32 mortonCodeBits)
+{
+	if (mortonCodeBits == 30)
+	{
+		const float scale = 1023.0f;
+		return (expandBits10(u64(position.x * scale)) << 2)
+			| (expandBits10(u64(position.y * scale)) << 1)
+			| expandBits10(u64(position.z * scale));
+	}
+	else
+	{
+		const float scale = 2097151.0f;
+		return (expandBits21(u64(position.x * scale)) << 2)
+			| (expandBits21(u64(position.y * scale)) << 1)
+			| expandBits21(u64(position.z * scale));
+	}
+}
+
+struct MortonPrimitive
+{
+	u64 code;
+	u32 prim;
+};
+
+// LSD radix sort of items by their integer code, using 8 bit digits.
+// Sort is stable and passes where all keys share the same digit are skipped.
+template <typename Item>
+void radixSort(std::vector<Item>& items)
+{
+	const u32 count = (u32)items.size();
+	const u32 keyBits = sizeof(items[0].code) * 8;
+
+	std::vector<Item> temp(count);
+
+	for (u32 shift = 0; shift < keyBits; shift += 8)
+	{
+		u32 histogram[256] = {};
+		for (const Item& it : items)
+		{
+			histogram[(it.code >> shift) & 0xFF]++;
+		}
+
+		if (histogram[(items[0].code >> shift) & 0xFF] == count)
+		{
+			continue;
+		}
+
+		u32 offset = 0;
+		for (u32& it : histogram)
+		{
+			u32 bucketCount = it;
+			it = offset;
+			offset += bucketCount;
+		}
+
+		for (const Item& it : items)
+		{
+			temp[histogram[(it.code >> shift) & 0xFF]++] = it;
+		}
+
+		items.swap(temp);
+	}
+}
+
+// Sorts leaf nodes along a Morton curve through their centroids.
+// Returns sorted codes. Leaf nodes in [0, primCount) are reordered to match.
+std::vector<MortonPrimitive> sortLeavesByMortonCode(std::vector<TempNode>& nodes, u32 primCount, u32 mortonCodeBits, TaskScheduler* scheduler)
+{
+	Box3 centroidBounds;
+	centroidBounds.expandInit();
+	for (u32 i = 0; i < primCount; ++i)
+	{
+		centroidBounds.expand(getCenter(nodes[i]));
+	}
+
+	Vec3 centroidExtents = centroidBounds.dimensions();
+	Vec3 scale;
+	for (u32 axis = 0; axis < 3; ++axis)
+	{
+		scale[axis] = centroidExtents[axis] > 0.0f ? 1.0f / centroidExtents[axis] : 0.0f;
+	}
+
+	std::vector<MortonPrimitive> mortonPrims(primCount);
+	parallelFor(scheduler, primCount, 65536, [&](u32 begin, u32 end)
+	{
+		for (u32 i = begin; i < end; ++i)
+		{
+			Vec3 position = (getCenter(nodes[i]) - centroidBounds.m_min) * scale;
+			mortonPrims[i].code = calculateMortonCode(position, mortonCodeBits);
+			mortonPrims[i].prim = i;
+		}
+	});
+
+	radixSort(mortonPrims);
+
+	std::vector<TempNode> sortedLeaves(primCount);
+	parallelFor(scheduler, primCount, 65536, [&](u32 begin, u32 end)
+	{
+		for (u32 i = begin; i < end; ++i)
+		{
+			sortedLeaves[i] = nodes[mortonPrims[i].prim];
+		}
+	});
+
+	std::copy(sortedLeaves.begin(), sortedLeaves.end(), nodes.begin());
+
+	return mortonPrims;
+}
+
+// Builds a binary radix tree over sorted Morton codes [Karras 2012].
+// Internal node i is stored at primCount+i and covers a key range that starts or ends at leaf i,
+// so all internal nodes can be emitted independently. Node bounds are then propagated bottom-up,
+// where the second thread to arrive at a node computes its bounds.
+u32 buildRadixTree(std::vector<TempNode>& nodes, const std::vector<MortonPrimitive>& mortonPrims, TaskScheduler* scheduler)
+{
+	const u32 primCount = (u32)mortonPrims.size();
+
+	if (primCount == 1)
+	{
+		return 0;
+	}
+
+	// Length of the common prefix of keys i and j, where equal codes are disambiguated by index
+	auto delta = [&](u32 i, i64 j) -> int
+	{
+		if (j < 0 || j >= (i64)primCount)
+		{
+			return -1;
+		}
+
+		u64 a = mortonPrims[i].code;
+		u64 b = mortonPrims[j].code;
+
+		if (a != b)
+		{
+			return (int)countLeadingZeros(a ^ b);
+		}
+		else
+		{
+			return 64 + (int)countLeadingZeros(u64(i ^ (u32)j) << 32);
+		}
+	};
+
+	nodes[primCount].parent = BVHNode::InvalidMask;
+
+	parallelFor(scheduler, primCount - 1, 16384, [&](u32 begin, u32 end)
+	{
+		for (u32 i = begin; i < end; ++i)
+		{
+			const int direction = delta(i, i64(i) + 1) > delta(i, i64(i) - 1) ? 1 : -1;
+			const int deltaMin = delta(i, i64(i) - direction);
+
+			i64 lengthMax = 2;
+			while (delta(i, i64(i) + lengthMax * direction) > deltaMin)
+			{
+				lengthMax *= 2;
+			}
+
+			i64 length = 0;
+			for (i64 t = lengthMax / 2; t >= 1; t /= 2)
+			{
+				if (delta(i, i64(i) + (length + t) * direction) > deltaMin)
+				{
+					length += t;
+				}
+			}
+
+			const i64 j = i64(i) + length * direction;
+			const int deltaNode = delta(i, j);
+
+			i64 splitOffset = 0;
+			for (i64 divisor = 2; ; divisor *= 2)
+			{
+				i64 t = (length + divisor - 1) / divisor;
+				if (delta(i, i64(i) + (splitOffset + t) * direction) > deltaNode)
+				{
+					splitOffset += t;
+				}
+				if (t == 1)
+				{
+					break;
+				}
+			}
+
+			const u32 gamma = u32(i64(i) + splitOffset * direction + min<i64>(direction, 0));
+			const u32 rangeMin = u32(min<i64>(i, j));
+			const u32 rangeMax = u32(max<i64>(i, j));
+
+			TempNode& node = nodes[primCount + i];
+			node.left = rangeMin == gamma ? gamma : primCount + gamma;
+			node.right = rangeMax == gamma + 1 ? gamma + 1 : primCount + gamma + 1;
+			node.prim = BVHNode::InvalidMask;
+
+			nodes[node.left].parent = primCount + i;
+			nodes[node.right].parent = primCount + i;
+		}
+	});
+
+	std::vector<std::atomic<u32>> visitCounts(primCount - 1);
+
+	parallelFor(scheduler, primCount, 16384, [&](u32 begin, u32 end)
+	{
+		for (u32 i = begin; i < end; ++i)
+		{
+			u32 nodeId = nodes[i].parent;
+			while (nodeId != BVHNode::InvalidMask)
+			{
+				if (visitCounts[nodeId - primCount].fetch_add(1) == 0)
+				{
+					break;
+				}
+
+				const TempNode& node = nodes[nodeId];
+				setInternalNode(nodes, nodeId, node.left, node.right);
+				nodeId = node.parent;
+			}
+		}
+	});
+
+	return primCount;
+}
+
+u32 buildLinear(std::vector<TempNode>& nodes, u32 primCount, const BVHBuilderSettings& settings, TaskScheduler* scheduler)
+{
+	std::vector<MortonPrimitive> mortonPrims = sortLeavesByMortonCode(nodes, primCount, settings.mortonCodeBits, scheduler);
+	return buildRadixTree(nodes, mortonPrims, scheduler);
+}
+
+struct ClusterNode
+{
+	Box3 bounds;
+	Vec3 center;
+	u32 nodeId;
+};
+
+// Top-down SAH sweep over a small set of prebuilt subtrees.
+// Subtree over range [begin, end) takes internal node slots from freeSlots[begin, end-1).
+u32 buildClusterHierarchy(std::vector<TempNode>& nodes, std::vector<ClusterNode>& clusters, u32 begin, u32 end, const std::vector<u32>& freeSlots)
+{
+	const u32 count = end - begin;
+
+	if (count == 1)
+	{
+		return clusters[begin].nodeId;
+	}
+
+	std::vector<float> surfaceAreaRight(count);
+
+	u32 bestAxis = 0;
+	u32 bestSplit = begin + count / 2;
+	float bestCost = FLT_MAX;
+
+	for (u32 axis = 0; axis < 3; ++axis)
+	{
+		std::sort(clusters.begin() + begin, clusters.begin() + end,
+			[&](const ClusterNode& a, const ClusterNode& b)
+		{
+			return a.center[axis] < b.center[axis];
+		});
+
+		Box3 boundsRight;
+		boundsRight.expandInit();
+		for (u32 i = count - 1; i > 0; --i)
+		{
+			boundsRight.expand(clusters[begin + i].bounds.m_min);
+			boundsRight.expand(clusters[begin + i].bounds.m_max);
+			surfaceAreaRight[i] = bboxSurfaceArea(boundsRight);
+		}
+
+		Box3 boundsLeft;
+		boundsLeft.expandInit();
+		for (u32 i = 1; i < count; ++i)
+		{
+			boundsLeft.expand(clusters[begin + i - 1].bounds.m_min);
+			boundsLeft.expand(clusters[begin + i - 1].bounds.m_max);
+
+			float cost = bboxSurfaceArea(boundsLeft) * (float)i + surfaceAreaRight[i] * (float)(count - i);
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = begin + i;
+			}
+		}
+	}
+
+	std::sort(clusters.begin() + begin, clusters.begin() + end,
+		[&](const ClusterNode& a, const ClusterNode& b)
+	{
+		return a.center[bestAxis] < b.center[bestAxis];
+	});
+
+	const u32 nodeId = freeSlots[bestSplit - 1];
+
+	u32 left = buildClusterHierarchy(nodes, clusters, begin, bestSplit, freeSlots);
+	u32 right = buildClusterHierarchy(nodes, clusters, bestSplit, end, freeSlots);
+
+	setInternalNode(nodes, nodeId, left, right);
+
+	return nodeId;
+}
+
+// Hierarchical LBVH [Garanzha et al. 2011].
+// Primitives are sorted by Morton code and grouped into clusters that share a code prefix.
+// Each cluster is built with top-down SAH in parallel, then a SAH hierarchy is built over cluster roots.
+// Cluster over primitive range [begin, end) owns internal node slots [primCount+begin, primCount+end-1),
+// leaving slot primCount+end-1 free for the top level hierarchy.
+u32 buildHierarchicalLinear(std::vector<TempNode>& nodes, u32 primCount, const BVHBuilderSettings& settings, TaskScheduler* scheduler)
+{
+	std::vector<MortonPrimitive> mortonPrims = sortLeavesByMortonCode(nodes, primCount, settings.mortonCodeBits, scheduler);
+
+	const u32 clusterShift = settings.mortonCodeBits - min<u32>(settings.clusterBits, settings.mortonCodeBits);
+
+	struct ClusterRange
+	{
+		u32 begin;
+		u32 end;
+	};
+
+	std::vector<ClusterRange> clusterRanges;
+	for (u32 begin = 0; begin < primCount;)
+	{
+		const u64 prefix = mortonPrims[begin].code >> clusterShift;
+		u32 end = begin + 1;
+		while (end < primCount && (mortonPrims[end].code >> clusterShift) == prefix)
+		{
+			++end;
+		}
+		clusterRanges.push_back({ begin, end });
+		begin = end;
+	}
+
+	mortonPrims.clear();
+	mortonPrims.shrink_to_fit();
+
+	const u32 clusterCount = (u32)clusterRanges.size();
+
+	std::vector<ClusterNode> clusters(clusterCount);
+	std::vector<u32> freeSlots(clusterCount - 1);
+
+	BuildContext context = { nodes, settings, scheduler, primCount };
+
+	parallelFor(scheduler, clusterCount, 1, [&](u32 clusterBegin, u32 clusterEnd)
+	{
+		for (u32 clusterIndex = clusterBegin; clusterIndex < clusterEnd; ++clusterIndex)
+		{
+			const ClusterRange& range = clusterRanges[clusterIndex];
+
+			ClusterNode& cluster = clusters[clusterIndex];
+			cluster.nodeId = buildInternal(context, range.begin, range.end);
+
+			const TempNode& root = nodes[cluster.nodeId];
+			cluster.bounds = Box3(root.bboxMin, root.bboxMax);
+			cluster.center = cluster.bounds.center();
+
+			if (clusterIndex + 1 < clusterCount)
+			{
+				freeSlots[clusterIndex] = primCount + range.end - 1;
+			}
+		}
+	});
+
+	u32 rootIndex = buildClusterHierarchy(nodes, clusters, 0, clusterCount, freeSlots);
+	nodes[rootIndex].parent = BVHNode::InvalidMask;
+
+	return rootIndex;
+}
+
+// Maps float to an unsigned integer with the same ordering
+inline u32 floatToSortableKey(float f)
+{
+	u32 u;
+	memcpy(&u, &f, sizeof(u));
+	return (u & 0x80000000) ? ~u : (u | 0x80000000);
+}
+
+struct AxisKey
+{
+	u32 code;
+	u32 prim;
+};
+
+// Top-down SAH sweep where primitives are sorted along each axis only once, up front.
+// Every node keeps 3 lists of primitive indices sorted by centroid along each axis.
+// After the best split is found along one axis, the other two lists are partitioned stably,
+// so they remain sorted. Leaf nodes are never moved, only 32 bit indices are.
+struct PresortedBuildContext
+{
+	std::vector<TempNode>& nodes;
+	const BVHBuilderSettings& settings;
+	TaskScheduler* scheduler;
+	u32 primCount;
+
+	std::vector<u32> sortedPrims[3];
+
+	// Scratch data is indexed by list position or by primitive, which are disjoint between subtrees
+	std::vector<float> surfaceAreaRight;
+	std::vector<u32> partitionScratch;
+	std::vector<u8> primIsLeft;
+
+	PresortedBuildContext(std::vector<TempNode>& inNodes, const BVHBuilderSettings& inSettings, TaskScheduler* inScheduler, u32 inPrimCount)
+		: nodes(inNodes), settings(inSettings), scheduler(inScheduler), primCount(inPrimCount)
+	{
+	}
+};
+
+// Finds the best SAH split of lists [begin, end) along all axes and partitions them, so that every list
+// remains sorted within both halves. Returns the split position and bounds of the whole range.
+u32 splitPresorted(PresortedBuildContext& context, u32 begin, u32 end, Box3& outBounds)
+{
+	const std::vector<TempNode>& nodes = context.nodes;
+
+	u32 bestAxis = 0;
+	u32 bestSplit = begin;
+	float bestCost = FLT_MAX;
+
+	for (u32 axis = 0; axis < 3; ++axis)
+	{
+		const u32* prims = context.sortedPrims[axis].data();
+
+		__m128 bboxMin = _mm_set1_ps(FLT_MAX);
+		__m128 bboxMax = _mm_set1_ps(-FLT_MAX);
+		for (u32 i = end - 1; i > begin; --i)
+		{
+			const TempNode& node = nodes[prims[i]];
+			bboxMin = _mm_min_ps(bboxMin, _mm_loadu_ps(&node.bboxMin.x));
+			bboxMax = _mm_max_ps(bboxMax, _mm_loadu_ps(&node.bboxMax.x));
+			context.surfaceAreaRight[i] = bboxSurfaceArea(extractVec3(bboxMin), extractVec3(bboxMax));
+		}
+
+		bboxMin = _mm_set1_ps(FLT_MAX);
+		bboxMax = _mm_set1_ps(-FLT_MAX);
+		for (u32 mid = begin + 1; mid < end; ++mid)
+		{
+			const TempNode& node = nodes[prims[mid - 1]];
+			bboxMin = _mm_min_ps(bboxMin, _mm_loadu_ps(&node.bboxMin.x));
+			bboxMax = _mm_max_ps(bboxMax, _mm_loadu_ps(&node.bboxMax.x));
+
+			float surfaceAreaLeft = bboxSurfaceArea(extractVec3(bboxMin), extractVec3(bboxMax));
+			float cost = surfaceAreaLeft * (float)(mid - begin) + context.surfaceAreaRight[mid] * (float)(end - mid);
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = mid;
+			}
+		}
+
+		if (axis == 0)
+		{
+			const TempNode& node = nodes[prims[end - 1]];
+			bboxMin = _mm_min_ps(bboxMin, _mm_loadu_ps(&node.bboxMin.x));
+			bboxMax = _mm_max_ps(bboxMax, _mm_loadu_ps(&node.bboxMax.x));
+			outBounds = Box3(extractVec3(bboxMin), extractVec3(bboxMax));
+		}
+	}
+
+	const u32 mid = bestSplit;
+
+	{
+		const u32* prims = context.sortedPrims[bestAxis].data();
+		for (u32 i = begin; i < end; ++i)
+		{
+			context.primIsLeft[prims[i]] = i < mid;
+		}
+	}
+
+	for (u32 axis = 0; axis < 3; ++axis)
+	{
+		if (axis == bestAxis)
+		{
+			continue;
+		}
+
+		u32* prims = context.sortedPrims[axis].data();
+		u32 leftIndex = begin;
+		u32 rightIndex = mid;
+		for (u32 i = begin; i < end; ++i)
+		{
+			if (context.primIsLeft[prims[i]])
+			{
+				prims[leftIndex++] = prims[i];
+			}
+			else
+			{
+				context.partitionScratch[rightIndex++] = prims[i];
+			}
+		}
+
+		std::copy(context.partitionScratch.begin() + mid, context.partitionScratch.begin() + end, prims + mid);
+	}
+
+	return mid;
+}
+
+// Same node slot assignment and work stack scheme as buildSubtrees()
+void buildPresortedSubtrees(PresortedBuildContext& context, const BuildItem& rootItem, TaskScheduler::TaskGroup& taskGroup)
+{
+	std::vector<TempNode>& nodes = context.nodes;
+
+	const bool spawnTasks = context.scheduler && context.scheduler->getThreadCount() > 1;
+
+	std::vector<BuildItem> stack;
+	stack.push_back(rootItem);
+
+	while (!stack.empty())
+	{
+		const BuildItem item = stack.back();
+		stack.pop_back();
+
+		const u32 count = item.end - item.begin;
+
+		u32 nodeId;
+
+		if (count == 1)
+		{
+			nodeId = context.sortedPrims[0][item.begin];
+		}
+		else
+		{
+			Box3 bounds;
+			const u32 mid = splitPresorted(context, item.begin, item.end, bounds);
+
+			nodeId = context.primCount + mid - 1;
+
+			TempNode& node = nodes[nodeId];
+			setBounds(node, bounds.m_min, bounds.m_max);
+			node.prim = BVHNode::InvalidMask;
+
+			const BuildItem leftItem = { item.begin, mid, nodeId, &node.left };
+			const BuildItem rightItem = { mid, item.end, nodeId, &node.right };
+
+			stack.push_back(rightItem);
+
+			if (spawnTasks && count >= context.settings.parallelBuildThreshold)
+			{
+				context.scheduler->run(taskGroup, [&context, &taskGroup, leftItem]()
+				{
+					buildPresortedSubtrees(context, leftItem, taskGroup);
+				});
+			}
+			else
+			{
+				stack.push_back(leftItem);
+			}
+		}
+
+		nodes[nodeId].parent = item.parent;
+		*item.link = nodeId;
+	}
+}
+
+u32 buildPresorted(std::vector<TempNode>& nodes, u32 primCount, const BVHBuilderSettings& settings, TaskScheduler* scheduler)
+{
+	PresortedBuildContext context(nodes, settings, scheduler, primCount);
+
+	TaskScheduler::TaskGroup taskGroup;
+	for (u32 axis = 0; axis < 3; ++axis)
+	{
+		auto sortAxis = [&context, &nodes, primCount, axis]()
+		{
+			std::vector<AxisKey> keys(primCount);
+			for (u32 i = 0; i < primCount; ++i)
+			{
+				keys[i].code = floatToSortableKey(getCenter(nodes[i])[axis]);
+				keys[i].prim = i;
+			}
+
+			radixSort(keys);
+
+			context.sortedPrims[axis].resize(primCount);
+			for (u32 i = 0; i < primCount; ++i)
+			{
+				context.sortedPrims[axis][i] = keys[i].prim;
+			}
+		};
+
+		if (scheduler)
+		{
+			scheduler->run(taskGroup, sortAxis);
+		}
+		else
+		{
+			sortAxis();
+		}
+	}
+
+	if (scheduler)
+	{
+		scheduler->wait(taskGroup);
+	}
+
+	context.surfaceAreaRight.resize(primCount);
+	context.partitionScratch.resize(primCount);
+	context.primIsLeft.resize(primCount);
+
+	u32 rootId = BVHNode::InvalidMask;
+
+	buildPresortedSubtrees(context, { 0, primCount, BVHNode::InvalidMask, &rootId }, taskGroup);
+	if (scheduler)
+	{
+		scheduler->wait(taskGroup);
+	}
+
+	orderChildren(nodes, primCount, primCount * 2 - 1, scheduler);
+
+	return rootId;
+}
+
+inline u64 hashPair(u32 a, u32 b)
+{
+	// SplitMix64 finalizer
+	u64 v = (u64(a) << 32) | b;
+	v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ull;
+	v = (v ^ (v >> 27)) * 0x94d049bb133111ebull;
+	return v ^ (v >> 31);
+}
+
+// Parallel locally-ordered clustering [Meister and Bittner 2018].
+// Clusters start as Morton-sorted leaves. In each iteration, every cluster finds its nearest neighbor
+// (smallest union surface area) within a window of radius clusters on either side.
+// Mutual nearest neighbors are merged and the cluster array is compacted.
+// Merge and compaction offsets come from per-chunk prefix sums, so the result does not depend on thread count.
+u32 buildPloc(std::vector<TempNode>& nodes, u32 primCount, const BVHBuilderSettings& settings, TaskScheduler* scheduler)
+{
+	static const u32 ChunkSize = 4096;
+
+	sortLeavesByMortonCode(nodes, primCount, settings.mortonCodeBits, scheduler);
+
+	const u32 radius = max<u32>(1, settings.plocRadius);
+
+	std::vector<u32> clusters(primCount);
+	for (u32 i = 0; i < primCount; ++i)
+	{
+		clusters[i] = i;
+	}
+
+	std::vector<u32> neighbors;
+	std::vector<u32> mergedClusters;
+	std::vector<u32> chunkMergeOffsets;
+	std::vector<u32> chunkClusterOffsets;
+
+	u32 nextNodeId = primCount;
+
+	while (clusters.size() > 1)
+	{
+		const u32 clusterCount = (u32)clusters.size();
+
+		neighbors.resize(clusterCount);
+		parallelFor(scheduler, clusterCount, 1024, [&](u32 begin, u32 end)
+		{
+			for (u32 i = begin; i < end; ++i)
+			{
+				const TempNode& node = nodes[clusters[i]];
+				const __m128 bboxMin = _mm_loadu_ps(&node.bboxMin.x);
+				const __m128 bboxMax = _mm_loadu_ps(&node.bboxMax.x);
+
+				const u32 searchBegin = i > radius ? i - radius : 0;
+				const u32 searchEnd = min<u32>(i + radius + 1, clusterCount);
+
+				// Pairs are ordered by union surface area, then by a symmetric hash of their indices.
+				// This is a strict total order on pairs, so the best pair overall is always mutual.
+				// Hashing (rather than preferring lower indices) keeps runs of identical boxes
+				// from being merged one pair per iteration.
+				float bestSurfaceArea = FLT_MAX;
+				u64 bestPairKey = ~0ull;
+				u32 bestNeighbor = BVHNode::InvalidMask;
+				for (u32 j = searchBegin; j < searchEnd; ++j)
+				{
+					if (j == i)
+					{
+						continue;
+					}
+
+					const TempNode& other = nodes[clusters[j]];
+					const __m128 unionMin = _mm_min_ps(bboxMin, _mm_loadu_ps(&other.bboxMin.x));
+					const __m128 unionMax = _mm_max_ps(bboxMax, _mm_loadu_ps(&other.bboxMax.x));
+					const float surfaceArea = bboxSurfaceArea(extractVec3(unionMin), extractVec3(unionMax));
+					if (surfaceArea > bestSurfaceArea)
+					{
+						continue;
+					}
+
+					const u64 pairKey = hashPair(min(i, j), max(i, j));
+					if (surfaceArea < bestSurfaceArea || pairKey < bestPairKey
+						|| (pairKey == bestPairKey && min(i, j) < min(i, bestNeighbor)))
+					{
+						bestSurfaceArea = surfaceArea;
+						bestPairKey = pairKey;
+						bestNeighbor = j;
+					}
+				}
+
+				neighbors[i] = bestNeighbor;
+			}
+		});
+
+		// Cluster at the lower index of a mutual pair is replaced by the merged node, the other one is removed
+		auto isMergeSource = [&](u32 i) { return neighbors[neighbors[i]] == i && i < neighbors[i]; };
+		auto isRemoved = [&](u32 i) { return neighbors[neighbors[i]] == i && i > neighbors[i]; };
+
+		const u32 chunkCount = divUp(clusterCount, ChunkSize);
+		chunkMergeOffsets.resize(chunkCount + 1);
+		chunkClusterOffsets.resize(chunkCount + 1);
+
+		parallelFor(scheduler, chunkCount, 1, [&](u32 chunkBegin, u32 chunkEnd)
+		{
+			for (u32 chunkIndex = chunkBegin; chunkIndex < chunkEnd; ++chunkIndex)
+			{
+				u32 mergeCount = 0;
+				u32 removedCount = 0;
+				const u32 end = min<u32>((chunkIndex + 1) * ChunkSize, clusterCount);
+				for (u32 i = chunkIndex * ChunkSize; i < end; ++i)
+				{
+					mergeCount += isMergeSource(i);
+					removedCount += isRemoved(i);
+				}
+				chunkMergeOffsets[chunkIndex + 1] = mergeCount;
+				chunkClusterOffsets[chunkIndex + 1] = end - chunkIndex * ChunkSize - removedCount;
+			}
+		});
+
+		chunkMergeOffsets[0] = 0;
+		chunkClusterOffsets[0] = 0;
+		for (u32 chunkIndex = 0; chunkIndex < chunkCount; ++chunkIndex)
+		{
+			chunkMergeOffsets[chunkIndex + 1] += chunkMergeOffsets[chunkIndex];
+			chunkClusterOffsets[chunkIndex + 1] += chunkClusterOffsets[chunkIndex];
+		}
+
+		mergedClusters.resize(chunkClusterOffsets[chunkCount]);
+
+		parallelFor(scheduler, chunkCount, 1, [&](u32 chunkBegin, u32 chunkEnd)
+		{
+			for (u32 chunkIndex = chunkBegin; chunkIndex < chunkEnd; ++chunkIndex)
+			{
+				u32 nodeId = nextNodeId + chunkMergeOffsets[chunkIndex];
+				u32 outputIndex = chunkClusterOffsets[chunkIndex];
+				const u32 end = min<u32>((chunkIndex + 1) * ChunkSize, clusterCount);
+				for (u32 i = chunkIndex * ChunkSize; i < end; ++i)
+				{
+					if (isMergeSource(i))
+					{
+						setInternalNode(nodes, nodeId, clusters[i], clusters[neighbors[i]]);
+						mergedClusters[outputIndex++] = nodeId++;
+					}
+					else if (!isRemoved(i))
+					{
+						mergedClusters[outputIndex++] = clusters[i];
+					}
+				}
+			}
+		});
+
+		nextNodeId += chunkMergeOffsets[chunkCount];
+
+		RUSH_ASSERT(mergedClusters.size() < clusters.size());
+
+		clusters.swap(mergedClusters);
+	}
+
+	const u32 rootIndex = clusters[0];
+	nodes[rootIndex].parent = BVHNode::InvalidMask;
+
+	return rootIndex;
+}
+
+struct TriangleList
+{
+	const float* vertices;
+	u32 stride;
+	const u32* indices;
+
+	Vec3 getVertex(u32 prim, u32 corner) const
+	{
+		return Vec3(vertices + stride * indices[prim * 3 + corner]);
+	}
+};
+
+// Bounds of the part of a triangle that lies between two planes perpendicular to axis
+Box3 clipTriangleBounds(const TriangleList& triangles, u32 prim, u32 axis, float planeMin, float planeMax)
+{
+	Vec3 v[3] =
+	{
+		triangles.getVertex(prim, 0),
+		triangles.getVertex(prim, 1),
+		triangles.getVertex(prim, 2),
+	};
+
+	Box3 result;
+	result.expandInit();
+
+	for (u32 i = 0; i < 3; ++i)
+	{
+		const Vec3& a = v[i];
+		const Vec3& b = v[(i + 1) % 3];
+
+		if (a[axis] >= planeMin && a[axis] <= planeMax)
+		{
+			result.expand(a);
+		}
+
+		const float planes[2] = { planeMin, planeMax };
+		for (float plane : planes)
+		{
+			if ((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane))
+			{
+				float t = (plane - a[axis]) / (b[axis] - a[axis]);
+				Vec3 p = a + (b - a) * t;
+				p[axis] = plane;
+				result.expand(p);
+			}
+		}
+	}
+
+	return result;
+}
+
+inline Box3 intersectBounds(const Box3& a, const Box3& b)
+{
+	Box3 result;
+	for (u32 axis = 0; axis < 3; ++axis)
+	{
+		result.m_min[axis] = max(a.m_min[axis], b.m_min[axis]);
+		result.m_max[axis] = min(a.m_max[axis], b.m_max[axis]);
+	}
+	return result;
+}
+
+inline void expandBounds(Box3& box, const Box3& other)
+{
+	box.expand(other.m_min);
+	box.expand(other.m_max);
+}
+
+inline bool isEmpty(const Box3& box)
+{
+	return box.m_min.x > box.m_max.x || box.m_min.y > box.m_max.y || box.m_min.z > box.m_max.z;
+}
+
+// Triangle reference, which may be clipped to a part of the original triangle bounds
+struct SpatialReference
+{
+	Box3 bounds;
+	u32 prim;
+};
+
+struct SpatialSplitContext
+{
+	TriangleList triangles;
+	const BVHBuilderSettings& settings;
+	TaskScheduler* scheduler;
+	std::vector<TempNode>& outNodes;
+	float minOverlapArea;
+
+	SpatialSplitContext(const TriangleList& inTriangles, const BVHBuilderSettings& inSettings, TaskScheduler* inScheduler,
+		std::vector<TempNode>& inOutNodes, float inMinOverlapArea)
+		: triangles(inTriangles), settings(inSettings), scheduler(inScheduler), outNodes(inOutNodes)
+		, minOverlapArea(inMinOverlapArea)
+	{
+	}
+};
+
+struct ObjectSplit
+{
+	u32 axis = 0;
+	u32 mid = 0;
+	float cost = FLT_MAX;
+	Box3 boundsLeft;
+	Box3 boundsRight;
+};
+
+struct SpatialSplit
+{
+	u32 axis = 0;
+	float position = 0.0f;
+	float cost = FLT_MAX;
+};
+
+void sortReferences(std::vector<SpatialReference>& refs, u32 axis)
+{
+	std::sort(refs.begin(), refs.end(),
+		[axis](const SpatialReference& a, const SpatialReference& b)
+	{
+		float centerA = a.bounds.m_min[axis] + a.bounds.m_max[axis];
+		float centerB = b.bounds.m_min[axis] + b.bounds.m_max[axis];
+		return centerA < centerB || (centerA == centerB && a.prim < b.prim);
+	});
+}
+
+ObjectSplit findObjectSplit(std::vector<SpatialReference>& refs, std::vector<float>& surfaceAreaRight)
+{
+	const u32 count = (u32)refs.size();
+
+	ObjectSplit result;
+
+	surfaceAreaRight.resize(max<size_t>(surfaceAreaRight.size(), count));
+
+	for (u32 axis = 0; axis < 3; ++axis)
+	{
+		sortReferences(refs, axis);
+
+		Box3 boundsRight;
+		boundsRight.expandInit();
+		for (u32 i = count - 1; i > 0; --i)
+		{
+			expandBounds(boundsRight, refs[i].bounds);
+			surfaceAreaRight[i] = bboxSurfaceArea(boundsRight);
+		}
+
+		Box3 boundsLeft;
+		boundsLeft.expandInit();
+		for (u32 mid = 1; mid < count; ++mid)
+		{
+			expandBounds(boundsLeft, refs[mid - 1].bounds);
+
+			float cost = bboxSurfaceArea(boundsLeft) * (float)mid + surfaceAreaRight[mid] * (float)(count - mid);
+			if (cost < result.cost)
+			{
+				result.cost = cost;
+				result.axis = axis;
+				result.mid = mid;
+			}
+		}
+	}
+
+	result.boundsLeft.expandInit();
+	result.boundsRight.expandInit();
+
+	sortReferences(refs, result.axis);
+
+	for (u32 i = 0; i < count; ++i)
+	{
+		expandBounds(i < result.mid ? result.boundsLeft : result.boundsRight, refs[i].bounds);
+	}
+
+	return result;
+}
+
+SpatialSplit findSpatialSplit(SpatialSplitContext& context, const std::vector<SpatialReference>& refs, const Box3& nodeBounds)
+{
+	static const u32 BinCount = 32;
+
+	struct SpatialBin
+	{
+		Box3 bounds;
+		u32 entryCount;
+		u32 exitCount;
+	};
+
+	SpatialSplit result;
+
+	const Vec3 extents = nodeBounds.dimensions();
+
+	for (u32 axis = 0; axis < 3; ++axis)
+	{
+		if (extents[axis] <= 0.0f)
+		{
+			continue;
+		}
+
+		const float binWidth = extents[axis] / (float)BinCount;
+		const float origin = nodeBounds.m_min[axis];
+
+		auto getBinIndex = [&](float position)
+		{
+			return min<u32>((u32)max(0.0f, (position - origin) / binWidth), BinCount - 1);
+		};
+
+		SpatialBin bins[BinCount];
+		for (SpatialBin& bin : bins)
+		{
+			bin.bounds.expandInit();
+			bin.entryCount = 0;
+			bin.exitCount = 0;
+		}
+
+		for (const SpatialReference& ref : refs)
+		{
+			const u32 firstBin = getBinIndex(ref.bounds.m_min[axis]);
+			const u32 lastBin = getBinIndex(ref.bounds.m_max[axis]);
+
+			bins[firstBin].entryCount++;
+			bins[lastBin].exitCount++;
+
+			if (firstBin == lastBin)
+			{
+				expandBounds(bins[firstBin].bounds, ref.bounds);
+				continue;
+			}
+
+			for (u32 binIndex = firstBin; binIndex <= lastBin; ++binIndex)
+			{
+				float planeMin = origin + binWidth * (float)binIndex;
+				float planeMax = binIndex == BinCount - 1 ? nodeBounds.m_max[axis] : origin + binWidth * (float)(binIndex + 1);
+				Box3 clipped = intersectBounds(clipTriangleBounds(context.triangles, ref.prim, axis, planeMin, planeMax), ref.bounds);
+				if (!isEmpty(clipped))
+				{
+					expandBounds(bins[binIndex].bounds, clipped);
+				}
+			}
+		}
+
+		float surfaceAreaRight[BinCount];
+		u32 countRight[BinCount];
+
+		Box3 boundsRight;
+		boundsRight.expandInit();
+		u32 count = 0;
+		for (u32 binIndex = BinCount - 1; binIndex > 0; --binIndex)
+		{
+			if (!isEmpty(bins[binIndex].bounds))
+			{
+				expandBounds(boundsRight, bins[binIndex].bounds);
+			}
+			count += bins[binIndex].exitCount;
+			surfaceAreaRight[binIndex] = count ? bboxSurfaceArea(boundsRight) : 0.0f;
+			countRight[binIndex] = count;
+		}
+
+		Box3 boundsLeft;
+		boundsLeft.expandInit();
+		count = 0;
+		for (u32 binIndex = 0; binIndex < BinCount - 1; ++binIndex)
+		{
+			if (!isEmpty(bins[binIndex].bounds))
+			{
+				expandBounds(boundsLeft, bins[binIndex].bounds);
+			}
+			count += bins[binIndex].entryCount;
+
+			const u32 refCount = (u32)refs.size();
+			if (count == 0 || countRight[binIndex + 1] == 0 || count == refCount || countRight[binIndex + 1] == refCount)
+			{
+				continue;
+			}
+
+			float cost = bboxSurfaceArea(boundsLeft) * (float)count + surfaceAreaRight[binIndex + 1] * (float)countRight[binIndex + 1];
+			if (cost < result.cost)
+			{
+				result.cost = cost;
+				result.axis = axis;
+				result.position = origin + binWidth * (float)(binIndex + 1);
+			}
+		}
+	}
+
+	return result;
+}
+
+// Returns false if the split does not make progress or duplicates more than budget references,
+// in which case no references are modified
+bool performSpatialSplit(SpatialSplitContext& context, std::vector<SpatialReference>& refs, const SpatialSplit& split,
+	u64 budget, std::vector<SpatialReference>& outLeft, std::vector<SpatialReference>& outRight)
+{
+	const u32 axis = split.axis;
+
+	u32 duplicateCount = 0;
+	for (const SpatialReference& ref : refs)
+	{
+		duplicateCount += ref.bounds.m_min[axis] < split.position && ref.bounds.m_max[axis] > split.position;
+	}
+
+	if (duplicateCount > budget)
+	{
+		return false;
+	}
+
+	for (const SpatialReference& ref : refs)
+	{
+		if (ref.bounds.m_max[axis] <= split.position)
+		{
+			outLeft.push_back(ref);
+		}
+		else if (ref.bounds.m_min[axis] >= split.position)
+		{
+			outRight.push_back(ref);
+		}
+		else
+		{
+			SpatialReference left = ref;
+			left.bounds = intersectBounds(clipTriangleBounds(context.triangles, ref.prim, axis, ref.bounds.m_min[axis], split.position), ref.bounds);
+
+			SpatialReference right = ref;
+			right.bounds = intersectBounds(clipTriangleBounds(context.triangles, ref.prim, axis, split.position, ref.bounds.m_max[axis]), ref.bounds);
+
+			bool leftValid = !isEmpty(left.bounds);
+			bool rightValid = !isEmpty(right.bounds);
+
+			// Clipping may produce an empty part due to numerical precision, in which case the reference is not duplicated
+			if (leftValid && rightValid)
+			{
+				outLeft.push_back(left);
+				outRight.push_back(right);
+			}
+			else
+			{
+				(rightValid ? outRight : outLeft).push_back(ref);
+			}
+		}
+	}
+
+	if (outLeft.empty() || outRight.empty() || outLeft.size() == refs.size() || outRight.size() == refs.size())
+	{
+		outLeft.clear();
+		outRight.clear();
+		return false;
+	}
+
+	return true;
+}
+
+// Subtree over a list of references, whose root node index is written to link.
+// Extra references that spatial splits may create within the subtree are limited by budget, so the subtree
+// has at most (refs + budget) * 2 - 1 nodes and owns that many node slots starting at firstNode.
+struct SpatialSplitItem
+{
+	std::vector<SpatialReference> refs;
+	u64 budget;
+	u32 firstNode;
+	u32 parent;
+	u32* link;
+};
+
+// Split BVH [Stich et al. 2009].
+// Object splits are found using a full SAH sweep. When children of the best object split overlap by more
+// than the threshold, spatial split planes are also evaluated by clipping references to spatial bins.
+// Spatial splits duplicate references that straddle the plane. Reference budget that remains after a split
+// is divided between children proportionally to their reference counts, so the result does not depend on
+// the order in which subtrees are built. Every leaf still references an original triangle.
+// Subtrees are built using an explicit work stack and large ones are spawned as tasks, same as buildSubtrees().
+void buildSpatialSplitSubtrees(SpatialSplitContext& context, SpatialSplitItem rootItem, TaskScheduler::TaskGroup& taskGroup)
+{
+	std::vector<TempNode>& nodes = context.outNodes;
+
+	const bool spawnTasks = context.scheduler && context.scheduler->getThreadCount() > 1;
+
+	std::vector<float> surfaceAreaRight;
+
+	std::vector<SpatialSplitItem> stack;
+	stack.push_back(std::move(rootItem));
+
+	while (!stack.empty())
+	{
+		SpatialSplitItem item = std::move(stack.back());
+		stack.pop_back();
+
+		std::vector<SpatialReference>& refs = item.refs;
+
+		const u32 nodeId = item.firstNode;
+		*item.link = nodeId;
+
+		TempNode& node = nodes[nodeId];
+		node.parent = item.parent;
+		node.left = BVHNode::InvalidMask;
+		node.right = BVHNode::InvalidMask;
+
+		if (refs.size() == 1)
+		{
+			setBounds(node, refs[0].bounds.m_min, refs[0].bounds.m_max);
+			node.prim = refs[0].prim;
+			continue;
+		}
+
+		Box3 nodeBounds;
+		nodeBounds.expandInit();
+		Box3 centroidBounds;
+		centroidBounds.expandInit();
+		for (const SpatialReference& ref : refs)
+		{
+			expandBounds(nodeBounds, ref.bounds);
+			centroidBounds.expand(ref.bounds.m_min + ref.bounds.m_max);
+		}
+
+		setBounds(node, nodeBounds.m_min, nodeBounds.m_max);
+		node.prim = BVHNode::InvalidMask;
+
+		SpatialSplitItem leftItem;
+		SpatialSplitItem rightItem;
+
+		const Vec3 centroidExtents = centroidBounds.dimensions();
+		if (centroidExtents.x == 0.0f && centroidExtents.y == 0.0f && centroidExtents.z == 0.0f)
+		{
+			// No plane separates coincident references
+			const size_t mid = refs.size() / 2;
+			leftItem.refs.assign(refs.begin(), refs.begin() + mid);
+			rightItem.refs.assign(refs.begin() + mid, refs.end());
+		}
+		else
+		{
+			ObjectSplit objectSplit = findObjectSplit(refs, surfaceAreaRight);
+
+			bool splitDone = false;
+
+			Box3 overlap = intersectBounds(objectSplit.boundsLeft, objectSplit.boundsRight);
+			if (!isEmpty(overlap) && bboxSurfaceArea(overlap) > context.minOverlapArea)
+			{
+				SpatialSplit spatialSplit = findSpatialSplit(context, refs, nodeBounds);
+				if (spatialSplit.cost < objectSplit.cost)
+				{
+					splitDone = performSpatialSplit(context, refs, spatialSplit, item.budget, leftItem.refs, rightItem.refs);
+				}
+			}
+
+			if (!splitDone)
+			{
+				// References are sorted along the object split axis by findObjectSplit()
+				leftItem.refs.assign(refs.begin(), refs.begin() + objectSplit.mid);
+				rightItem.refs.assign(refs.begin() + objectSplit.mid, refs.end());
+			}
+		}
+
+		const size_t count = refs.size();
+		const size_t childCount = leftItem.refs.size() + rightItem.refs.size();
+		std::vector<SpatialReference>().swap(refs);
+
+		const u64 budget = item.budget - (childCount - count);
+		leftItem.budget = u64(double(budget) * double(leftItem.refs.size()) / double(childCount));
+		rightItem.budget = budget - leftItem.budget;
+
+		leftItem.firstNode = nodeId + 1;
+		leftItem.parent = nodeId;
+		leftItem.link = &node.left;
+		rightItem.firstNode = nodeId + u32(leftItem.refs.size() + leftItem.budget) * 2;
+		rightItem.parent = nodeId;
+		rightItem.link = &node.right;
+
+		stack.push_back(std::move(rightItem));
+
+		if (spawnTasks && count >= context.settings.parallelBuildThreshold)
+		{
+			std::shared_ptr<SpatialSplitItem> task = std::make_shared<SpatialSplitItem>(std::move(leftItem));
+			context.scheduler->run(taskGroup, [&context, &taskGroup, task]()
+			{
+				buildSpatialSplitSubtrees(context, std::move(*task), taskGroup);
+			});
+		}
+		else
+		{
+			stack.push_back(std::move(leftItem));
+		}
+	}
+}
+
+// Replaces leaf nodes with a new node array, where leaves may reference the same primitive multiple times
+u32 buildSpatialSplit(std::vector<TempNode>& nodes, u32 primCount, const TriangleList& triangles, const BVHBuilderSettings& settings,
+	TaskScheduler* scheduler)
+{
+	SpatialSplitItem rootItem;
+	rootItem.refs.resize(primCount);
+	rootItem.budget = u64(double(primCount) * max(0.0f, settings.spatialSplitBudget));
+	rootItem.firstNode = 0;
+	rootItem.parent = BVHNode::InvalidMask;
+
+	Box3 rootBounds;
+	rootBounds.expandInit();
+
+	for (u32 primId = 0; primId < primCount; ++primId)
+	{
+		const TempNode& node = nodes[primId];
+		rootItem.refs[primId].bounds = Box3(node.bboxMin, node.bboxMax);
+		rootItem.refs[primId].prim = node.prim;
+		expandBounds(rootBounds, rootItem.refs[primId].bounds);
+	}
+
+	// Slots that are not used because of unspent budget keep an internal node without children
+	TempNode unusedNode;
+	unusedNode.left = BVHNode::InvalidMask;
+	unusedNode.right = BVHNode::InvalidMask;
+
+	std::vector<TempNode> outNodes((primCount + rootItem.budget) * 2 - 1, unusedNode);
+
+	SpatialSplitContext context(triangles, settings, scheduler, outNodes, settings.spatialSplitOverlap * bboxSurfaceArea(rootBounds));
+
+	u32 rootIndex = BVHNode::InvalidMask;
+	rootItem.link = &rootIndex;
+
+	TaskScheduler::TaskGroup taskGroup;
+	buildSpatialSplitSubtrees(context, std::move(rootItem), taskGroup);
+	if (scheduler)
+	{
+		scheduler->wait(taskGroup);
+	}
+
+	// Used slots are compacted in place, which keeps their relative order
+	std::vector<u32> newIndices(outNodes.size(), u32(BVHNode::InvalidMask));
+	u32 nodeCount = 0;
+	for (u32 i = 0; i < (u32)outNodes.size(); ++i)
+	{
+		if (outNodes[i].isLeaf() || outNodes[i].left != BVHNode::InvalidMask)
+		{
+			newIndices[i] = nodeCount++;
+		}
+	}
+
+	for (u32 i = 0; i < (u32)outNodes.size(); ++i)
+	{
+		if (newIndices[i] == BVHNode::InvalidMask)
+		{
+			continue;
+		}
+
+		TempNode& node = outNodes[newIndices[i]];
+		node = outNodes[i];
+
+		if (node.parent != BVHNode::InvalidMask)
+		{
+			node.parent = newIndices[node.parent];
+		}
+
+		if (!node.isLeaf())
+		{
+			node.left = newIndices[node.left];
+			node.right = newIndices[node.right];
+		}
+	}
+
+	outNodes.resize(nodeCount);
+
+	orderChildren(outNodes, 0, nodeCount, scheduler);
+
+	nodes.swap(outNodes);
+
+	return newIndices[rootIndex];
+}
+
+// Finds the split plane that is aligned to the coarsest level of a power-of-two grid over the scene bounds.
+// Such planes are likely to coincide with split planes near the top of the hierarchy.
+bool findPresplitPlane(const Box3& bounds, const Box3& sceneBounds, u32& outAxis, float& outPosition)
+{
+	static const u32 GridBits = 21;
+
+	const Vec3 sceneExtents = sceneBounds.dimensions();
+
+	u32 bestLevel = GridBits + 1;
+	float bestExtent = 0.0f;
+
+	for (u32 axis = 0; axis < 3; ++axis)
+	{
+		if (sceneExtents[axis] <= 0.0f)
+		{
+			continue;
+		}
+
+		const float gridScale = float(1 << GridBits) / sceneExtents[axis];
+		const u32 quantizedMin = (u32)max(0.0f, (bounds.m_min[axis] - sceneBounds.m_min[axis]) * gridScale);
+		const u32 quantizedMax = min<u32>((u32)max(0.0f, (bounds.m_max[axis] - sceneBounds.m_min[axis]) * gridScale), 1 << GridBits);
+
+		if (quantizedMin == quantizedMax)
+		{
+			continue;
+		}
+
+		const u32 highestBit = 63 - (u32)countLeadingZeros(u64(quantizedMin ^ quantizedMax));
+		const u32 level = GridBits - highestBit;
+		const u32 quantizedPlane = (quantizedMax >> highestBit) << highestBit;
+		const float position = sceneBounds.m_min[axis] + float(quantizedPlane) / gridScale;
+		const float extent = bounds.m_max[axis] - bounds.m_min[axis];
+
+		if (position <= bounds.m_min[axis] || position >= bounds.m_max[axis])
+		{
+			continue;
+		}
+
+		if (level < bestLevel || (level == bestLevel && extent > bestExtent))
+		{
+			bestLevel = level;
+			bestExtent = extent;
+			outAxis = axis;
+			outPosition = position;
+		}
+	}
+
+	return bestLevel <= GridBits;
+}
+
+void presplitReference(const TriangleList& triangles, const Box3& sceneBounds, const SpatialReference& ref, u32 referenceCount,
+	std::vector<SpatialReference>& outRefs)
+{
+	u32 axis;
+	float position;
+	if (referenceCount <= 1 || !findPresplitPlane(ref.bounds, sceneBounds, axis, position))
+	{
+		outRefs.push_back(ref);
+		return;
+	}
+
+	SpatialReference left = ref;
+	left.bounds = intersectBounds(clipTriangleBounds(triangles, ref.prim, axis, ref.bounds.m_min[axis], position), ref.bounds);
+
+	SpatialReference right = ref;
+	right.bounds = intersectBounds(clipTriangleBounds(triangles, ref.prim, axis, position, ref.bounds.m_max[axis]), ref.bounds);
+
+	if (isEmpty(left.bounds) || isEmpty(right.bounds))
+	{
+		outRefs.push_back(ref);
+		return;
+	}
+
+	// Remaining references are distributed proportionally to child surface areas
+	const float surfaceAreaLeft = bboxSurfaceArea(left.bounds);
+	const float surfaceAreaRight = bboxSurfaceArea(right.bounds);
+	const float weightLeft = surfaceAreaLeft + surfaceAreaRight > 0.0f ? surfaceAreaLeft / (surfaceAreaLeft + surfaceAreaRight) : 0.5f;
+
+	const u32 countLeft = min<u32>(max<u32>(1, u32(float(referenceCount) * weightLeft + 0.5f)), referenceCount - 1);
+
+	presplitReference(triangles, sceneBounds, left, countLeft, outRefs);
+	presplitReference(triangles, sceneBounds, right, referenceCount - countLeft, outRefs);
+}
+
+// Early split clipping [Karras and Aila 2013].
+// Triangles whose bounding box surface area is much larger than the triangle area are subdivided
+// along grid-aligned planes into multiple references with tight bounds. The reference budget is
+// distributed proportionally to (boxArea - 2 * triangleArea)^(1/3).
+// Leaf nodes in the array are replaced with the references, which keep original primitive ids.
+void presplitTriangles(std::vector<TempNode>& nodes, const TriangleList& triangles, const BVHBuilderSettings& settings, TaskScheduler* scheduler)
+{
+	static const u32 ChunkSize = 16384;
+
+	const u32 primCount = (u32)nodes.size();
+	const u32 maxExtraReferences = u32(double(primCount) * max(0.0f, settings.presplitBudget));
+
+	if (maxExtraReferences == 0)
+	{
+		return;
+	}
+
+	Box3 sceneBounds = calculateBounds(nodes, 0, primCount);
+
+	std::vector<float> priorities(primCount);
+	parallelFor(scheduler, primCount, ChunkSize, [&](u32 begin, u32 end)
+	{
+		for (u32 i = begin; i < end; ++i)
+		{
+			const TempNode& node = nodes[i];
+			const float boxArea = bboxSurfaceArea(node.bboxMin, node.bboxMax);
+			const float primArea = Triangle::calculateArea(
+				triangles.getVertex(node.prim, 0),
+				triangles.getVertex(node.prim, 1),
+				triangles.getVertex(node.prim, 2));
+			const bool wantSplit = boxArea > primArea * settings.presplitThreshold;
+			priorities[i] = wantSplit ? cbrtf(max(0.0f, boxArea - 2.0f * primArea)) : 0.0f;
+		}
+	});
+
+	double prioritySum = 0.0;
+	for (float priority : priorities)
+	{
+		prioritySum += priority;
+	}
+
+	if (prioritySum == 0.0)
+	{
+		return;
+	}
+
+	const double priorityScale = double(maxExtraReferences) / prioritySum;
+
+	const u32 chunkCount = divUp(primCount, ChunkSize);
+	std::vector<std::vector<TempNode>> chunkNodes(chunkCount);
+
+	parallelFor(scheduler, chunkCount, 1, [&](u32 chunkBegin, u32 chunkEnd)
+	{
+		std::vector<SpatialReference> refs;
+
+		for (u32 chunkIndex = chunkBegin; chunkIndex < chunkEnd; ++chunkIndex)
+		{
+			const u32 end = min<u32>((chunkIndex + 1) * ChunkSize, primCount);
+			for (u32 i = chunkIndex * ChunkSize; i < end; ++i)
+			{
+				const TempNode& node = nodes[i];
+
+				const u32 referenceCount = 1 + u32(double(priorities[i]) * priorityScale);
+				if (referenceCount == 1)
+				{
+					chunkNodes[chunkIndex].push_back(node);
+					continue;
+				}
+
+				SpatialReference ref;
+				ref.bounds = Box3(node.bboxMin, node.bboxMax);
+				ref.prim = node.prim;
+
+				refs.clear();
+				presplitReference(triangles, sceneBounds, ref, referenceCount, refs);
+
+				for (const SpatialReference& it : refs)
+				{
+					TempNode splitNode = node;
+					setBounds(splitNode, it.bounds.m_min, it.bounds.m_max);
+					chunkNodes[chunkIndex].push_back(splitNode);
+				}
+			}
+		}
+	});
+
+	nodes.clear();
+	for (const auto& it : chunkNodes)
+	{
+		nodes.insert(nodes.end(), it.begin(), it.end());
+	}
+}
+
+// Same as BVHBuilder::calculateSahCost() for a tree with single primitive leaves
+float calculateTreeSahCost(const std::vector<TempNode>& nodes, u32 root, const BVHBuilderSettings& settings)
+{
+	const float rootSurfaceArea = bboxSurfaceArea(nodes[root].bboxMin, nodes[root].bboxMax);
+	if (rootSurfaceArea == 0.0f)
+	{
+		return 0.0f;
+	}
+
+	double cost = 0.0;
+	for (const TempNode& node : nodes)
+	{
+		const float nodeCost = node.isLeaf() ? settings.intersectionCost : settings.traversalCost;
+		cost += nodeCost * bboxSurfaceArea(node.bboxMin, node.bboxMax);
+	}
+
+	return float(cost / rootSurfaceArea);
+}
+
+// Finds optimal topology of a treelet rooted at the given node using dynamic programming over all subsets of treelet leaves.
+// Internal nodes of the treelet are reused for the new topology, so the rest of the tree is not affected.
+// Subtree costs are unnormalized SAH costs with the same weights as calculateTreeSahCost().
+void optimizeTreelet(std::vector<TempNode>& nodes, u32 rootId, u32 treeletSize, float traversalCost,
+	std::vector<float>& subtreeCosts)
+{
+	static const u32 MaxLeafCount = BVHBuilderSettings::MaxTreeletSize;
+	static const u32 MaxSubsetCount = 1 << MaxLeafCount;
+
+	u32 treeletLeaves[MaxLeafCount];
+	u32 treeletInternalNodes[MaxLeafCount - 1];
+
+	u32 leafCount = 2;
+	u32 internalNodeCount = 1;
+
+	treeletInternalNodes[0] = rootId;
+	treeletLeaves[0] = nodes[rootId].left;
+	treeletLeaves[1] = nodes[rootId].right;
+
+	// Treelet is grown by expanding the leaf with largest surface area
+	while (leafCount < treeletSize)
+	{
+		u32 bestIndex = BVHNode::InvalidMask;
+		float bestSurfaceArea = -1.0f;
+
+		for (u32 i = 0; i < leafCount; ++i)
+		{
+			const TempNode& node = nodes[treeletLeaves[i]];
+			const float surfaceArea = bboxSurfaceArea(node.bboxMin, node.bboxMax);
+			if (!node.isLeaf() && surfaceArea > bestSurfaceArea)
+			{
+				bestIndex = i;
+				bestSurfaceArea = surfaceArea;
+			}
+		}
+
+		if (bestIndex == BVHNode::InvalidMask)
+		{
+			break;
+		}
+
+		const TempNode& expandedNode = nodes[treeletLeaves[bestIndex]];
+		treeletInternalNodes[internalNodeCount++] = treeletLeaves[bestIndex];
+		treeletLeaves[bestIndex] = expandedNode.left;
+		treeletLeaves[leafCount++] = expandedNode.right;
+	}
+
+	if (leafCount < 3)
+	{
+		return;
+	}
+
+	const u32 subsetCount = 1 << leafCount;
+	const u32 fullSet = subsetCount - 1;
+
+	Box3 subsetBounds[MaxSubsetCount];
+	float subsetCosts[MaxSubsetCount];
+	u8 subsetPartitions[MaxSubsetCount];
+
+	for (u32 i = 0; i < leafCount; ++i)
+	{
+		const TempNode& node = nodes[treeletLeaves[i]];
+		subsetBounds[1 << i] = Box3(node.bboxMin, node.bboxMax);
+		subsetCosts[1 << i] = subtreeCosts[treeletLeaves[i]];
+	}
+
+	// Subsets of a set always have lower indices, so they are processed first
+	for (u32 subset = 1; subset < subsetCount; ++subset)
+	{
+		const u32 lowestBit = subset & (~subset + 1);
+		if (subset == lowestBit)
+		{
+			continue;
+		}
+
+		subsetBounds[subset] = subsetBounds[subset ^ lowestBit];
+		expandBounds(subsetBounds[subset], subsetBounds[lowestBit]);
+
+		// Each partition is evaluated once by keeping the lowest bit on the left side
+		float bestCost = FLT_MAX;
+		u32 bestPartition = 0;
+		const u32 rest = subset ^ lowestBit;
+		for (u32 partition = (rest - 1) & rest; ; partition = (partition - 1) & rest)
+		{
+			const u32 left = partition | lowestBit;
+			const float cost = subsetCosts[left] + subsetCosts[subset ^ left];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestPartition = left;
+			}
+
+			if (partition == 0)
+			{
+				break;
+			}
+		}
+
+		subsetCosts[subset] = traversalCost * bboxSurfaceArea(subsetBounds[subset]) + bestCost;
+		subsetPartitions[subset] = (u8)bestPartition;
+	}
+
+	// Small relative margin avoids rewriting treelets due to rounding differences
+	if (subsetCosts[fullSet] >= subtreeCosts[rootId] * 0.9999f)
+	{
+		return;
+	}
+
+	struct TreeletNode
+	{
+		u32 subset;
+		u32 nodeId;
+		u32 left;
+		u32 right;
+	};
+
+	TreeletNode newNodes[MaxLeafCount - 1];
+	u32 newNodeCount = 1;
+	u32 nextInternalNode = 1;
+
+	newNodes[0].subset = fullSet;
+	newNodes[0].nodeId = rootId;
+
+	auto getChild = [&](u32 subset)
+	{
+		if ((subset & (subset - 1)) == 0)
+		{
+			u32 index = 0;
+			while (subset != (1u << index))
+			{
+				++index;
+			}
+			return treeletLeaves[index];
+		}
+
+		TreeletNode& child = newNodes[newNodeCount++];
+		child.subset = subset;
+		child.nodeId = treeletInternalNodes[nextInternalNode++];
+		return child.nodeId;
+	};
+
+	// Nodes are allocated in pre-order and finalized in reverse, so children are always finalized before parents
+	for (u32 i = 0; i < newNodeCount; ++i)
+	{
+		const u32 subset = newNodes[i].subset;
+		const u32 left = subsetPartitions[subset];
+		newNodes[i].left = getChild(left);
+		newNodes[i].right = getChild(subset ^ left);
+	}
+
+	for (u32 i = newNodeCount; i-- > 0;)
+	{
+		const TreeletNode& node = newNodes[i];
+		setInternalNode(nodes, node.nodeId, node.left, node.right);
+		subtreeCosts[node.nodeId] = subsetCosts[node.subset];
+	}
+}
+
+// Treelet restructuring [Karras and Aila 2013].
+// Nodes are visited bottom-up in parallel. A node is processed only after both of its subtrees are finished,
+// so concurrently optimized treelets never overlap. Subtrees with fewer leaves than the threshold are skipped.
+// The threshold is doubled after each pass.
+void optimizeTreelets(std::vector<TempNode>& nodes, const BVHBuilderSettings& settings, TaskScheduler* scheduler)
+{
+	const u32 nodeCount = (u32)nodes.size();
+	const u32 treeletSize = max<u32>(3, min<u32>(settings.treeletSize, BVHBuilderSettings::MaxTreeletSize));
+
+	if (nodeCount < 5)
+	{
+		return;
+	}
+
+	std::vector<u32> leaves;
+	for (u32 i = 0; i < nodeCount; ++i)
+	{
+		if (nodes[i].isLeaf())
+		{
+			leaves.push_back(i);
+		}
+	}
+
+	std::vector<float> subtreeCosts(nodeCount);
+	std::vector<u32> subtreeLeafCounts(nodeCount);
+
+	for (u32 pass = 0; pass < settings.treeletPasses; ++pass)
+	{
+		const u32 minLeafCount = treeletSize << pass;
+
+		std::vector<std::atomic<u32>> visitCounts(nodeCount);
+
+		parallelFor(scheduler, (u32)leaves.size(), 4096, [&](u32 begin, u32 end)
+		{
+			for (u32 i = begin; i < end; ++i)
+			{
+				const TempNode& leaf = nodes[leaves[i]];
+				subtreeCosts[leaves[i]] = settings.intersectionCost * bboxSurfaceArea(leaf.bboxMin, leaf.bboxMax);
+				subtreeLeafCounts[leaves[i]] = 1;
+
+				u32 nodeId = leaf.parent;
+				while (nodeId != BVHNode::InvalidMask)
+				{
+					if (visitCounts[nodeId].fetch_add(1) == 0)
+					{
+						break;
+					}
+
+					const TempNode& node = nodes[nodeId];
+					subtreeCosts[nodeId] = settings.traversalCost * bboxSurfaceArea(node.bboxMin, node.bboxMax)
+						+ subtreeCosts[node.left] + subtreeCosts[node.right];
+					subtreeLeafCounts[nodeId] = subtreeLeafCounts[node.left] + subtreeLeafCounts[node.right];
+
+					if (subtreeLeafCounts[nodeId] >= minLeafCount)
+					{
+						optimizeTreelet(nodes, nodeId, treeletSize, settings.traversalCost, subtreeCosts);
+					}
+
+					nodeId = node.parent;
+				}
+			}
+		});
+	}
+}
+
+// Marks nodes where a leaf with all primitives of the subtree has lower SAH cost than the subtree.
+// Nodes are evaluated in reverse depth-first order, so that children are visited before their parents.
+void findCollapsedNodes(const std::vector<TempNode>& nodes, u32 root, const BVHBuilderSettings& settings, std::vector<u8>& collapseFlags)
+{
+	std::vector<u32> order;
+	std::vector<u32> stack;
+	stack.push_back(root);
+
+	while (!stack.empty())
+	{
+		const u32 nodeId = stack.back();
+		stack.pop_back();
+
+		order.push_back(nodeId);
+
+		const TempNode& node = nodes[nodeId];
+		if (!node.isLeaf())
+		{
+			stack.push_back(node.right);
+			stack.push_back(node.left);
+		}
+	}
+
+	// SAH cost and primitive count of every subtree
+	std::vector<float> costs(nodes.size());
+	std::vector<u32> primCounts(nodes.size());
+
+	for (auto it = order.rbegin(); it != order.rend(); ++it)
+	{
+		const u32 nodeId = *it;
+		const TempNode& node = nodes[nodeId];
+		const float surfaceArea = bboxSurfaceArea(node.bboxMin, node.bboxMax);
+
+		if (node.isLeaf())
+		{
+			primCounts[nodeId] = 1;
+			costs[nodeId] = settings.intersectionCost * surfaceArea;
+			continue;
+		}
+
+		const u32 primCount = primCounts[node.left] + primCounts[node.right];
+		const float internalCost = settings.traversalCost * surfaceArea + costs[node.left] + costs[node.right];
+
+		primCounts[nodeId] = primCount;
+		costs[nodeId] = internalCost;
+
+		if (primCount > settings.maxLeafSize)
+		{
+			continue;
+		}
+
+		const float leafCost = settings.intersectionCost * surfaceArea * primCount;
+		if (leafCost <= internalCost)
+		{
+			collapseFlags[nodeId] = 1;
+			costs[nodeId] = leafCost;
+		}
+	}
+}
+
+// Appends primitives of the subtree in depth-first order
+void gatherLeafPrims(const std::vector<TempNode>& nodes, u32 root, std::vector<u32>& stack, std::vector<u32>& outPrims)
+{
+	stack.push_back(root);
+
+	while (!stack.empty())
+	{
+		const TempNode& node = nodes[stack.back()];
+		stack.pop_back();
+
+		if (node.isLeaf())
+		{
+			outPrims.push_back(node.prim);
+		}
+		else
+		{
+			stack.push_back(node.right);
+			stack.push_back(node.left);
+		}
+	}
+}
+
+void collapseMarkedNodes(std::vector<TempNode>& nodes, u32 root, const std::vector<u8>& collapseFlags, std::vector<u32>& leafPrims)
+{
+	std::vector<u32> stack;
+	std::vector<u32> gatherStack;
+	stack.push_back(root);
+
+	while (!stack.empty())
+	{
+		const u32 nodeId = stack.back();
+		stack.pop_back();
+
+		TempNode& node = nodes[nodeId];
+
+		if (node.isLeaf())
+		{
+			continue;
+		}
+
+		if (!collapseFlags[nodeId])
+		{
+			stack.push_back(node.right);
+			stack.push_back(node.left);
+			continue;
+		}
+
+		const u32 firstPrim = (u32)leafPrims.size();
+		gatherLeafPrims(nodes, nodeId, gatherStack, leafPrims);
+		leafPrims.back() |= BVHNode::LeafMask;
+
+		node.prim = BVHNode::LeafMask | firstPrim;
+		node.left = BVHNode::InvalidMask;
+		node.right = BVHNode::InvalidMask;
+	}
+}
+
+// Replaces subtrees with multi-primitive leaves where this reduces SAH cost.
+// Nodes of collapsed subtrees become unreachable from the root.
+// Primitives of each multi-primitive leaf are stored contiguously in leafPrims and the last one is marked with LeafMask.
+// All passes use explicit stacks, since the tree may be arbitrarily deep.
+void collapseLeaves(std::vector<TempNode>& nodes, u32 root, const BVHBuilderSettings& settings, std::vector<u32>& leafPrims)
+{
+	std::vector<u8> collapseFlags(nodes.size());
+
+	findCollapsedNodes(nodes, root, settings, collapseFlags);
+
+	collapseMarkedNodes(nodes, root, collapseFlags, leafPrims);
+}
+
+inline u32 getLeafPrimCount(const BVHNode& node, const std::vector<u32>& leafPrims)
+{
+	if (!(node.prim & BVHNode::LeafMask))
+	{
+		return 1;
+	}
+
+	u32 count = 1;
+	for (u32 i = node.prim & ~BVHNode::LeafMask; !(leafPrims[i] & BVHNode::LeafMask); ++i)
+	{
+		++count;
+	}
+
+	return count;
+}
+
+// Leaf nodes store two triangle edges and the index of the first vertex record, which follows all nodes in the buffer
+void packLeafNode(const BVHNode& node, const TriangleList& triangles, u32 nodeCount, BVHPackedNode* outData)
+{
+	struct BVHPrimitiveNode
+	{
+		Vec3 edge0;
+		u32 prim;
+		Vec3 edge1;
+		u32 next;
+	};
+
+	BVHPrimitiveNode packedNode;
+
+	Vec3 v0 = triangles.getVertex(node.prim, 0);
+	Vec3 v1 = triangles.getVertex(node.prim, 1);
+	Vec3 v2 = triangles.getVertex(node.prim, 2);
+
+	packedNode.edge0 = v1 - v0;
+	packedNode.prim = node.prim + nodeCount * 2;
+
+	packedNode.edge1 = v2 - v0;
+	packedNode.next = node.next;
+
+	memcpy(&outData[0], &packedNode.edge0, sizeof(BVHPackedNode));
+	memcpy(&outData[1], &packedNode.edge1, sizeof(BVHPackedNode));
+}
+
+void packInternalNode(const BVHNode& node, BVHPackedNode* outData)
+{
+	BVHNode packedNode;
+
+	packedNode.bboxMin = node.bboxMin;
+	packedNode.prim = node.prim;
+	packedNode.bboxMax = node.bboxMax;
+	packedNode.next = node.next;
+
+	memcpy(&outData[0], &packedNode.bboxMin, sizeof(BVHPackedNode));
+	memcpy(&outData[1], &packedNode.bboxMax, sizeof(BVHPackedNode));
+}
+
+void packVertex(const TriangleList& triangles, u32 prim, BVHPackedNode& outData)
+{
+	Vec3 v0 = triangles.getVertex(prim, 0);
+	outData = {};
+	memcpy(&outData, &v0, sizeof(v0));
+}
+
+// Multi-primitive leaves store bounds, like internal nodes, and the index of the first triangle record marked with LeafMask.
+// Triangle records of a leaf are contiguous and follow the vertex records in the buffer. Each record holds two
+// triangle edges, index of the vertex record and a flag that marks the last triangle of the leaf.
+void packMultiPrimLeafNode(const BVHNode& node, u32 triangleRecordOffset, u32 triangleRecordSize, BVHPackedNode* outData)
+{
+	BVHNode packedNode = node;
+	packedNode.prim = BVHNode::LeafMask | (triangleRecordOffset + (node.prim & ~BVHNode::LeafMask) * triangleRecordSize);
+	packInternalNode(packedNode, outData);
+}
+
+void packTriangleRecord(const TriangleList& triangles, u32 leafPrim, u32 nodeCount, BVHPackedNode* outData)
+{
+	struct BVHTriangleRecord
+	{
+		Vec3 edge0;
+		u32 vertexRecord;
+		Vec3 edge1;
+		u32 last;
+	};
+
+	const u32 prim = leafPrim & ~BVHNode::LeafMask;
+
+	Vec3 v0 = triangles.getVertex(prim, 0);
+	Vec3 v1 = triangles.getVertex(prim, 1);
+	Vec3 v2 = triangles.getVertex(prim, 2);
+
+	BVHTriangleRecord record;
+	record.edge0 = v1 - v0;
+	record.vertexRecord = nodeCount * 2 + prim;
+	record.edge1 = v2 - v0;
+	record.last = (leafPrim & BVHNode::LeafMask) ? 1 : 0;
+
+	memcpy(&outData[0], &record.edge0, sizeof(BVHPackedNode));
+	memcpy(&outData[1], &record.edge1, sizeof(BVHPackedNode));
+}
+
+struct PositionKey
+{
+	u32 x, y, z;
+
+	bool operator==(const PositionKey& other) const
+	{
+		return x == other.x && y == other.y && z == other.z;
+	}
+};
+
+struct PositionKeyHash
+{
+	size_t operator()(const PositionKey& key) const
+	{
+		return (size_t(key.x) * 73856093) ^ (size_t(key.y) * 19349663) ^ (size_t(key.z) * 83492791);
+	}
+};
+
+// Vertices with bitwise identical positions share a record, so vertices that were split by other attributes are merged.
+// Records are allocated in order of first use by leaves in node order, which keeps vertices of nearby leaves close.
+// outVertexRecords maps every referenced vertex to its record index relative to the first position record.
+void findUniquePositions(const std::vector<BVHNode>& nodes, const std::vector<u32>& leafPrims, const TriangleList& triangles,
+	u32 primCount, std::vector<u32>& outVertexRecords, std::vector<u32>& outPositionVertices)
+{
+	u32 vertexCount = 0;
+	for (u32 i = 0; i < primCount * 3; ++i)
+	{
+		vertexCount = max(vertexCount, triangles.indices[i] + 1);
+	}
+
+	outVertexRecords.assign(vertexCount, u32(BVHNode::InvalidMask));
+	outPositionVertices.clear();
+
+	std::unordered_map<PositionKey, u32, PositionKeyHash> positionRecords;
+	positionRecords.reserve(vertexCount);
+
+	auto addTriangle = [&](u32 prim)
+	{
+		for (u32 corner = 0; corner < 3; ++corner)
+		{
+			const u32 vertex = triangles.indices[prim * 3 + corner];
+			if (outVertexRecords[vertex] != BVHNode::InvalidMask)
+			{
+				continue;
+			}
+
+			PositionKey key;
+			memcpy(&key, triangles.vertices + triangles.stride * vertex, sizeof(key));
+
+			auto it = positionRecords.insert(std::make_pair(key, (u32)outPositionVertices.size()));
+			if (it.second)
+			{
+				outPositionVertices.push_back(vertex);
+			}
+
+			outVertexRecords[vertex] = it.first->second;
+		}
+	};
+
+	for (const BVHNode& node : nodes)
+	{
+		if (!node.isLeaf())
+		{
+			continue;
+		}
+
+		if (node.prim & BVHNode::LeafMask)
+		{
+			for (u32 i = node.prim & ~BVHNode::LeafMask; ; ++i)
+			{
+				addTriangle(leafPrims[i] & ~BVHNode::LeafMask);
+				if (leafPrims[i] & BVHNode::LeafMask)
+				{
+					break;
+				}
+			}
+		}
+		else
+		{
+			addTriangle(node.prim);
+		}
+	}
+}
+
+bool isIndexedLeafRecord(const BVHNode& node)
+{
+	return node.isLeaf() && !(node.prim & BVHNode::LeafMask);
+}
+
+// Indexed nodes are addressed by record offset instead of node index, since single-triangle leaves take
+// a single record and other nodes take two. Returns the total number of node records.
+u64 calculateIndexedNodeOffsets(const std::vector<BVHNode>& nodes, std::vector<u32>& outOffsets)
+{
+	outOffsets.resize(nodes.size());
+
+	u64 offset = 0;
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		outOffsets[i] = u32(offset);
+		offset += isIndexedLeafRecord(nodes[i]) ? 1 : 2;
+	}
+
+	return offset;
+}
+
+// Skip pointers of indexed nodes are record offsets. In single-triangle leaf records InvalidMask would mark
+// an internal node, so the end of traversal is marked with offset zero instead. Root is never a skip target.
+u32 getIndexedNext(const BVHNode& node, const std::vector<u32>& nodeOffsets)
+{
+	if (node.next == BVHNode::InvalidMask)
+	{
+		return isIndexedLeafRecord(node) ? 0 : BVHNode::InvalidMask;
+	}
+
+	return nodeOffsets[node.next];
+}
+
+// Indexed leaf nodes are a single record with buffer indices of the three position records of the triangle
+// and the skip pointer, which must already be converted with getIndexedNext(). Skip pointer is below LeafMask, which tells the record apart from internal nodes and
+// multi-primitive leaves that store InvalidMask or a LeafMask flagged index in the same element.
+void packIndexedLeafNode(const BVHNode& node, const TriangleList& triangles, const std::vector<u32>& vertexRecords,
+	u32 positionOffset, BVHPackedNode& outData)
+{
+	outData.a = positionOffset + vertexRecords[triangles.indices[node.prim * 3 + 0]];
+	outData.b = positionOffset + vertexRecords[triangles.indices[node.prim * 3 + 1]];
+	outData.c = positionOffset + vertexRecords[triangles.indices[node.prim * 3 + 2]];
+	outData.d = node.next;
+}
+
+// Indexed triangle records of multi-primitive leaves hold buffer indices of the three position records
+// and a flag that marks the last triangle of the leaf
+void packIndexedTriangleRecord(const TriangleList& triangles, const std::vector<u32>& vertexRecords, u32 leafPrim,
+	u32 positionOffset, BVHPackedNode& outData)
+{
+	const u32 prim = leafPrim & ~BVHNode::LeafMask;
+
+	outData.a = positionOffset + vertexRecords[triangles.indices[prim * 3 + 0]];
+	outData.b = positionOffset + vertexRecords[triangles.indices[prim * 3 + 1]];
+	outData.c = positionOffset + vertexRecords[triangles.indices[prim * 3 + 2]];
+	outData.d = (leafPrim & BVHNode::LeafMask) ? 1 : 0;
+}
+
+void packPosition(const TriangleList& triangles, u32 vertex, BVHPackedNode& outData)
+{
+	Vec3 position(triangles.vertices + triangles.stride * vertex);
+	outData = {};
+	memcpy(&outData, &position, sizeof(position));
+}
+
+BVHBuilderSettings sanitizeSettings(const BVHBuilderSettings& inSettings)
+{
+	BVHBuilderSettings settings = inSettings;
+	settings.binCount = max<u32>(2, min<u32>(settings.binCount, BVHBuilderSettings::MaxBinCount));
+	settings.mortonCodeBits = settings.mortonCodeBits <= 30 ? 30 : 63;
+	settings.maxLeafSize = max<u32>(1, min<u32>(settings.maxLeafSize, BVHBuilderSettings::MaxLeafSize));
+	return settings;
+}
+
+// Builds the hierarchy over leaves at the beginning of tempNodes and writes it to outNodes in the requested layout.
+// Triangles are only needed by spatial split builds. Temporary nodes are released on return.
+void buildHierarchy(std::vector<TempNode>& tempNodes, const TriangleList* triangles, const BVHBuilderSettings& settings,
+	TaskScheduler* scheduler, std::vector<BVHNode>& outNodes, std::vector<u32>& outLeafPrims, float& outUnoptimizedSahCost)
+{
+	// Builders treat every leaf as a separate primitive, even if several leaves reference the same triangle
+	const u32 leafCount = (u32)tempNodes.size();
+
+	tempNodes.resize(leafCount * 2 - 1);
+
+	u32 rootIndex = BVHNode::InvalidMask;
+
+	// Primitives without triangle data fall back to object splits
+	const BVHBuildMethod method = settings.method == BVHBuildMethod::SpatialSplit && !triangles
+		? BVHBuildMethod::TopDown
+		: settings.method;
+
+	switch (method)
+	{
+	case BVHBuildMethod::Linear:
+		rootIndex = buildLinear(tempNodes, leafCount, settings, scheduler);
+		break;
+	case BVHBuildMethod::HierarchicalLinear:
+		rootIndex = buildHierarchicalLinear(tempNodes, leafCount, settings, scheduler);
+		break;
+	case BVHBuildMethod::Ploc:
+		rootIndex = buildPloc(tempNodes, leafCount, settings, scheduler);
+		break;
+	case BVHBuildMethod::SpatialSplit:
+		rootIndex = buildSpatialSplit(tempNodes, leafCount, *triangles, settings, scheduler);
+		break;
+	case BVHBuildMethod::TopDown:
+	default:
+		if (settings.splitMode == BVHSplitMode::PresortedSweep)
+		{
+			rootIndex = buildPresorted(tempNodes, leafCount, settings, scheduler);
+		}
+		else
+		{
+			BuildContext context = { tempNodes, settings, scheduler, leafCount };
+			rootIndex = buildInternal(context, 0, leafCount);
+		}
+		break;
+	}
+
+	if (settings.treeletPasses != 0)
+	{
+		outUnoptimizedSahCost = calculateTreeSahCost(tempNodes, rootIndex, settings);
+		optimizeTreelets(tempNodes, settings, scheduler);
+	}
+
+	if (settings.maxLeafSize > 1)
+	{
+		collapseLeaves(tempNodes, rootIndex, settings, outLeafPrims);
+	}
+
+	std::vector<u32> visitOrder;
+	outNodes.resize(setDepthFirstVisitOrder(tempNodes, rootIndex, visitOrder));
+
+	if (settings.nodeLayout == BVHNodeLayout::Treelet)
+	{
+		setTreeletVisitOrder(tempNodes, rootIndex, max<u32>(1, settings.layoutTreeletSize), visitOrder);
+	}
+
+	for (u32 oldIndex = 0; oldIndex < (u32)tempNodes.size(); ++oldIndex)
+	{
+		const TempNode& oldNode = tempNodes[oldIndex];
+
+		if (visitOrder[oldIndex] == BVHNode::InvalidMask)
+		{
+			continue; // Part of a collapsed subtree
+		}
+
+		BVHNode& newNode = outNodes[visitOrder[oldIndex]];
+
+		Vec3 bboxMin(oldNode.bboxMin);
+		Vec3 bboxMax(oldNode.bboxMax);
+		setBounds(newNode, bboxMin, bboxMax);
+
+		newNode.prim = oldNode.prim;
+		newNode.next = oldNode.next == BVHNode::InvalidMask
+			? BVHNode::InvalidMask
+			: visitOrder[oldNode.next];
+	}
+
+	// Build working set is released before the caller allocates packed data to reduce peak memory usage
+	std::vector<TempNode>().swap(tempNodes);
+}
+
+// Upper bound of primitive references created by pre-splitting and spatial splits
+double calculateMaxReferenceCount(u32 primCount, const BVHBuilderSettings& settings)
+{
+	double referenceCount = double(primCount) * (1.0 + max(0.0f, settings.presplitBudget));
+	if (settings.method == BVHBuildMethod::SpatialSplit)
+	{
+		referenceCount *= 1.0 + max(0.0f, settings.spatialSplitBudget);
+	}
+	return referenceCount;
+}
+
+}
+
+u32 BVHBuilder::getMaxPrimCount(const BVHBuilderSettings& inSettings, u64 maxPackedNodeCount)
+{
+	const BVHBuilderSettings settings = sanitizeSettings(inSettings);
+	const bool indexed = settings.triangleFormat == BVHTriangleFormat::Indexed;
+
+	// Every reference adds at most a leaf and an internal node of two records each, plus a triangle record
+	// in multi-primitive leaves. Edges format stores one vertex per primitive, indexed format up to three positions.
+	const double recordsPerReference = 4.0 + (settings.maxLeafSize > 1 ? (indexed ? 1.0 : 2.0) : 0.0);
+	const double recordsPerPrim = calculateMaxReferenceCount(1, settings) * recordsPerReference + (indexed ? 3.0 : 1.0);
+
+	return u32(double(min<u64>(maxPackedNodeCount, MaxPackedNodeCount)) / recordsPerPrim);
+}
+
+bool BVHBuilder::validatePackedNodeCount(u64 packedNodeCount)
+{
+	if (packedNodeCount <= MaxPackedNodeCount)
+	{
+		return true;
+	}
+
+	Log::error("BVH requires %llu packed nodes, which exceeds the limit of %u. Mesh must be split into several BVHs.",
+		(unsigned long long)packedNodeCount, u32(MaxPackedNodeCount));
+
+	return false;
+}
+
+void BVHBuilder::build(const float* vertices, u32 stride, const u32* indices, u32 primCount,
+	const BVHBuilderSettings& inSettings)
+{
+	const BVHBuilderSettings settings = sanitizeSettings(inSettings);
+
+	auto getVertex = [vertices, stride](u32 vertexId)
+	{
+		return Vec3(vertices + stride*vertexId);
+	};
+
+	m_nodes.clear();
+
+	m_leafPrims.clear();
+	m_unoptimizedSahCost = 0.0f;
+
+	m_packedNodes.clear();
+	m_positionVertices.clear();
+
+	// Every reference needs at least one packed record, which also keeps temporary node indices within u32
+	if (!validatePackedNodeCount(u64(calculateMaxReferenceCount(primCount, settings))))
+	{
+		return;
+	}
+
+	std::vector<TempNode> tempNodes;
+	tempNodes.reserve(primCount * 2 - 1);
+
+	for (u32 primId = 0; primId < primCount; ++primId)
+	{
+		TempNode node;
+		Box3 box;
+		box.expandInit();
+
+		Vec3 v0 = getVertex(indices[primId * 3 + 0]);
+		Vec3 v1 = getVertex(indices[primId * 3 + 1]);
+		Vec3 v2 = getVertex(indices[primId * 3 + 2]);
+
+		box.expand(v0);
+		box.expand(v1);
+		box.expand(v2);
+
+		setBounds(node, box.m_min, box.m_max);
+
+		node.prim = primId;
+		node.left = BVHNode::InvalidMask;
+		node.right = BVHNode::InvalidMask;
+		tempNodes.push_back(node);
+	}
+
+	std::unique_ptr<TaskScheduler> scheduler;
+	if (settings.threadCount != 1 && primCount >= settings.parallelBuildThreshold)
+	{
+		scheduler.reset(new TaskScheduler(settings.threadCount));
+	}
+
+	const TriangleList triangles = { vertices, stride, indices };
+
+	if (settings.presplitBudget > 0.0f)
+	{
+		presplitTriangles(tempNodes, triangles, settings, scheduler.get());
+	}
+
+	buildHierarchy(tempNodes, &triangles, settings, scheduler.get(), m_nodes, m_leafPrims, m_unoptimizedSahCost);
+
+	const u32 nodeCount = (u32)m_nodes.size();
+
+	m_triangleFormat = settings.triangleFormat;
+
+	if (m_triangleFormat == BVHTriangleFormat::Indexed)
+	{
+		std::vector<u32> vertexRecords;
+		findUniquePositions(m_nodes, m_leafPrims, triangles, primCount, vertexRecords, m_positionVertices);
+
+		const u32 positionCount = (u32)m_positionVertices.size();
+
+		std::vector<u32> nodeOffsets;
+		const u64 nodeRecordCount = calculateIndexedNodeOffsets(m_nodes, nodeOffsets);
+
+		if (!validatePackedNodeCount(nodeRecordCount + positionCount + m_leafPrims.size()))
+		{
+			m_nodes.clear();
+			m_leafPrims.clear();
+			m_positionVertices.clear();
+			return;
+		}
+
+		const u32 positionOffset = u32(nodeRecordCount);
+		const u32 triangleRecordOffset = positionOffset + positionCount;
+
+		m_packedNodes.resize(triangleRecordOffset + (u32)m_leafPrims.size());
+
+		for (u32 i = 0; i < nodeCount; ++i)
+		{
+			BVHNode node = m_nodes[i];
+			node.next = getIndexedNext(m_nodes[i], nodeOffsets);
+
+			if (!node.isLeaf())
+			{
+				packInternalNode(node, &m_packedNodes[nodeOffsets[i]]);
+			}
+			else if (node.prim & BVHNode::LeafMask)
+			{
+				packMultiPrimLeafNode(node, triangleRecordOffset, 1, &m_packedNodes[nodeOffsets[i]]);
+			}
+			else
+			{
+				packIndexedLeafNode(node, triangles, vertexRecords, positionOffset, m_packedNodes[nodeOffsets[i]]);
+			}
+		}
+
+		for (u32 i = 0; i < positionCount; ++i)
+		{
+			packPosition(triangles, m_positionVertices[i], m_packedNodes[positionOffset + i]);
+		}
+
+		for (u32 i = 0; i < (u32)m_leafPrims.size(); ++i)
+		{
+			packIndexedTriangleRecord(triangles, vertexRecords, m_leafPrims[i], positionOffset,
+				m_packedNodes[triangleRecordOffset + i]);
+		}
+
+		return;
+	}
+
+	if (!validatePackedNodeCount(u64(nodeCount) * 2 + primCount + u64(m_leafPrims.size()) * 2))
+	{
+		m_nodes.clear();
+		m_leafPrims.clear();
+		return;
+	}
+
+	const u32 triangleRecordOffset = nodeCount * 2 + primCount;
+
+	m_packedNodes.resize(triangleRecordOffset + (u32)m_leafPrims.size() * 2);
+
+	for (u32 i = 0; i < nodeCount; ++i)
+	{
+		const BVHNode& node = m_nodes[i];
+
+		if (!node.isLeaf())
+		{
+			packInternalNode(node, &m_packedNodes[i * 2]);
+		}
+		else if (node.prim & BVHNode::LeafMask)
+		{
+			packMultiPrimLeafNode(node, triangleRecordOffset, 2, &m_packedNodes[i * 2]);
+		}
+		else
+		{
+			packLeafNode(node, triangles, nodeCount, &m_packedNodes[i * 2]);
+		}
+	}
+
+	for (u32 primId = 0; primId < primCount; ++primId)
+	{
+		packVertex(triangles, primId, m_packedNodes[nodeCount * 2 + primId]);
+	}
+
+	for (u32 i = 0; i < (u32)m_leafPrims.size(); ++i)
+	{
+		packTriangleRecord(triangles, m_leafPrims[i], nodeCount, &m_packedNodes[triangleRecordOffset + i * 2]);
+	}
+}
+
+void BVHBuilder::build(const Box3* bounds, u32 primCount, const BVHBuilderSettings& inSettings)
+{
+	BVHBuilderSettings settings = sanitizeSettings(inSettings);
+	settings.presplitBudget = 0.0f;
+
+	m_nodes.clear();
+
+	m_leafPrims.clear();
+	m_unoptimizedSahCost = 0.0f;
+
+	m_packedNodes.clear();
+	m_positionVertices.clear();
+
+	std::vector<TempNode> tempNodes;
+	tempNodes.reserve(primCount * 2 - 1);
+
+	for (u32 primId = 0; primId < primCount; ++primId)
+	{
+		TempNode node;
+		setBounds(node, bounds[primId].m_min, bounds[primId].m_max);
+
+		node.prim = primId;
+		node.left = BVHNode::InvalidMask;
+		node.right = BVHNode::InvalidMask;
+		tempNodes.push_back(node);
+	}
+
+	std::unique_ptr<TaskScheduler> scheduler;
+	if (settings.threadCount != 1 && primCount >= settings.parallelBuildThreshold)
+	{
+		scheduler.reset(new TaskScheduler(settings.threadCount));
+	}
+
+	buildHierarchy(tempNodes, nullptr, settings, scheduler.get(), m_nodes, m_leafPrims, m_unoptimizedSahCost);
+}
+
+void BVHBuilder::refit(const float* vertices, u32 stride, const u32* indices,
+	std::vector<BVHBufferRange>* outChangedRanges, TaskScheduler* scheduler)
+{
+	static const u32 SubtreeGrainSize = 16384;
+
+	if (outChangedRanges)
+	{
+		outChangedRanges->clear();
+	}
+
+	if (m_nodes.empty())
+	{
+		return;
+	}
+
+	const bool indexed = m_triangleFormat == BVHTriangleFormat::Indexed;
+
+	// Vertex records are either first vertices of all triangles or unique positions, followed by triangle records
+	const u32 nodeCount = (u32)m_nodes.size();
+	const u32 leafPrimCount = (u32)m_leafPrims.size();
+	const u32 triangleRecordSize = indexed ? 1 : 2;
+
+	std::vector<u32> nodeOffsets;
+	const u32 nodeRecordCount = indexed ? u32(calculateIndexedNodeOffsets(m_nodes, nodeOffsets)) : nodeCount * 2;
+	const u32 vertexRecordCount = (u32)m_packedNodes.size() - nodeRecordCount - leafPrimCount * triangleRecordSize;
+	const u32 triangleRecordOffset = nodeRecordCount + vertexRecordCount;
+
+	const TriangleList triangles = { vertices, stride, indices };
+
+	std::vector<u8> changedFlags(m_packedNodes.size());
+
+	auto storePackedData = [&](u32 index, const BVHPackedNode* data, u32 count)
+	{
+		for (u32 i = 0; i < count; ++i)
+		{
+			if (memcmp(&m_packedNodes[index + i], &data[i], sizeof(BVHPackedNode)))
+			{
+				m_packedNodes[index + i] = data[i];
+				changedFlags[index + i] = 1;
+			}
+		}
+	};
+
+	// Skip pointers of indexed nodes are record offsets
+	auto getPackedNode = [&](const BVHNode& node)
+	{
+		BVHNode packedNode = node;
+		if (indexed)
+		{
+			packedNode.next = getIndexedNext(node, nodeOffsets);
+		}
+		return packedNode;
+	};
+
+	// Left child is the next node and right child is the miss link of the left child
+	auto refitNode = [&](u32 nodeId)
+	{
+		BVHNode& node = m_nodes[nodeId];
+		BVHPackedNode data[2];
+
+		if (node.isLeaf() && (node.prim & BVHNode::LeafMask))
+		{
+			Box3 box;
+			box.expandInit();
+
+			for (u32 i = node.prim & ~BVHNode::LeafMask; ; ++i)
+			{
+				const u32 prim = m_leafPrims[i] & ~BVHNode::LeafMask;
+				box.expand(triangles.getVertex(prim, 0));
+				box.expand(triangles.getVertex(prim, 1));
+				box.expand(triangles.getVertex(prim, 2));
+
+				// Indexed triangle records do not depend on vertex positions
+				if (!indexed)
+				{
+					BVHPackedNode recordData[2];
+					packTriangleRecord(triangles, m_leafPrims[i], nodeCount, recordData);
+					storePackedData(triangleRecordOffset + i * 2, recordData, 2);
+				}
+
+				if (m_leafPrims[i] & BVHNode::LeafMask)
+				{
+					break;
+				}
+			}
+
+			setBounds(node, box.m_min, box.m_max);
+			packMultiPrimLeafNode(getPackedNode(node), triangleRecordOffset, triangleRecordSize, data);
+		}
+		else if (node.isLeaf())
+		{
+			Box3 box;
+			box.expandInit();
+			box.expand(triangles.getVertex(node.prim, 0));
+			box.expand(triangles.getVertex(node.prim, 1));
+			box.expand(triangles.getVertex(node.prim, 2));
+
+			setBounds(node, box.m_min, box.m_max);
+
+			// Indexed leaf records only hold position record indices, which stay the same
+			if (indexed)
+			{
+				return;
+			}
+
+			packLeafNode(node, triangles, nodeCount, data);
+		}
+		else
+		{
+			const BVHNode& left = m_nodes[nodeId + 1];
+			const BVHNode& right = m_nodes[left.next];
+
+			__m128 bboxMin = _mm_min_ps(_mm_loadu_ps(&left.bboxMin.x), _mm_loadu_ps(&right.bboxMin.x));
+			__m128 bboxMax = _mm_max_ps(_mm_loadu_ps(&left.bboxMax.x), _mm_loadu_ps(&right.bboxMax.x));
+
+			setBounds(node, extractVec3(bboxMin), extractVec3(bboxMax));
+			packInternalNode(getPackedNode(node), data);
+		}
+
+		storePackedData(indexed ? nodeOffsets[nodeId] : nodeId * 2, data, 2);
+	};
+
+	// Nodes in depth-first order are found by following the traversal path of a ray that hits every node.
+	// Every subtree occupies a contiguous range of this order, which ends at the miss link of its root.
+	// With BVHNodeLayout::DepthFirst this is the same as the memory order.
+	std::vector<u32> depthFirstNodes(nodeCount);
+	std::vector<u32> depthFirstIndices(nodeCount);
+
+	for (u32 nodeId = 0, index = 0; nodeId != BVHNode::InvalidMask; ++index)
+	{
+		depthFirstNodes[index] = nodeId;
+		depthFirstIndices[nodeId] = index;
+		nodeId = m_nodes[nodeId].isLeaf() ? m_nodes[nodeId].next : nodeId + 1;
+	}
+
+	auto getSubtreeEnd = [&](u32 nodeId)
+	{
+		return m_nodes[nodeId].next == BVHNode::InvalidMask ? nodeCount : depthFirstIndices[m_nodes[nodeId].next];
+	};
+
+	// The tree is cut into small subtrees that are refitted in parallel,
+	// nodes above them are refitted afterwards in reverse discovery order.
+	std::vector<u32> subtreeRoots;
+	std::vector<u32> topNodes;
+	std::vector<u32> stack;
+
+	stack.push_back(0);
+	while (!stack.empty())
+	{
+		const u32 nodeId = stack.back();
+		stack.pop_back();
+
+		if (m_nodes[nodeId].isLeaf() || getSubtreeEnd(nodeId) - depthFirstIndices[nodeId] < SubtreeGrainSize)
+		{
+			subtreeRoots.push_back(nodeId);
+		}
+		else
+		{
+			topNodes.push_back(nodeId);
+			stack.push_back(nodeId + 1);
+			stack.push_back(m_nodes[nodeId + 1].next);
+		}
+	}
+
+	parallelFor(scheduler, (u32)subtreeRoots.size(), 1, [&](u32 begin, u32 end)
+	{
+		for (u32 i = begin; i < end; ++i)
+		{
+			const u32 root = subtreeRoots[i];
+			for (u32 index = getSubtreeEnd(root); index-- > depthFirstIndices[root];)
+			{
+				refitNode(depthFirstNodes[index]);
+			}
+		}
+	});
+
+	for (u32 i = (u32)topNodes.size(); i-- > 0;)
+	{
+		refitNode(topNodes[i]);
+	}
+
+	parallelFor(scheduler, vertexRecordCount, SubtreeGrainSize, [&](u32 begin, u32 end)
+	{
+		for (u32 i = begin; i < end; ++i)
+		{
+			BVHPackedNode data;
+			if (indexed)
+			{
+				packPosition(triangles, m_positionVertices[i], data);
+			}
+			else
+			{
+				packVertex(triangles, i, data);
+			}
+			storePackedData(nodeRecordCount + i, &data, 1);
+		}
+	});
+
+	if (outChangedRanges)
+	{
+		for (u32 i = 0; i < (u32)changedFlags.size(); ++i)
+		{
+			if (!changedFlags[i])
+			{
+				continue;
+			}
+
+			const u64 offset = u64(i) * sizeof(BVHPackedNode);
+			if (!outChangedRanges->empty() && outChangedRanges->back().offset + outChangedRanges->back().size == offset)
+			{
+				outChangedRanges->back().size += sizeof(BVHPackedNode);
+			}
+			else
+			{
+				BVHBufferRange range = { offset, sizeof(BVHPackedNode) };
+				outChangedRanges->push_back(range);
+			}
+		}
+	}
+}
+
+void BVHBuilder::sortChildren(u32 octant)
+{
+	const u32 nodeCount = (u32)m_nodes.size();
+	if (nodeCount == 0)
+	{
+		return;
+	}
+
+	const Vec3 octantDirection(
+		(octant & 1) ? -1.0f : 1.0f,
+		(octant & 2) ? -1.0f : 1.0f,
+		(octant & 4) ? -1.0f : 1.0f);
+
+	struct VisitItem
+	{
+		u32 nodeId;
+		u32 nextId;
+	};
+
+	// New depth-first order and skip pointers are found first, since skip pointers refer to nodes visited later
+	std::vector<u32> visitOrder(nodeCount);
+	std::vector<u32> nextIds(nodeCount);
+	std::vector<VisitItem> stack;
+	stack.push_back({ 0, BVHNode::InvalidMask });
+
+	u32 order = 0;
+
+	while (!stack.empty())
+	{
+		const VisitItem item = stack.back();
+		stack.pop_back();
+
+		visitOrder[item.nodeId] = order++;
+		nextIds[item.nodeId] = item.nextId;
+
+		if (m_nodes[item.nodeId].isLeaf())
+		{
+			continue;
+		}
+
+		// Left child is the next node and right child is the miss link of the left child
+		u32 first = item.nodeId + 1;
+		u32 second = m_nodes[first].next;
+
+		// Child whose center is closer to the ray origin along the octant direction is visited first.
+		// Children at the same distance keep the order chosen by the builder.
+		if (dot(getCenter(m_nodes[second]) - getCenter(m_nodes[first]), octantDirection) < 0.0f)
+		{
+			std::swap(first, second);
+		}
+
+		stack.push_back({ second, item.nextId });
+		stack.push_back({ first, second });
+	}
+
+	std::vector<BVHNode> nodes(nodeCount);
+
+	for (u32 oldIndex = 0; oldIndex < nodeCount; ++oldIndex)
+	{
+		const u32 newIndex = visitOrder[oldIndex];
+
+		nodes[newIndex] = m_nodes[oldIndex];
+		nodes[newIndex].next = nextIds[oldIndex] == BVHNode::InvalidMask
+			? BVHNode::InvalidMask
+			: visitOrder[nextIds[oldIndex]];
+	}
+
+	// Indexed nodes are addressed by record offset, other formats use two records per node
+	std::vector<u32> oldOffsets;
+	std::vector<u32> newOffsets;
+	const bool indexed = m_triangleFormat == BVHTriangleFormat::Indexed;
+
+	if (indexed)
+	{
+		calculateIndexedNodeOffsets(m_nodes, oldOffsets);
+		calculateIndexedNodeOffsets(nodes, newOffsets);
+	}
+
+	std::vector<BVHPackedNode> packedNodes(getPackedNodeRecordCount());
+
+	for (u32 oldIndex = 0; oldIndex < nodeCount; ++oldIndex)
+	{
+		const u32 newIndex = visitOrder[oldIndex];
+		const BVHNode& node = nodes[newIndex];
+
+		const u32 oldOffset = indexed ? oldOffsets[oldIndex] : oldIndex * 2;
+		const u32 newOffset = indexed ? newOffsets[newIndex] : newIndex * 2;
+		const u32 recordCount = indexed && isIndexedLeafRecord(node) ? 1 : 2;
+
+		// Skip pointer is stored in the last element of every packed node format
+		std::copy(&m_packedNodes[oldOffset], &m_packedNodes[oldOffset] + recordCount, &packedNodes[newOffset]);
+		packedNodes[newOffset + recordCount - 1].d = indexed ? getIndexedNext(node, newOffsets) : node.next;
+	}
+
+	m_nodes.swap(nodes);
+	std::copy(packedNodes.begin(), packedNodes.end(), m_packedNodes.begin());
+}
+
+u32 BVHBuilder::getPackedNodeRecordCount() const
+{
+	if (m_triangleFormat != BVHTriangleFormat::Indexed)
+	{
+		return (u32)m_nodes.size() * 2;
+	}
+
+	u32 count = 0;
+	for (const BVHNode& node : m_nodes)
+	{
+		count += isIndexedLeafRecord(node) ? 1 : 2;
+	}
+
+	return count;
+}
+
+float BVHBuilder::calculateSahCost(float traversalCost, float intersectionCost) const
+{
+	if (m_nodes.empty())
+	{
+		return 0.0f;
+	}
+
+	const float rootSurfaceArea = bboxSurfaceArea(m_nodes[0].bboxMin, m_nodes[0].bboxMax);
+	if (rootSurfaceArea == 0.0f)
+	{
+		return 0.0f;
+	}
+
+	double cost = 0.0;
+	for (const BVHNode& node : m_nodes)
+	{
+		const float nodeCost = node.isLeaf()
+			? intersectionCost * getLeafPrimCount(node, m_leafPrims)
+			: traversalCost;
+		cost += nodeCost * bboxSurfaceArea(node.bboxMin, node.bboxMax);
+	}
+
+	return float(cost / rootSurfaceArea);
 }
@@ -5,6 +5,8 @@
 
 #include <vector>
 
+class TaskScheduler;
+
 struct BVHNode
 {
 	static const u32 LeafMask = 0x80000000;
@@ -24,11 +26,143 @@ struct BVHPackedNode
 	u32 a, b, c, d;
 };
 
+// Byte ranges are 64 bit, since packed data of up to MaxPackedNodeCount records exceeds 4 GB
+struct BVHBufferRange
+{
+	u64 offset; // In bytes, from the start of packed node data
+	u64 size;   // In bytes
+};
+
+enum class BVHBuildMethod
+{
+	TopDown, // Recursive top-down partitioning using split mode
+	Linear,  // Linear BVH: hierarchy emitted from sorted Morton codes of primitive centroids
+	HierarchicalLinear, // HLBVH: Morton code clusters built with top-down SAH, then SAH over cluster roots
+	Ploc, // Bottom-up parallel locally-ordered clustering of Morton-sorted primitives
+	SpatialSplit, // SBVH: top-down SAH with spatial splits that may reference a primitive from multiple leaves
+};
+
+enum class BVHSplitMode
+{
+	Sweep,  // Exact SAH: primitives are sorted along each axis at every node
+	Binned, // Approximate SAH: split candidates are evaluated on centroid bins
+	PresortedSweep, // Exact SAH: primitives are sorted once per axis and sorted lists are partitioned at every node
+};
+
+enum class BVHTriangleFormat
+{
+	Edges,   // Leaves store two triangle edges, followed by one first vertex record per triangle
+	Indexed, // Leaves store indices into a buffer of unique vertex positions
+};
+
+enum class BVHNodeLayout
+{
+	DepthFirst, // Every subtree occupies a contiguous range of nodes
+	Treelet,    // Subtrees are grouped into treelets of up to layoutTreeletSize nodes, which are stored contiguously
+};
+
+struct BVHBuilderSettings
+{
+	static const u32 MaxBinCount = 64;
+	static const u32 MaxTreeletSize = 7;
+	static const u32 MaxLeafSize = 16;
+
+	BVHBuildMethod method = BVHBuildMethod::TopDown;
+	BVHSplitMode splitMode = BVHSplitMode::Sweep;
+	u32 binCount = 32; // Only used by BVHSplitMode::Binned
+	u32 mortonCodeBits = 63; // Either 30 or 63. Used by Linear, HierarchicalLinear and Ploc build methods
+	u32 clusterBits = 12; // Morton code prefix length that groups primitives into HLBVH clusters
+	u32 plocRadius = 16; // Nearest neighbor search radius, in clusters along the Morton curve, used by PLOC
+
+	// Spatial splits are considered when overlap of object split children exceeds this fraction of root surface area
+	float spatialSplitOverlap = 1e-5f;
+	// Maximum number of duplicated primitive references, as a fraction of primitive count
+	float spatialSplitBudget = 0.3f;
+
+	// Triangles with bounding box surface area above this multiple of triangle area are candidates for pre-splitting
+	float presplitThreshold = 10.0f;
+	// Maximum number of extra references created by pre-splitting, as a fraction of primitive count. Zero disables it.
+	float presplitBudget = 0.0f;
+
+	// Subtrees with up to maxLeafSize primitives are collapsed into a single leaf when this reduces SAH cost.
+	// Costs are relative to each other and are also used by BVHBuilder::calculateSahCost().
+	u32 maxLeafSize = 1; // Up to MaxLeafSize, one disables multi-primitive leaves
+	float traversalCost = 1.0f; // Cost of intersecting a ray with an internal node
+	float intersectionCost = 1.0f; // Cost of intersecting a ray with a primitive
+
+	// Layout of triangle data in BVHBuilder::m_packedNodes
+	BVHTriangleFormat triangleFormat = BVHTriangleFormat::Edges;
+
+	// Memory order of nodes. Left child always directly follows its parent and right child is stored after its parent,
+	// so stackless traversal works the same way with every layout.
+	BVHNodeLayout nodeLayout = BVHNodeLayout::DepthFirst;
+	u32 layoutTreeletSize = 128; // Nodes per treelet, 128 nodes of 32 bytes fill a 4 KB page
+
+	// Treelet restructuring passes that run after the build and reduce SAH cost by rearranging small subtrees.
+	// Zero disables the optimization.
+	u32 treeletPasses = 0;
+	u32 treeletSize = 7; // Leaves per treelet, up to MaxTreeletSize
+
+	// Subtrees are built as parallel tasks. Output is identical to the single-threaded build.
+	u32 threadCount = 0; // Zero uses all available hardware threads, one disables multithreading
+	u32 parallelBuildThreshold = 4096; // Subtrees with fewer primitives are built serially
+
+	// With BVHSplitMode::Binned, larger ranges distribute binning and partitioning across threads.
+	// Bounds of larger ranges are calculated in parallel with every split mode.
+	u32 parallelBinningThreshold = 1000000;
+};
+
 struct BVHBuilder
 {
+	// Packed data is addressed by u32 indices with LeafMask reserved for leaf flags, so a BVH of a single mesh
+	// may not exceed this many vec4 records. Larger meshes have to be split into several BVHs.
+	static const u32 MaxPackedNodeCount = BVHNode::LeafMask;
+
+	// Conservative number of triangles that always fit into maxPackedNodeCount records with the given settings,
+	// assuming that every reference allowed by pre-splitting and spatial split budgets is created.
+	// The record count is clamped to MaxPackedNodeCount, smaller values fit the BVH into a device buffer size limit.
+	static u32 getMaxPrimCount(const BVHBuilderSettings& settings = BVHBuilderSettings(),
+		u64 maxPackedNodeCount = MaxPackedNodeCount);
+
+	// Logs an error and returns false if packedNodeCount exceeds MaxPackedNodeCount
+	static bool validatePackedNodeCount(u64 packedNodeCount);
+
 	std::vector<BVHNode> m_nodes;
 	std::vector<BVHPackedNode> m_packedNodes;
-	void build(const float* vertices, u32 stride, const u32* indices, u32 primCount);
+	std::vector<u32> m_leafPrims; // Primitives of multi-primitive leaves, the last one in each leaf is marked with LeafMask
+	float m_unoptimizedSahCost = 0.0f; // SAH cost before treelet optimization, zero if it was not enabled
+
+	BVHTriangleFormat m_triangleFormat = BVHTriangleFormat::Edges;
+	std::vector<u32> m_positionVertices; // Source vertex of each unique position, only used by BVHTriangleFormat::Indexed
+
+	// Builds m_nodes and m_packedNodes over a triangle mesh. If the packed data would exceed MaxPackedNodeCount,
+	// an error is logged and the BVH is left empty.
+	void build(const float* vertices, u32 stride, const u32* indices, u32 primCount,
+		const BVHBuilderSettings& settings = BVHBuilderSettings());
+
+	// Builds m_nodes over arbitrary primitive bounds, such as mesh instances of a two-level BVH. Leaves reference
+	// primitives by their index in the bounds array. m_packedNodes is left empty, since there is no triangle data.
+	// Spatial split method falls back to object splits and pre-splitting is disabled.
+	void build(const Box3* bounds, u32 primCount, const BVHBuilderSettings& settings = BVHBuilderSettings());
+
+	// Recomputes bounds and packed triangle data for updated vertex positions without changing the tree topology.
+	// Indices must be the same as in the last build. Leaves created by spatial splits or pre-splitting are refitted
+	// to whole triangle bounds. With BVHTriangleFormat::Indexed, vertices that had identical positions during the build
+	// must keep identical positions. Byte ranges of m_packedNodes that were modified are optionally written to outChangedRanges.
+	void refit(const float* vertices, u32 stride, const u32* indices,
+		std::vector<BVHBufferRange>* outChangedRanges = nullptr, TaskScheduler* scheduler = nullptr);
+
+	// Reorders nodes, so that children of every node are visited front-to-back by rays in the given direction octant.
+	// Bits 0, 1 and 2 of the octant are set for negative X, Y and Z direction. Nodes are stored in depth-first order
+	// afterwards. Only the node part of m_packedNodes changes, triangle data stays the same.
+	void sortChildren(u32 octant);
+
+	// Number of leading m_packedNodes records that hold nodes. Nodes take two records each, except single-triangle
+	// leaves of BVHTriangleFormat::Indexed that take one.
+	u32 getPackedNodeRecordCount() const;
+
+	// Surface area heuristic cost of the tree in m_nodes, normalized by root surface area
+	float calculateSahCost(float traversalCost = 1.0f, float intersectionCost = 1.0f) const;
 };
 
 
@@ -0,0 +1,572 @@
+#include "BVHCache.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+static const u32 CacheMagic = 0x43485642; // 'BVHC'
+static const u32 SectionAlignment = 16;
+
+struct CacheSection
+{
+	u64 offset; // In bytes, from the start of the file
+	u64 size;   // In bytes
+};
+
+enum CacheSectionIndex
+{
+	CacheSection_PackedNodes,
+	CacheSection_Nodes,
+	CacheSection_LeafPrims,
+	CacheSection_PositionVertices,
+
+	CacheSection_Count
+};
+
+struct CacheHeader
+{
+	u32 magic;
+	u32 version;
+	u64 key;
+	u64 payloadHash; // Hash of all bytes after the header
+	u32 triangleFormat;
+	float unoptimizedSahCost;
+	CacheSection sections[CacheSection_Count];
+};
+
+// 64 bit multiplicative hash over 8 byte words. Fast enough to validate large files on load,
+// but not meant to be collision resistant against deliberate tampering.
+class Hasher
+{
+public:
+
+	void add(const void* data, u64 size)
+	{
+		const u8* bytes = static_cast<const u8*>(data);
+
+		u64 i = 0;
+		for (; i + 8 <= size; i += 8)
+		{
+			u64 word;
+			memcpy(&word, bytes + i, sizeof(word));
+			mix(word);
+		}
+
+		if (i < size)
+		{
+			u64 word = 0;
+			memcpy(&word, bytes + i, size - i);
+			mix(word);
+		}
+
+		mix(size);
+	}
+
+	template <typename T>
+	void addValue(const T& value)
+	{
+		add(&value, sizeof(value));
+	}
+
+	u64 get() const
+	{
+		u64 h = m_state;
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		return h;
+	}
+
+private:
+
+	void mix(u64 word)
+	{
+		m_state = (m_state ^ word) * 0x9e3779b97f4a7c15ull;
+		m_state ^= m_state >> 29;
+	}
+
+	u64 m_state = 0xcbf29ce484222325ull;
+};
+
+inline u64 alignSectionOffset(u64 offset)
+{
+	return (offset + SectionAlignment - 1) & ~u64(SectionAlignment - 1);
+}
+
+// Hash of alignment padding and data of all sections, which must be within the file
+u64 calculatePayloadHash(const u8* data, const CacheHeader& header)
+{
+	Hasher hasher;
+	u64 offset = sizeof(CacheHeader);
+	for (u32 i = 0; i < CacheSection_Count; ++i)
+	{
+		const CacheSection& section = header.sections[i];
+		hasher.add(data + offset, section.offset - offset);
+		hasher.add(data + section.offset, section.size);
+		offset = section.offset + section.size;
+	}
+	return hasher.get();
+}
+
+}
+
+bool MappedFile::open(const char* filename)
+{
+	close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	const void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data)
+	{
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	m_file = file;
+	m_mapping = mapping;
+	m_data = static_cast<const u8*>(data);
+	m_size = (u64)fileSize.QuadPart;
+#else
+	int file = ::open(filename, O_RDONLY);
+	if (file < 0)
+	{
+		return false;
+	}
+
+	struct stat fileStat;
+	if (fstat(file, &fileStat) != 0 || fileStat.st_size == 0)
+	{
+		::close(file);
+		return false;
+	}
+
+	void* data = mmap(nullptr, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+
+	// Mapping remains valid after the descriptor is closed
+	::close(file);
+
+	if (data == MAP_FAILED)
+	{
+		return false;
+	}
+
+	m_data = static_cast<const u8*>(data);
+	m_size = (u64)fileStat.st_size;
+#endif
+
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (!m_data)
+	{
+		return;
+	}
+
+#ifdef _WIN32
+	UnmapViewOfFile(m_data);
+	CloseHandle(m_mapping);
+	CloseHandle(m_file);
+	m_file = nullptr;
+	m_mapping = nullptr;
+#else
+	munmap(const_cast<u8*>(m_data), (size_t)m_size);
+#endif
+
+	m_data = nullptr;
+	m_size = 0;
+}
+
+u64 BVHCache::calculateKey(const float* vertices, u32 stride, u32 vertexCount, const u32* indices, u32 primCount,
+	const BVHBuilderSettings& settings)
+{
+	Hasher hasher;
+
+	hasher.addValue(Version);
+
+	// Only positions affect the BVH, other vertex attributes are ignored
+	hasher.addValue(vertexCount);
+	for (u32 i = 0; i < vertexCount; ++i)
+	{
+		hasher.add(vertices + stride * i, sizeof(float) * 3);
+	}
+
+	hasher.addValue(primCount);
+	hasher.add(indices, u64(primCount) * 3 * sizeof(u32));
+
+	// Thread count and parallel build threshold are omitted, since the result does not depend on them
+	hasher.addValue(u32(settings.method));
+	hasher.addValue(u32(settings.splitMode));
+	hasher.addValue(settings.binCount);
+	hasher.addValue(settings.mortonCodeBits);
+	hasher.addValue(settings.clusterBits);
+	hasher.addValue(settings.plocRadius);
+	hasher.addValue(settings.spatialSplitOverlap);
+	hasher.addValue(settings.spatialSplitBudget);
+	hasher.addValue(settings.presplitThreshold);
+	hasher.addValue(settings.presplitBudget);
+	hasher.addValue(settings.maxLeafSize);
+	hasher.addValue(settings.traversalCost);
+	hasher.addValue(settings.intersectionCost);
+	hasher.addValue(u32(settings.triangleFormat));
+	hasher.addValue(u32(settings.nodeLayout));
+	hasher.addValue(settings.layoutTreeletSize);
+	hasher.addValue(settings.treeletPasses);
+	hasher.addValue(settings.treeletSize);
+	hasher.addValue(settings.parallelBinningThreshold);
+
+	return hasher.get();
+}
+
+u64 BVHCache::calculateStreamedKey(u64 key)
+{
+	static const u32 StreamedMarker = 0x5354524D; // 'STRM'
+
+	Hasher hasher;
+	hasher.addValue(key);
+	hasher.addValue(StreamedMarker);
+	return hasher.get();
+}
+
+u64 BVHCache::calculateSegmentKey(u64 key, u32 firstPrim, u32 primCount)
+{
+	static const u32 SegmentMarker = 0x5345474D; // 'SEGM'
+
+	Hasher hasher;
+	hasher.addValue(key);
+	hasher.addValue(SegmentMarker);
+	hasher.addValue(firstPrim);
+	hasher.addValue(primCount);
+	return hasher.get();
+}
+
+bool BVHCache::write(const char* filename, u64 key, const BVHBuilder& bvh)
+{
+	BVHCacheWriter writer;
+
+	bool success = writer.open(filename, key, bvh.m_triangleFormat, bvh.m_unoptimizedSahCost,
+		bvh.m_packedNodes.size(), bvh.m_nodes.size(), bvh.m_leafPrims.size(), bvh.m_positionVertices.size());
+
+	success = success && writer.write(bvh.m_packedNodes.data(), bvh.m_packedNodes.size() * sizeof(BVHPackedNode));
+	success = success && writer.write(bvh.m_nodes.data(), bvh.m_nodes.size() * sizeof(BVHNode));
+	success = success && writer.write(bvh.m_leafPrims.data(), bvh.m_leafPrims.size() * sizeof(u32));
+	success = success && writer.write(bvh.m_positionVertices.data(), bvh.m_positionVertices.size() * sizeof(u32));
+
+	return success && writer.close();
+}
+
+bool BVHCache::open(const char* filename, u64 key)
+{
+	close();
+
+	if (!m_file.open(filename))
+	{
+		return false;
+	}
+
+	const u8* data = m_file.data();
+	const u64 fileSize = m_file.size();
+
+	CacheHeader header;
+	if (fileSize < sizeof(header))
+	{
+		close();
+		return false;
+	}
+
+	memcpy(&header, data, sizeof(header));
+
+	if (header.magic != CacheMagic || header.version != Version || header.key != key)
+	{
+		close();
+		return false;
+	}
+
+	// Sections must be aligned, ordered, within the file and contain whole elements
+	static const u64 elementSizes[CacheSection_Count] = { sizeof(BVHPackedNode), sizeof(BVHNode), sizeof(u32), sizeof(u32) };
+
+	u64 offset = sizeof(CacheHeader);
+	for (u32 i = 0; i < CacheSection_Count; ++i)
+	{
+		const CacheSection& section = header.sections[i];
+		if (section.offset != alignSectionOffset(offset)
+			|| section.size > fileSize - section.offset
+			|| section.offset > fileSize
+			|| section.size % elementSizes[i] != 0
+			|| section.size / elementSizes[i] > 0xFFFFFFFF)
+		{
+			close();
+			return false;
+		}
+		offset = section.offset + section.size;
+	}
+
+	// Packed data beyond the index range of the format would be misinterpreted by traversal
+	if (header.sections[CacheSection_PackedNodes].size / sizeof(BVHPackedNode) > BVHBuilder::MaxPackedNodeCount)
+	{
+		close();
+		return false;
+	}
+
+	if (offset != fileSize)
+	{
+		close();
+		return false;
+	}
+
+	if (calculatePayloadHash(data, header) != header.payloadHash)
+	{
+		close();
+		return false;
+	}
+
+	m_packedNodes = reinterpret_cast<const BVHPackedNode*>(data + header.sections[CacheSection_PackedNodes].offset);
+	m_nodes = reinterpret_cast<const BVHNode*>(data + header.sections[CacheSection_Nodes].offset);
+	m_leafPrims = reinterpret_cast<const u32*>(data + header.sections[CacheSection_LeafPrims].offset);
+	m_positionVertices = reinterpret_cast<const u32*>(data + header.sections[CacheSection_PositionVertices].offset);
+
+	m_packedNodeCount = u32(header.sections[CacheSection_PackedNodes].size / sizeof(BVHPackedNode));
+	m_nodeCount = u32(header.sections[CacheSection_Nodes].size / sizeof(BVHNode));
+	m_leafPrimCount = u32(header.sections[CacheSection_LeafPrims].size / sizeof(u32));
+	m_positionVertexCount = u32(header.sections[CacheSection_PositionVertices].size / sizeof(u32));
+
+	m_triangleFormat = BVHTriangleFormat(header.triangleFormat);
+	m_unoptimizedSahCost = header.unoptimizedSahCost;
+
+	return true;
+}
+
+void BVHCache::close()
+{
+	m_file.close();
+
+	m_packedNodes = nullptr;
+	m_nodes = nullptr;
+	m_leafPrims = nullptr;
+	m_positionVertices = nullptr;
+
+	m_packedNodeCount = 0;
+	m_nodeCount = 0;
+	m_leafPrimCount = 0;
+	m_positionVertexCount = 0;
+}
+
+void BVHCache::load(BVHBuilder& bvh) const
+{
+	bvh.m_packedNodes.assign(m_packedNodes, m_packedNodes + m_packedNodeCount);
+	bvh.m_nodes.assign(m_nodes, m_nodes + m_nodeCount);
+	bvh.m_leafPrims.assign(m_leafPrims, m_leafPrims + m_leafPrimCount);
+	bvh.m_positionVertices.assign(m_positionVertices, m_positionVertices + m_positionVertexCount);
+	bvh.m_triangleFormat = m_triangleFormat;
+	bvh.m_unoptimizedSahCost = m_unoptimizedSahCost;
+}
+
+bool BVHCacheWriter::open(const char* filename, u64 key, BVHTriangleFormat triangleFormat, float unoptimizedSahCost,
+	u64 packedNodeCount, u64 nodeCount, u64 leafPrimCount, u64 positionVertexCount)
+{
+	static_assert(SectionCount == CacheSection_Count, "Section count must match the file format");
+
+	discard();
+
+	m_key = key;
+	m_triangleFormat = triangleFormat;
+	m_unoptimizedSahCost = unoptimizedSahCost;
+
+	m_sectionSizes[CacheSection_PackedNodes] = packedNodeCount * sizeof(BVHPackedNode);
+	m_sectionSizes[CacheSection_Nodes] = nodeCount * sizeof(BVHNode);
+	m_sectionSizes[CacheSection_LeafPrims] = leafPrimCount * sizeof(u32);
+	m_sectionSizes[CacheSection_PositionVertices] = positionVertexCount * sizeof(u32);
+
+	u64 offset = sizeof(CacheHeader);
+	for (u32 i = 0; i < SectionCount; ++i)
+	{
+		m_sectionOffsets[i] = alignSectionOffset(offset);
+		offset = m_sectionOffsets[i] + m_sectionSizes[i];
+	}
+
+	m_file = fopen(filename, "wb");
+	if (!m_file)
+	{
+		return false;
+	}
+
+	m_filename = filename;
+	m_section = 0;
+	m_offset = 0;
+	m_failed = false;
+
+	// Header is written by close(), once the payload hash is known
+	return writePadding(sizeof(CacheHeader));
+}
+
+bool BVHCacheWriter::write(const void* data, u64 size)
+{
+	const u8* bytes = static_cast<const u8*>(data);
+
+	while (size != 0 && !m_failed)
+	{
+		// Skip finished sections, including empty ones
+		while (m_section < SectionCount && m_offset == m_sectionOffsets[m_section] + m_sectionSizes[m_section])
+		{
+			++m_section;
+		}
+
+		if (m_section == SectionCount || !writePadding(m_sectionOffsets[m_section]))
+		{
+			m_failed = true; // More data than declared
+			break;
+		}
+
+		const u64 sectionEnd = m_sectionOffsets[m_section] + m_sectionSizes[m_section];
+		const u64 chunkSize = min(size, sectionEnd - m_offset);
+
+		if (fwrite(bytes, 1, (size_t)chunkSize, m_file) != chunkSize)
+		{
+			m_failed = true;
+			break;
+		}
+
+		bytes += chunkSize;
+		size -= chunkSize;
+		m_offset += chunkSize;
+	}
+
+	return !m_failed;
+}
+
+bool BVHCacheWriter::close()
+{
+	if (!m_file)
+	{
+		return false;
+	}
+
+	const u64 fileSize = m_sectionOffsets[SectionCount - 1] + m_sectionSizes[SectionCount - 1];
+
+	// Data of every section must be complete, so only padding of trailing empty sections may be missing
+	u64 expectedOffset = m_sectionOffsets[0];
+	for (u32 i = 0; i < SectionCount; ++i)
+	{
+		if (m_sectionSizes[i] != 0)
+		{
+			expectedOffset = m_sectionOffsets[i] + m_sectionSizes[i];
+		}
+	}
+
+	bool success = !m_failed && m_offset >= expectedOffset && writePadding(fileSize);
+	success &= fclose(m_file) == 0;
+	m_file = nullptr;
+
+	CacheHeader header = {};
+	header.magic = CacheMagic;
+	header.version = BVHCache::Version;
+	header.key = m_key;
+	header.triangleFormat = u32(m_triangleFormat);
+	header.unoptimizedSahCost = m_unoptimizedSahCost;
+
+	for (u32 i = 0; i < SectionCount; ++i)
+	{
+		header.sections[i].offset = m_sectionOffsets[i];
+		header.sections[i].size = m_sectionSizes[i];
+	}
+
+	if (success)
+	{
+		MappedFile file;
+		success = file.open(m_filename.c_str()) && file.size() == fileSize;
+		if (success)
+		{
+			header.payloadHash = calculatePayloadHash(file.data(), header);
+		}
+	}
+
+	if (success)
+	{
+		FILE* f = fopen(m_filename.c_str(), "r+b");
+		success = f != nullptr;
+		if (f)
+		{
+			success &= fwrite(&header, sizeof(header), 1, f) == 1;
+			success &= fclose(f) == 0;
+		}
+	}
+
+	if (!success)
+	{
+		remove(m_filename.c_str());
+	}
+
+	m_filename.clear();
+
+	return success;
+}
+
+void BVHCacheWriter::discard()
+{
+	if (!m_file)
+	{
+		return;
+	}
+
+	fclose(m_file);
+	m_file = nullptr;
+
+	remove(m_filename.c_str());
+	m_filename.clear();
+}
+
+bool BVHCacheWriter::writePadding(u64 offset)
+{
+	static const u8 padding[SectionAlignment] = {};
+
+	while (m_offset < offset)
+	{
+		const u64 paddingSize = min<u64>(offset - m_offset, SectionAlignment);
+		if (fwrite(padding, 1, (size_t)paddingSize, m_file) != paddingSize)
+		{
+			return false;
+		}
+		m_offset += paddingSize;
+	}
+
+	return true;
+}
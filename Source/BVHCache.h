@@ -0,0 +1,129 @@
+#pragma once
+
+#include "BVHBuilder.h"
+
+#include <Rush/Rush.h>
+
+#include <stdio.h>
+#include <string>
+
+// Read-only memory-mapped file
+class MappedFile
+{
+	RUSH_DISALLOW_COPY_AND_ASSIGN(MappedFile);
+
+public:
+
+	MappedFile() = default;
+	~MappedFile() { close(); }
+
+	bool open(const char* filename);
+	void close();
+
+	const u8* data() const { return m_data; }
+	u64 size() const { return m_size; }
+
+private:
+
+	const u8* m_data = nullptr;
+	u64 m_size = 0;
+
+#ifdef _WIN32
+	void* m_file = nullptr;
+	void* m_mapping = nullptr;
+#endif
+};
+
+// Binary cache of a built BVH.
+// File starts with a header followed by 16 byte aligned arrays: packed nodes, nodes, multi-primitive leaf primitives
+// and unique position vertices. Arrays are used in place from the memory-mapped file.
+// Cache is keyed by a hash of vertex positions, indices and settings that affect the build result.
+// Files with a different version or key, inconsistent section sizes or a payload hash mismatch are rejected.
+class BVHCache
+{
+public:
+
+	static const u32 Version = 2;
+
+	static u64 calculateKey(const float* vertices, u32 stride, u32 vertexCount, const u32* indices, u32 primCount,
+		const BVHBuilderSettings& settings);
+
+	// Streaming builds produce a different tree than in-memory builds of the same mesh, so they are stored under a derived key
+	static u64 calculateStreamedKey(u64 key);
+
+	// Segments of a model that is too large for one BVH are cached separately, keyed by the model key and their triangle range
+	static u64 calculateSegmentKey(u64 key, u32 firstPrim, u32 primCount);
+
+	static bool write(const char* filename, u64 key, const BVHBuilder& bvh);
+
+	// Returns false if the file is missing, stale or corrupt
+	bool open(const char* filename, u64 key);
+	void close();
+
+	const BVHPackedNode* getPackedNodes() const { return m_packedNodes; }
+	u32 getPackedNodeCount() const { return m_packedNodeCount; }
+	u32 getNodeCount() const { return m_nodeCount; }
+
+	// Copies cached data into a builder, which is needed for wide BVH construction and refit
+	void load(BVHBuilder& bvh) const;
+
+private:
+
+	MappedFile m_file;
+
+	const BVHPackedNode* m_packedNodes = nullptr;
+	const BVHNode* m_nodes = nullptr;
+	const u32* m_leafPrims = nullptr;
+	const u32* m_positionVertices = nullptr;
+
+	u32 m_packedNodeCount = 0;
+	u32 m_nodeCount = 0;
+	u32 m_leafPrimCount = 0;
+	u32 m_positionVertexCount = 0;
+
+	BVHTriangleFormat m_triangleFormat = BVHTriangleFormat::Edges;
+	float m_unoptimizedSahCost = 0.0f;
+};
+
+// Writes a cache file in pieces, for BVHs that are produced incrementally and do not fit in memory at once.
+// Section sizes are declared up front and data is written in section order: packed nodes, nodes, leaf primitives
+// and position vertices. Alignment padding is inserted automatically. The result is the same as BVHCache::write().
+class BVHCacheWriter
+{
+	RUSH_DISALLOW_COPY_AND_ASSIGN(BVHCacheWriter);
+
+public:
+
+	BVHCacheWriter() = default;
+	~BVHCacheWriter() { discard(); }
+
+	bool open(const char* filename, u64 key, BVHTriangleFormat triangleFormat, float unoptimizedSahCost,
+		u64 packedNodeCount, u64 nodeCount, u64 leafPrimCount, u64 positionVertexCount);
+
+	bool write(const void* data, u64 size);
+
+	// Payload hash is calculated by reading the file back, then the header is written.
+	// Returns false and deletes the file if any write failed or the declared sections are incomplete.
+	bool close();
+
+	// Deletes an unfinished file
+	void discard();
+
+private:
+
+	bool writePadding(u64 offset);
+
+	FILE* m_file = nullptr;
+	std::string m_filename;
+
+	u64 m_key = 0;
+	BVHTriangleFormat m_triangleFormat = BVHTriangleFormat::Edges;
+	float m_unoptimizedSahCost = 0.0f;
+
+	static const u32 SectionCount = 4;
+	u64 m_sectionOffsets[SectionCount] = {};
+	u64 m_sectionSizes[SectionCount] = {};
+	u32 m_section = 0;
+	u64 m_offset = 0;
+	bool m_failed = false;
+};
@@ -0,0 +1,409 @@
+#include "BVHDynamic.h"
+
+#include <algorithm>
+
+namespace
+{
+
+inline float bboxSurfaceArea(const Box3& bbox)
+{
+	Vec3 extents = bbox.m_max - bbox.m_min;
+	return (extents.x * extents.y + extents.y * extents.z + extents.z * extents.x) * 2.0f;
+}
+
+inline Box3 unionBounds(const Box3& a, const Box3& b)
+{
+	Box3 result;
+	result.m_min = Vec3(min(a.m_min.x, b.m_min.x), min(a.m_min.y, b.m_min.y), min(a.m_min.z, b.m_min.z));
+	result.m_max = Vec3(max(a.m_max.x, b.m_max.x), max(a.m_max.y, b.m_max.y), max(a.m_max.z, b.m_max.z));
+	return result;
+}
+
+}
+
+void BVHDynamic::build(const Box3* bounds, u32 primCount, const BVHBuilderSettings& inSettings)
+{
+	clear();
+
+	if (primCount == 0)
+	{
+		return;
+	}
+
+	BVHBuilderSettings settings = inSettings;
+	settings.maxLeafSize = 1;
+
+	BVHBuilder builder;
+	builder.build(bounds, primCount, settings);
+
+	const std::vector<BVHNode>& nodes = builder.m_nodes;
+	const u32 nodeCount = (u32)nodes.size();
+
+	// Leaves take the first primCount slots, so that leaf handles are equal to primitive indices
+	std::vector<u32> nodeIds(nodeCount);
+	u32 internalNodeCount = 0;
+	for (u32 i = 0; i < nodeCount; ++i)
+	{
+		nodeIds[i] = nodes[i].isLeaf() ? nodes[i].prim : primCount + internalNodeCount++;
+	}
+
+	m_nodes.resize(nodeCount);
+
+	for (u32 i = 0; i < nodeCount; ++i)
+	{
+		Node& node = m_nodes[nodeIds[i]];
+		node.bounds.m_min = nodes[i].bboxMin;
+		node.bounds.m_max = nodes[i].bboxMax;
+
+		if (nodes[i].isLeaf())
+		{
+			node.prim = nodes[i].prim;
+			continue;
+		}
+
+		// Left child directly follows its parent and right child is the skip target of the left child
+		node.left = nodeIds[i + 1];
+		node.right = nodeIds[nodes[i + 1].next];
+		m_nodes[node.left].parent = nodeIds[i];
+		m_nodes[node.right].parent = nodeIds[i];
+	}
+
+	m_root = nodeIds[0];
+	m_leafCount = primCount;
+}
+
+void BVHDynamic::clear()
+{
+	m_nodes.clear();
+	m_freeNodes.clear();
+	m_root = BVHNode::InvalidMask;
+	m_leafCount = 0;
+}
+
+u32 BVHDynamic::insert(const Box3& bounds, u32 prim)
+{
+	const u32 leaf = allocateNode();
+
+	Node& node = m_nodes[leaf];
+	node.bounds = bounds;
+	node.prim = prim;
+
+	insertLeaf(leaf);
+	++m_leafCount;
+
+	return leaf;
+}
+
+void BVHDynamic::remove(u32 leaf)
+{
+	RUSH_ASSERT(m_nodes[leaf].isLeaf());
+
+	removeLeaf(leaf);
+	freeNode(leaf);
+	--m_leafCount;
+}
+
+void BVHDynamic::update(u32 leaf, const Box3& bounds)
+{
+	RUSH_ASSERT(m_nodes[leaf].isLeaf());
+
+	removeLeaf(leaf);
+	m_nodes[leaf].bounds = bounds;
+	insertLeaf(leaf);
+}
+
+void BVHDynamic::getNodes(std::vector<BVHNode>& outNodes) const
+{
+	outNodes.clear();
+
+	if (m_root == BVHNode::InvalidMask)
+	{
+		return;
+	}
+
+	outNodes.reserve(m_leafCount * 2 - 1);
+
+	// Parents are written before their children, so skip pointers can be resolved in the same order
+	std::vector<u32> order;
+	std::vector<u32> outIndices(m_nodes.size(), u32(BVHNode::InvalidMask));
+	std::vector<u32> stack;
+
+	order.reserve(m_leafCount * 2 - 1);
+	stack.push_back(m_root);
+
+	while (!stack.empty())
+	{
+		const u32 nodeId = stack.back();
+		stack.pop_back();
+
+		outIndices[nodeId] = (u32)order.size();
+		order.push_back(nodeId);
+
+		const Node& node = m_nodes[nodeId];
+		if (!node.isLeaf())
+		{
+			stack.push_back(node.right);
+			stack.push_back(node.left);
+		}
+	}
+
+	outNodes.resize(order.size());
+
+	for (u32 i = 0; i < (u32)order.size(); ++i)
+	{
+		const Node& node = m_nodes[order[i]];
+
+		BVHNode& outNode = outNodes[i];
+		outNode.bboxMin = node.bounds.m_min;
+		outNode.bboxMax = node.bounds.m_max;
+		outNode.prim = node.prim;
+
+		if (node.parent == BVHNode::InvalidMask)
+		{
+			outNode.next = BVHNode::InvalidMask;
+		}
+		else if (m_nodes[node.parent].left == order[i])
+		{
+			outNode.next = outIndices[m_nodes[node.parent].right];
+		}
+		else
+		{
+			outNode.next = outNodes[outIndices[node.parent]].next;
+		}
+	}
+}
+
+u32 BVHDynamic::allocateNode()
+{
+	if (m_freeNodes.empty())
+	{
+		m_nodes.push_back(Node());
+		return (u32)m_nodes.size() - 1;
+	}
+
+	const u32 nodeId = m_freeNodes.back();
+	m_freeNodes.pop_back();
+	m_nodes[nodeId] = Node();
+
+	return nodeId;
+}
+
+void BVHDynamic::freeNode(u32 nodeId)
+{
+	m_freeNodes.push_back(nodeId);
+}
+
+// Cost of making node X the sibling of the new leaf is the area of their union plus the area increase of all
+// ancestors of X. Children can't be cheaper than the area of the leaf plus the increase inherited from X, which
+// bounds the search.
+u32 BVHDynamic::findBestSibling(const Box3& bounds) const
+{
+	const float leafArea = bboxSurfaceArea(bounds);
+
+	u32 bestNode = m_root;
+	float bestCost = bboxSurfaceArea(unionBounds(m_nodes[m_root].bounds, bounds));
+
+	m_searchHeap.clear();
+	m_searchHeap.push_back({ m_root, 0.0f });
+
+	while (!m_searchHeap.empty())
+	{
+		std::pop_heap(m_searchHeap.begin(), m_searchHeap.end());
+		const SearchItem item = m_searchHeap.back();
+		m_searchHeap.pop_back();
+
+		if (item.inheritedCost + leafArea >= bestCost)
+		{
+			break; // Items are ordered by inherited cost, so the remaining ones can't be better either
+		}
+
+		const Node& node = m_nodes[item.nodeId];
+		const float unionArea = bboxSurfaceArea(unionBounds(node.bounds, bounds));
+		const float cost = unionArea + item.inheritedCost;
+
+		if (cost < bestCost)
+		{
+			bestCost = cost;
+			bestNode = item.nodeId;
+		}
+
+		if (!node.isLeaf())
+		{
+			const float childInheritedCost = item.inheritedCost + unionArea - bboxSurfaceArea(node.bounds);
+			if (childInheritedCost + leafArea < bestCost)
+			{
+				m_searchHeap.push_back({ node.left, childInheritedCost });
+				std::push_heap(m_searchHeap.begin(), m_searchHeap.end());
+				m_searchHeap.push_back({ node.right, childInheritedCost });
+				std::push_heap(m_searchHeap.begin(), m_searchHeap.end());
+			}
+		}
+	}
+
+	return bestNode;
+}
+
+void BVHDynamic::insertLeaf(u32 leaf)
+{
+	if (m_root == BVHNode::InvalidMask)
+	{
+		m_root = leaf;
+		m_nodes[leaf].parent = BVHNode::InvalidMask;
+		return;
+	}
+
+	const u32 sibling = findBestSibling(m_nodes[leaf].bounds);
+	const u32 oldParent = m_nodes[sibling].parent;
+	const u32 newParent = allocateNode();
+
+	Node& parentNode = m_nodes[newParent];
+	parentNode.parent = oldParent;
+	parentNode.left = sibling;
+	parentNode.right = leaf;
+	parentNode.bounds = unionBounds(m_nodes[sibling].bounds, m_nodes[leaf].bounds);
+
+	m_nodes[sibling].parent = newParent;
+	m_nodes[leaf].parent = newParent;
+
+	if (oldParent == BVHNode::InvalidMask)
+	{
+		m_root = newParent;
+	}
+	else
+	{
+		Node& oldParentNode = m_nodes[oldParent];
+		if (oldParentNode.left == sibling)
+		{
+			oldParentNode.left = newParent;
+		}
+		else
+		{
+			oldParentNode.right = newParent;
+		}
+
+		refitAncestors(oldParent);
+	}
+}
+
+// Parent of the leaf is freed and the sibling takes its place
+void BVHDynamic::removeLeaf(u32 leaf)
+{
+	const u32 parent = m_nodes[leaf].parent;
+	m_nodes[leaf].parent = BVHNode::InvalidMask;
+
+	if (parent == BVHNode::InvalidMask)
+	{
+		m_root = BVHNode::InvalidMask;
+		return;
+	}
+
+	const Node& parentNode = m_nodes[parent];
+	const u32 sibling = parentNode.left == leaf ? parentNode.right : parentNode.left;
+	const u32 grandParent = parentNode.parent;
+
+	m_nodes[sibling].parent = grandParent;
+	freeNode(parent);
+
+	if (grandParent == BVHNode::InvalidMask)
+	{
+		m_root = sibling;
+		return;
+	}
+
+	Node& grandParentNode = m_nodes[grandParent];
+	if (grandParentNode.left == parent)
+	{
+		grandParentNode.left = sibling;
+	}
+	else
+	{
+		grandParentNode.right = sibling;
+	}
+
+	refitAncestors(grandParent);
+}
+
+void BVHDynamic::refitAncestors(u32 nodeId)
+{
+	while (nodeId != BVHNode::InvalidMask)
+	{
+		Node& node = m_nodes[nodeId];
+		node.bounds = unionBounds(m_nodes[node.left].bounds, m_nodes[node.right].bounds);
+
+		rotate(nodeId);
+
+		nodeId = node.parent;
+	}
+}
+
+// Swaps a child with a grandchild on the other side when this reduces the area of the intermediate node.
+// Bounds of the node itself do not change.
+void BVHDynamic::rotate(u32 nodeId)
+{
+	const Node& node = m_nodes[nodeId];
+	const u32 children[2] = { node.left, node.right };
+
+	float bestAreaDelta = 0.0f;
+	u32 bestChild = BVHNode::InvalidMask;
+	u32 bestGrandChild = BVHNode::InvalidMask;
+
+	for (u32 i = 0; i < 2; ++i)
+	{
+		const u32 child = children[i];
+		const u32 otherChild = children[1 - i];
+		const Node& otherNode = m_nodes[otherChild];
+
+		if (otherNode.isLeaf())
+		{
+			continue;
+		}
+
+		const float otherArea = bboxSurfaceArea(otherNode.bounds);
+		const u32 grandChildren[2] = { otherNode.left, otherNode.right };
+
+		for (u32 j = 0; j < 2; ++j)
+		{
+			// Child is swapped with grandChildren[j], so the other node would contain child and grandChildren[1 - j]
+			const Box3 rotatedBounds = unionBounds(m_nodes[child].bounds, m_nodes[grandChildren[1 - j]].bounds);
+			const float areaDelta = bboxSurfaceArea(rotatedBounds) - otherArea;
+
+			if (areaDelta < bestAreaDelta)
+			{
+				bestAreaDelta = areaDelta;
+				bestChild = child;
+				bestGrandChild = grandChildren[j];
+			}
+		}
+	}
+
+	if (bestChild == BVHNode::InvalidMask)
+	{
+		return;
+	}
+
+	const u32 otherChild = node.left == bestChild ? node.right : node.left;
+
+	Node& parentNode = m_nodes[nodeId];
+	if (parentNode.left == bestChild)
+	{
+		parentNode.left = bestGrandChild;
+	}
+	else
+	{
+		parentNode.right = bestGrandChild;
+	}
+
+	Node& otherNode = m_nodes[otherChild];
+	if (otherNode.left == bestGrandChild)
+	{
+		otherNode.left = bestChild;
+	}
+	else
+	{
+		otherNode.right = bestChild;
+	}
+
+	m_nodes[bestGrandChild].parent = nodeId;
+	m_nodes[bestChild].parent = otherChild;
+	otherNode.bounds = unionBounds(m_nodes[otherNode.left].bounds, m_nodes[otherNode.right].bounds);
+}
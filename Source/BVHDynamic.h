@@ -0,0 +1,67 @@
+#pragma once
+
+#include "BVHBuilder.h"
+
+// Binary BVH over object bounds that supports cheap incremental edits, e.g. the top level of a two-level BVH.
+// Inserted leaves become siblings of the node that minimizes the total surface area increase of the tree, which is
+// found by branch and bound search (Bittner et al. 2015). Ancestors of every edited leaf are refitted and locally
+// restructured by tree rotations (Kopta et al. 2012), so the tree quality does not degrade over many edits.
+class BVHDynamic
+{
+public:
+
+	// Builds the initial tree with BVHBuilder. Leaf handle of every primitive is equal to its index.
+	void build(const Box3* bounds, u32 primCount, const BVHBuilderSettings& settings = BVHBuilderSettings());
+
+	void clear();
+
+	// Returns a leaf handle, which stays valid until the leaf is removed
+	u32 insert(const Box3& bounds, u32 prim);
+	void remove(u32 leaf);
+
+	// Leaf is reinserted at the best position for its new bounds
+	void update(u32 leaf, const Box3& bounds);
+
+	u32 getPrim(u32 leaf) const { return m_nodes[leaf].prim; }
+	u32 getLeafCount() const { return m_leafCount; }
+
+	// Writes nodes in depth-first order, same format as BVHBuilder::m_nodes. Cost is linear in the number of nodes.
+	void getNodes(std::vector<BVHNode>& outNodes) const;
+
+private:
+
+	struct Node
+	{
+		Box3 bounds;
+		u32 parent = BVHNode::InvalidMask;
+		u32 left = BVHNode::InvalidMask;
+		u32 right = BVHNode::InvalidMask;
+		u32 prim = BVHNode::InvalidMask; // InvalidMask for internal nodes
+
+		bool isLeaf() const { return prim != BVHNode::InvalidMask; }
+	};
+
+	u32 allocateNode();
+	void freeNode(u32 nodeId);
+
+	u32 findBestSibling(const Box3& bounds) const;
+	void insertLeaf(u32 leaf);
+	void removeLeaf(u32 leaf);
+	void refitAncestors(u32 nodeId);
+	void rotate(u32 nodeId);
+
+	std::vector<Node> m_nodes;
+	std::vector<u32> m_freeNodes;
+	u32 m_root = BVHNode::InvalidMask;
+	u32 m_leafCount = 0;
+
+	struct SearchItem
+	{
+		u32 nodeId;
+		float inheritedCost; // Surface area increase of ancestors if the new leaf is inserted below this node
+
+		bool operator<(const SearchItem& other) const { return inheritedCost > other.inheritedCost; }
+	};
+
+	mutable std::vector<SearchItem> m_searchHeap;
+};
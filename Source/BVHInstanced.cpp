@@ -0,0 +1,489 @@
+#include "BVHInstanced.h"
+
+#include <algorithm>
+#include <float.h>
+#include <string.h>
+
+namespace
+{
+
+inline Vec3 loadVec3(const BVHPackedNode& data)
+{
+	float xyz[3];
+	memcpy(xyz, &data, sizeof(xyz));
+	return Vec3(xyz[0], xyz[1], xyz[2]);
+}
+
+inline BVHPackedNode packVec4(const Vec3& v, float w)
+{
+	BVHPackedNode result;
+	memcpy(&result, &v, sizeof(v));
+	memcpy(&result.d, &w, sizeof(w));
+	return result;
+}
+
+inline Vec3 transformPoint(const Mat4& m, const Vec3& p)
+{
+	return Vec3(
+		p.x * m.rows[0].x + p.y * m.rows[1].x + p.z * m.rows[2].x + m.rows[3].x,
+		p.x * m.rows[0].y + p.y * m.rows[1].y + p.z * m.rows[2].y + m.rows[3].y,
+		p.x * m.rows[0].z + p.y * m.rows[1].z + p.z * m.rows[2].z + m.rows[3].z);
+}
+
+// Root bounds of a packed mesh BVH. Single triangle leaves store edges instead of bounds.
+Box3 calculateMeshBounds(const BVHInstancedMesh& mesh)
+{
+	const BVHPackedNode* root = mesh.packedNodes;
+	const u32 prim = root[0].d;
+
+	Box3 bounds;
+	bounds.expandInit();
+
+	if (prim == BVHNode::InvalidMask || (prim & BVHNode::LeafMask))
+	{
+		bounds.expand(loadVec3(root[0]));
+		bounds.expand(loadVec3(root[1]));
+	}
+	else
+	{
+		const Vec3 v0 = loadVec3(mesh.packedNodes[prim]);
+		bounds.expand(v0);
+		bounds.expand(v0 + loadVec3(root[0]));
+		bounds.expand(v0 + loadVec3(root[1]));
+	}
+
+	return bounds;
+}
+
+Box3 transformBounds(const Mat4& m, const Box3& bounds)
+{
+	Box3 result;
+	result.expandInit();
+
+	for (u32 i = 0; i < 8; ++i)
+	{
+		const Vec3 corner(
+			(i & 1) ? bounds.m_max.x : bounds.m_min.x,
+			(i & 2) ? bounds.m_max.y : bounds.m_min.y,
+			(i & 4) ? bounds.m_max.z : bounds.m_min.z);
+		result.expand(transformPoint(m, corner));
+	}
+
+	return result;
+}
+
+// Object to world transform is p * M + t, so world to object is (p - t) * inverse(M). Output rows are columns of
+// inverse(M) with the translation folded into W: local.x = dot(row0.xyz, p) + row0.w
+void packWorldToObject(const Mat4& m, BVHPackedNode* outData)
+{
+	const Vec3 a(m.rows[0].x, m.rows[0].y, m.rows[0].z);
+	const Vec3 b(m.rows[1].x, m.rows[1].y, m.rows[1].z);
+	const Vec3 c(m.rows[2].x, m.rows[2].y, m.rows[2].z);
+	const Vec3 t(m.rows[3].x, m.rows[3].y, m.rows[3].z);
+
+	const Vec3 bc = cross(b, c);
+	const float invDet = 1.0f / dot(a, bc);
+
+	const Vec3 rows[3] =
+	{
+		bc * invDet,
+		cross(c, a) * invDet,
+		cross(a, b) * invDet,
+	};
+
+	for (u32 i = 0; i < 3; ++i)
+	{
+		outData[i] = packVec4(rows[i], -dot(rows[i], t));
+	}
+}
+
+inline Vec3 transformPoint(const BVHPackedNode* rows, const Vec3& p)
+{
+	Vec3 result;
+	for (u32 i = 0; i < 3; ++i)
+	{
+		float w;
+		memcpy(&w, &rows[i].d, sizeof(w));
+		result[i] = dot(loadVec3(rows[i]), p) + w;
+	}
+	return result;
+}
+
+inline Vec3 transformDirection(const BVHPackedNode* rows, const Vec3& d)
+{
+	return Vec3(dot(loadVec3(rows[0]), d), dot(loadVec3(rows[1]), d), dot(loadVec3(rows[2]), d));
+}
+
+inline bool intersectRayBox(const Vec3& origin, const Vec3& invDir, float maxT, const BVHPackedNode* node)
+{
+	const Vec3 t0 = (loadVec3(node[0]) - origin) * invDir;
+	const Vec3 t1 = (loadVec3(node[1]) - origin) * invDir;
+
+	const float tNear = max(max(min(t0.x, t1.x), min(t0.y, t1.y)), max(min(t0.z, t1.z), 0.0f));
+	const float tFar = min(min(max(t0.x, t1.x), max(t0.y, t1.y)), min(max(t0.z, t1.z), maxT));
+
+	return tNear <= tFar;
+}
+
+inline bool intersectTriangle(const Vec3& v0, const Vec3& edge0, const Vec3& edge1,
+	const Vec3& origin, const Vec3& direction, float maxT)
+{
+	const Vec3 s1 = cross(direction, edge1);
+	const float invd = 1.0f / dot(s1, edge0);
+	const Vec3 d = origin - v0;
+	const float b1 = dot(d, s1) * invd;
+	const Vec3 s2 = cross(d, edge0);
+	const float b2 = dot(direction, s2) * invd;
+	const float t = dot(edge1, s2) * invd;
+
+	return !(b1 < 0.0f || b1 > 1.0f || b2 < 0.0f || b1 + b2 > 1.0f || t < 0.0f || t > maxT);
+}
+
+// Stackless traversal of a packed mesh BVH, same as RayTracedShadows.comp
+bool intersectMesh(const BVHPackedNode* data, const Vec3& origin, const Vec3& direction, float maxT)
+{
+	const Vec3 invDir = Vec3(1.0f) / direction;
+
+	u32 nodeIndex = 0;
+
+	while (nodeIndex != BVHNode::InvalidMask)
+	{
+		const BVHPackedNode* node = data + nodeIndex * 2;
+		const u32 prim = node[0].d;
+
+		if (prim == BVHNode::InvalidMask)
+		{
+			if (intersectRayBox(origin, invDir, maxT, node))
+			{
+				++nodeIndex;
+				continue;
+			}
+		}
+		else if (prim & BVHNode::LeafMask)
+		{
+			if (intersectRayBox(origin, invDir, maxT, node))
+			{
+				for (u32 record = prim & ~BVHNode::LeafMask; ; record += 2)
+				{
+					const Vec3 v0 = loadVec3(data[data[record].d]);
+					if (intersectTriangle(v0, loadVec3(data[record]), loadVec3(data[record + 1]), origin, direction, maxT))
+					{
+						return true;
+					}
+
+					if (data[record + 1].d != 0)
+					{
+						break;
+					}
+				}
+			}
+		}
+		else if (intersectTriangle(loadVec3(data[prim]), loadVec3(node[0]), loadVec3(node[1]), origin, direction, maxT))
+		{
+			return true;
+		}
+
+		nodeIndex = node[1].d;
+	}
+
+	return false;
+}
+
+// Top-level nodes and instance records in vec4 units, mesh data follows them
+u64 calculateTopLevelSize(u32 instanceCapacity)
+{
+	return max<u64>(u64(instanceCapacity) * 2, 2) * 2 - 2 + u64(instanceCapacity) * BVHInstanced::InstanceRecordSize;
+}
+
+}
+
+void BVHInstanced::build(const BVHInstancedMesh* meshes, u32 meshCount, const BVHInstance* instances, u32 instanceCount,
+	const BVHBuilderSettings& settings, u32 instanceCapacity)
+{
+	m_nodes.clear();
+	m_instances.assign(instances, instances + instanceCount);
+	m_freeInstances.clear();
+	m_dirtyInstances.clear();
+
+	// Leaf handles of the initial top-level tree are equal to instance indices
+	m_instanceLeaves.resize(instanceCount);
+	for (u32 i = 0; i < instanceCount; ++i)
+	{
+		m_instanceLeaves[i] = i;
+		m_dirtyInstances.push_back(i);
+	}
+
+	m_meshBounds.resize(meshCount);
+	for (u32 i = 0; i < meshCount; ++i)
+	{
+		if (meshes[i].packedNodeCount != 0)
+		{
+			m_meshBounds[i] = calculateMeshBounds(meshes[i]);
+		}
+	}
+
+	std::vector<Box3> instanceBounds(instanceCount);
+	for (u32 i = 0; i < instanceCount; ++i)
+	{
+		RUSH_ASSERT(instances[i].mesh < meshCount && meshes[instances[i].mesh].packedNodeCount != 0);
+		instanceBounds[i] = calculateInstanceBounds(instances[i]);
+	}
+
+	m_topLevel.build(instanceBounds.data(), instanceCount, settings);
+
+	u64 meshDataSize = 0;
+	for (u32 i = 0; i < meshCount; ++i)
+	{
+		meshDataSize += meshes[i].packedNodeCount;
+	}
+
+	m_instanceCapacity = max(instanceCount, instanceCapacity);
+
+	if (!BVHBuilder::validatePackedNodeCount(calculateTopLevelSize(m_instanceCapacity) + meshDataSize))
+	{
+		m_topLevel.clear();
+		m_instances.clear();
+		m_instanceLeaves.clear();
+		m_dirtyInstances.clear();
+		m_meshOffsets.clear();
+		m_instanceCapacity = 0;
+		m_packedNodes.clear();
+		m_topLevelDirty = false;
+		return;
+	}
+
+	u32 packedNodeCount = getInstanceRecordOffset() + m_instanceCapacity * InstanceRecordSize;
+
+	m_meshOffsets.resize(meshCount);
+	for (u32 i = 0; i < meshCount; ++i)
+	{
+		m_meshOffsets[i] = packedNodeCount;
+		packedNodeCount += meshes[i].packedNodeCount;
+	}
+
+	m_packedNodes.clear();
+	m_packedNodes.resize(packedNodeCount);
+
+	for (u32 i = 0; i < meshCount; ++i)
+	{
+		std::copy(meshes[i].packedNodes, meshes[i].packedNodes + meshes[i].packedNodeCount,
+			m_packedNodes.begin() + m_meshOffsets[i]);
+	}
+
+	m_topLevelDirty = true;
+	updatePackedNodes();
+}
+
+u32 BVHInstanced::addInstance(const BVHInstance& instance)
+{
+	RUSH_ASSERT(instance.mesh < (u32)m_meshOffsets.size());
+
+	if (m_freeInstances.empty() && (u32)m_instances.size() == m_instanceCapacity)
+	{
+		// Capacity is doubled while the buffer stays within the packed format limit
+		const u64 meshDataSize = m_packedNodes.size() - calculateTopLevelSize(m_instanceCapacity);
+		u32 instanceCapacity = max(m_instanceCapacity * 2, m_instanceCapacity + 1);
+		if (calculateTopLevelSize(instanceCapacity) + meshDataSize > BVHBuilder::MaxPackedNodeCount)
+		{
+			instanceCapacity = m_instanceCapacity + 1;
+		}
+
+		if (!BVHBuilder::validatePackedNodeCount(calculateTopLevelSize(instanceCapacity) + meshDataSize))
+		{
+			return BVHNode::InvalidMask;
+		}
+
+		reserveInstances(instanceCapacity);
+	}
+
+	u32 index;
+	if (m_freeInstances.empty())
+	{
+		index = (u32)m_instances.size();
+		m_instances.push_back(instance);
+		m_instanceLeaves.push_back(u32(BVHNode::InvalidMask));
+	}
+	else
+	{
+		index = m_freeInstances.back();
+		m_freeInstances.pop_back();
+		m_instances[index] = instance;
+	}
+
+	m_instanceLeaves[index] = m_topLevel.insert(calculateInstanceBounds(instance), index);
+
+	m_dirtyInstances.push_back(index);
+	m_topLevelDirty = true;
+
+	return index;
+}
+
+void BVHInstanced::removeInstance(u32 instance)
+{
+	RUSH_ASSERT(m_instanceLeaves[instance] != BVHNode::InvalidMask);
+
+	m_topLevel.remove(m_instanceLeaves[instance]);
+	m_instanceLeaves[instance] = BVHNode::InvalidMask;
+	m_freeInstances.push_back(instance);
+
+	m_topLevelDirty = true;
+}
+
+void BVHInstanced::setInstanceTransform(u32 instance, const Mat4& transform)
+{
+	RUSH_ASSERT(m_instanceLeaves[instance] != BVHNode::InvalidMask);
+
+	m_instances[instance].transform = transform;
+	m_topLevel.update(m_instanceLeaves[instance], calculateInstanceBounds(m_instances[instance]));
+
+	m_dirtyInstances.push_back(instance);
+	m_topLevelDirty = true;
+}
+
+void BVHInstanced::updatePackedNodes(std::vector<BVHBufferRange>* outChangedRanges)
+{
+	const u32 instanceRecordOffset = getInstanceRecordOffset();
+
+	if (m_topLevelDirty)
+	{
+		m_topLevel.getNodes(m_nodes);
+
+		if (m_nodes.empty())
+		{
+			// Degenerate box at the float limit is missed by every ray with finite length. Inverted bounds are not
+			// enough, as they are hit by rays parallel to an axis.
+			BVHNode node;
+			node.bboxMin = Vec3(FLT_MAX);
+			node.bboxMax = Vec3(FLT_MAX);
+			m_nodes.push_back(node);
+		}
+
+		for (u32 i = 0; i < (u32)m_nodes.size(); ++i)
+		{
+			BVHNode node = m_nodes[i];
+			if (node.isLeaf())
+			{
+				node.prim = instanceRecordOffset + node.prim * InstanceRecordSize;
+			}
+
+			static_assert(sizeof(BVHNode) == 2 * sizeof(BVHPackedNode), "Top-level node must occupy two vec4");
+			memcpy(&m_packedNodes[i * 2], &node, sizeof(node));
+		}
+
+		if (outChangedRanges && !m_layoutChanged)
+		{
+			outChangedRanges->push_back({ 0, u64(m_nodes.size()) * sizeof(BVHNode) });
+		}
+	}
+
+	std::sort(m_dirtyInstances.begin(), m_dirtyInstances.end());
+	m_dirtyInstances.erase(std::unique(m_dirtyInstances.begin(), m_dirtyInstances.end()), m_dirtyInstances.end());
+
+	for (u32 instance : m_dirtyInstances)
+	{
+		if (m_instanceLeaves[instance] == BVHNode::InvalidMask)
+		{
+			continue; // Removed after the edit
+		}
+
+		const u32 recordOffset = instanceRecordOffset + instance * InstanceRecordSize;
+		BVHPackedNode* record = &m_packedNodes[recordOffset];
+		packWorldToObject(m_instances[instance].transform, record);
+		record[3] = { m_meshOffsets[m_instances[instance].mesh], 0, 0, 0 };
+
+		if (outChangedRanges && !m_layoutChanged)
+		{
+			outChangedRanges->push_back({ u64(recordOffset) * sizeof(BVHPackedNode), u64(InstanceRecordSize) * sizeof(BVHPackedNode) });
+		}
+	}
+
+	if (outChangedRanges && m_layoutChanged)
+	{
+		outChangedRanges->push_back({ 0, u64(m_packedNodes.size()) * sizeof(BVHPackedNode) });
+	}
+
+	m_dirtyInstances.clear();
+	m_topLevelDirty = false;
+	m_layoutChanged = false;
+}
+
+bool BVHInstanced::intersectAny(const Vec3& origin, const Vec3& direction, float maxT) const
+{
+	if (m_packedNodes.empty())
+	{
+		return false;
+	}
+
+	const BVHPackedNode* data = m_packedNodes.data();
+	const Vec3 invDir = Vec3(1.0f) / direction;
+
+	u32 nodeIndex = 0;
+
+	while (nodeIndex != BVHNode::InvalidMask)
+	{
+		const BVHPackedNode* node = data + nodeIndex * 2;
+
+		if (intersectRayBox(origin, invDir, maxT, node))
+		{
+			const u32 record = node[0].d;
+			if (record == BVHNode::InvalidMask)
+			{
+				++nodeIndex;
+				continue;
+			}
+
+			// Direction is not normalized, so that distances along the ray stay the same in object space
+			const BVHPackedNode* rows = data + record;
+			const Vec3 localOrigin = transformPoint(rows, origin);
+			const Vec3 localDirection = transformDirection(rows, direction);
+
+			if (intersectMesh(data + rows[3].a, localOrigin, localDirection, maxT))
+			{
+				return true;
+			}
+		}
+
+		nodeIndex = node[1].d;
+	}
+
+	return false;
+}
+
+// Top-level nodes of a full tree over all instance slots are followed by instance records
+u32 BVHInstanced::getInstanceRecordOffset() const
+{
+	return max<u32>(m_instanceCapacity * 2, 2) * 2 - 2;
+}
+
+Box3 BVHInstanced::calculateInstanceBounds(const BVHInstance& instance) const
+{
+	return transformBounds(instance.transform, m_meshBounds[instance.mesh]);
+}
+
+// Mesh data is moved to make space for more instance records, which requires all records to be rewritten
+void BVHInstanced::reserveInstances(u32 instanceCapacity)
+{
+	const u32 oldMeshDataOffset = getInstanceRecordOffset() + m_instanceCapacity * InstanceRecordSize;
+	const u32 meshDataSize = (u32)m_packedNodes.size() - oldMeshDataOffset;
+
+	m_instanceCapacity = instanceCapacity;
+
+	const u32 meshDataOffset = getInstanceRecordOffset() + m_instanceCapacity * InstanceRecordSize;
+
+	std::vector<BVHPackedNode> packedNodes(meshDataOffset + meshDataSize);
+	std::copy(m_packedNodes.begin() + oldMeshDataOffset, m_packedNodes.end(), packedNodes.begin() + meshDataOffset);
+	m_packedNodes.swap(packedNodes);
+
+	for (u32& meshOffset : m_meshOffsets)
+	{
+		meshOffset += meshDataOffset - oldMeshDataOffset;
+	}
+
+	for (u32 i = 0; i < (u32)m_instances.size(); ++i)
+	{
+		m_dirtyInstances.push_back(i);
+	}
+
+	m_topLevelDirty = true;
+	m_layoutChanged = true;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "BVHBuilder.h"
+#include "BVHDynamic.h"
+
+// Packed binary BVH of a mesh that may be referenced by many instances.
+// Data must use BVHTriangleFormat::Edges, e.g. BVHBuilder::m_packedNodes or BVHCache::getPackedNodes().
+struct BVHInstancedMesh
+{
+	const BVHPackedNode* packedNodes = nullptr;
+	u32 packedNodeCount = 0;
+};
+
+struct BVHInstance
+{
+	Mat4 transform = Mat4::identity(); // Object to world, must be invertible. Points are row vectors: p * transform.
+	u32 mesh = 0; // Index of the mesh BVH
+};
+
+// Two-level BVH: every unique mesh BVH is stored once and a top-level BVH is built over world space bounds of
+// mesh instances. Memory scales with unique geometry, every instance only adds a top-level leaf and a transform.
+//
+// GPU buffer layout, in vec4 units:
+// - Top-level nodes. Internal nodes are the same as in BVHBuilder::m_packedNodes. Leaves store world space bounds
+//   of an instance, offset of its instance record in place of the primitive index and the skip pointer.
+// - Instance records of 4 vec4: three rows of the world to object transform (local.x = dot(row0.xyz, p) + row0.w)
+//   followed by the offset of the mesh BVH in X.
+// - Mesh BVHs, copied as is. Node, vertex and triangle record indices inside a mesh BVH are relative to its offset.
+struct BVHInstanced
+{
+	static const u32 InstanceRecordSize = 4;
+
+	BVHDynamic m_topLevel; // Leaf primitive is the instance index
+	std::vector<BVHNode> m_nodes; // Top-level nodes in the order they are stored in m_packedNodes
+	std::vector<BVHInstance> m_instances; // Slots of removed instances are reused by new ones
+	std::vector<u32> m_instanceLeaves; // Top-level leaf of every instance, InvalidMask for removed instances
+	std::vector<u32> m_freeInstances;
+	std::vector<Box3> m_meshBounds;
+	std::vector<u32> m_meshOffsets; // Offset of every mesh BVH in m_packedNodes
+	u32 m_instanceCapacity = 0; // Instances that fit into the buffer before mesh data has to be moved
+	std::vector<BVHPackedNode> m_packedNodes;
+
+	// Mesh data is copied, so it does not need to outlive the call. Top-level settings are used with single
+	// instance leaves. Space for instanceCapacity instances is reserved in the buffer, so that instances can be added
+	// later without moving mesh data. Without instances, the buffer holds a single node that is missed by every ray.
+	// If the buffer would exceed BVHBuilder::MaxPackedNodeCount, an error is logged and the BVH is left empty.
+	void build(const BVHInstancedMesh* meshes, u32 meshCount, const BVHInstance* instances, u32 instanceCount,
+		const BVHBuilderSettings& settings = BVHBuilderSettings(), u32 instanceCapacity = 0);
+
+	// Incremental edits of the top level. Instance index is returned by addInstance(), indices of instances passed
+	// to build() are their positions in the array. Edits only change the top-level tree, m_packedNodes is written
+	// by updatePackedNodes(). addInstance() returns InvalidMask if the instance does not fit into the packed format.
+	u32 addInstance(const BVHInstance& instance);
+	void removeInstance(u32 instance);
+	void setInstanceTransform(u32 instance, const Mat4& transform);
+
+	// Writes top-level nodes and instance records changed since the last call to m_packedNodes. All top-level nodes
+	// are written in depth-first order, which is linear in instance count, so edits should be batched, e.g. per frame.
+	// Byte ranges of m_packedNodes that were modified are optionally written to outChangedRanges.
+	void updatePackedNodes(std::vector<BVHBufferRange>* outChangedRanges = nullptr);
+
+	// Any-hit shadow ray query, same as GPU traversal in RayTracedShadowsInstanced.comp.
+	// Returns true if any triangle is hit between the ray origin and maxT.
+	bool intersectAny(const Vec3& origin, const Vec3& direction, float maxT) const;
+
+private:
+
+	u32 getInstanceRecordOffset() const;
+	Box3 calculateInstanceBounds(const BVHInstance& instance) const;
+	void reserveInstances(u32 instanceCapacity);
+
+	bool m_topLevelDirty = false;
+	bool m_layoutChanged = false; // Mesh data was moved, so the whole buffer has to be uploaded
+	std::vector<u32> m_dirtyInstances;
+};
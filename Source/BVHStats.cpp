@@ -0,0 +1,393 @@
+#include "BVHStats.h"
+#include "TaskScheduler.h"
+
+#include <Rush/UtilLog.h>
+
+#include <stdio.h>
+#include <string>
+
+namespace
+{
+
+inline float bboxSurfaceArea(const Vec3& bboxMin, const Vec3& bboxMax)
+{
+	Vec3 extents = bboxMax - bboxMin;
+	return (extents.x * extents.y + extents.y * extents.z + extents.z * extents.x) * 2.0f;
+}
+
+inline bool bboxOverlaps(const Vec3& minA, const Vec3& maxA, const Vec3& minB, const Vec3& maxB)
+{
+	return minA.x <= maxB.x && minB.x <= maxA.x
+		&& minA.y <= maxB.y && minB.y <= maxA.y
+		&& minA.z <= maxB.z && minB.z <= maxA.z;
+}
+
+inline bool bboxContains(const Vec3& outerMin, const Vec3& outerMax, const Vec3& innerMin, const Vec3& innerMax)
+{
+	return outerMin.x <= innerMin.x && innerMax.x <= outerMax.x
+		&& outerMin.y <= innerMin.y && innerMax.y <= outerMax.y
+		&& outerMin.z <= innerMin.z && innerMax.z <= outerMax.z;
+}
+
+template <typename Function>
+void forEachLeafPrim(const BVHNode& node, const std::vector<u32>& leafPrims, const Function& function)
+{
+	if (!(node.prim & BVHNode::LeafMask))
+	{
+		function(node.prim);
+		return;
+	}
+
+	for (u32 i = node.prim & ~BVHNode::LeafMask; ; ++i)
+	{
+		function(leafPrims[i] & ~BVHNode::LeafMask);
+		if (leafPrims[i] & BVHNode::LeafMask)
+		{
+			break;
+		}
+	}
+}
+
+// Area of the part of a triangle inside the box. Triangle is clipped by each box plane in turn,
+// which adds at most one vertex per plane.
+float calculateClippedTriangleArea(const Vec3& v0, const Vec3& v1, const Vec3& v2, const Vec3& bboxMin, const Vec3& bboxMax)
+{
+	static const u32 MaxVertexCount = 3 + 6;
+
+	Vec3 polygons[2][MaxVertexCount];
+	polygons[0][0] = v0;
+	polygons[0][1] = v1;
+	polygons[0][2] = v2;
+
+	u32 vertexCount = 3;
+	u32 current = 0;
+
+	for (u32 plane = 0; plane < 6; ++plane)
+	{
+		const u32 axis = plane >> 1;
+		const float position = (plane & 1) ? bboxMax[axis] : bboxMin[axis];
+		const float sign = (plane & 1) ? -1.0f : 1.0f;
+
+		const Vec3* input = polygons[current];
+		Vec3* output = polygons[current ^ 1];
+		u32 outputCount = 0;
+
+		for (u32 i = 0; i < vertexCount; ++i)
+		{
+			const Vec3& a = input[i];
+			const Vec3& b = input[i + 1 == vertexCount ? 0 : i + 1];
+			const float distanceA = sign * (a[axis] - position);
+			const float distanceB = sign * (b[axis] - position);
+
+			if (distanceA >= 0.0f)
+			{
+				output[outputCount++] = a;
+			}
+
+			if ((distanceA >= 0.0f) != (distanceB >= 0.0f))
+			{
+				output[outputCount++] = a + (b - a) * (distanceA / (distanceA - distanceB));
+			}
+		}
+
+		vertexCount = outputCount;
+		current ^= 1;
+
+		if (vertexCount < 3)
+		{
+			return 0.0f;
+		}
+	}
+
+	const Vec3* polygon = polygons[current];
+	Vec3 areaVector = Vec3(0.0f);
+	for (u32 i = 1; i + 1 < vertexCount; ++i)
+	{
+		areaVector = areaVector + cross(polygon[i] - polygon[0], polygon[i + 1] - polygon[0]);
+	}
+
+	return length(areaVector) * 0.5f;
+}
+
+}
+
+void BVHStats::calculate(const BVHBuilder& bvh, const float* vertices, u32 stride, const u32* indices,
+	float traversalCost, float intersectionCost, TaskScheduler* scheduler)
+{
+	*this = BVHStats();
+
+	const std::vector<BVHNode>& nodes = bvh.m_nodes;
+
+	nodeCount = (u32)nodes.size();
+	nodeBytes = nodes.size() * sizeof(BVHNode);
+	leafPrimBytes = bvh.m_leafPrims.size() * sizeof(u32);
+	positionVertexBytes = bvh.m_positionVertices.size() * sizeof(u32);
+
+	// Triangle data follows all nodes in the packed node array
+	packedNodeBytes = u64(bvh.getPackedNodeRecordCount()) * sizeof(BVHPackedNode);
+	packedTriangleBytes = bvh.m_packedNodes.size() * sizeof(BVHPackedNode) - packedNodeBytes;
+
+	if (nodes.empty())
+	{
+		return;
+	}
+
+	sahCost = bvh.calculateSahCost(traversalCost, intersectionCost);
+
+	const float rootSurfaceArea = bboxSurfaceArea(nodes[0].bboxMin, nodes[0].bboxMax);
+
+	// Children are always stored after their parent, so depth is propagated in a single pass.
+	// Left child is the next node and right child is the miss link of the left child.
+	std::vector<u32> depths(nodes.size());
+	std::vector<float> nodeCosts(nodes.size());
+
+	double overlap = 0.0;
+	u64 leafDepthSum = 0;
+	u32 primCount = 0;
+
+	minLeafDepth = BVHNode::InvalidMask;
+
+	for (u32 nodeId = 0; nodeId < nodeCount; ++nodeId)
+	{
+		const BVHNode& node = nodes[nodeId];
+
+		if (node.isLeaf())
+		{
+			u32 leafSize = 0;
+			forEachLeafPrim(node, bvh.m_leafPrims, [&](u32 prim)
+			{
+				++leafSize;
+				primCount = max(primCount, prim + 1);
+			});
+
+			++leafCount;
+			primReferenceCount += leafSize;
+			++leafSizeHistogram[min(leafSize, BVHBuilderSettings::MaxLeafSize)];
+
+			minLeafDepth = min(minLeafDepth, depths[nodeId]);
+			maxLeafDepth = max(maxLeafDepth, depths[nodeId]);
+			leafDepthSum += depths[nodeId];
+
+			nodeCosts[nodeId] = intersectionCost * leafSize;
+			continue;
+		}
+
+		const u32 leftId = nodeId + 1;
+		const u32 rightId = nodes[leftId].next;
+		const BVHNode& left = nodes[leftId];
+		const BVHNode& right = nodes[rightId];
+
+		depths[leftId] = depths[nodeId] + 1;
+		depths[rightId] = depths[nodeId] + 1;
+
+		if (bboxOverlaps(left.bboxMin, left.bboxMax, right.bboxMin, right.bboxMax))
+		{
+			const Vec3 overlapMin(max(left.bboxMin.x, right.bboxMin.x), max(left.bboxMin.y, right.bboxMin.y), max(left.bboxMin.z, right.bboxMin.z));
+			const Vec3 overlapMax(min(left.bboxMax.x, right.bboxMax.x), min(left.bboxMax.y, right.bboxMax.y), min(left.bboxMax.z, right.bboxMax.z));
+			overlap += bboxSurfaceArea(overlapMin, overlapMax);
+		}
+
+		++internalNodeCount;
+		nodeCosts[nodeId] = traversalCost;
+	}
+
+	averageLeafDepth = leafCount ? float(double(leafDepthSum) / leafCount) : 0.0f;
+	siblingOverlap = rootSurfaceArea > 0.0f ? float(overlap / rootSurfaceArea) : 0.0f;
+
+	// Nodes in depth-first order are found by following the traversal path of a ray that hits every node.
+	// Every subtree occupies a contiguous range of this order, which ends at the miss link of its root.
+	std::vector<u32> depthFirstIndices(nodes.size());
+	for (u32 nodeId = 0, index = 0; nodeId != BVHNode::InvalidMask; ++index)
+	{
+		depthFirstIndices[nodeId] = index;
+		nodeId = nodes[nodeId].isLeaf() ? nodes[nodeId].next : nodeId + 1;
+	}
+
+	// Depth-first indices of leaves that reference each primitive, grouped by primitive.
+	// Primitives are referenced by more than one leaf only with spatial splits or pre-splitting.
+	std::vector<u32> primLeafOffsets(primCount + 1, 0);
+	std::vector<u32> primLeaves(primReferenceCount);
+
+	for (const BVHNode& node : nodes)
+	{
+		if (node.isLeaf())
+		{
+			forEachLeafPrim(node, bvh.m_leafPrims, [&](u32 prim) { ++primLeafOffsets[prim + 1]; });
+		}
+	}
+
+	for (u32 prim = 0; prim < primCount; ++prim)
+	{
+		primLeafOffsets[prim + 1] += primLeafOffsets[prim];
+	}
+
+	{
+		std::vector<u32> primLeafCounts(primCount, 0);
+		for (u32 nodeId = 0; nodeId < nodeCount; ++nodeId)
+		{
+			if (nodes[nodeId].isLeaf())
+			{
+				forEachLeafPrim(nodes[nodeId], bvh.m_leafPrims, [&](u32 prim)
+				{
+					primLeaves[primLeafOffsets[prim] + primLeafCounts[prim]++] = depthFirstIndices[nodeId];
+				});
+			}
+		}
+	}
+
+	// Each triangle is tested against all nodes that overlap its bounds. Partial sums are kept per chunk
+	// and added up in order, so the result does not depend on the thread count.
+	const u32 chunkSize = 16384;
+	const u32 chunkCount = (primCount + chunkSize - 1) / chunkSize;
+
+	std::vector<double> chunkOverlapAreas(chunkCount, 0.0);
+	std::vector<double> chunkTriangleAreas(chunkCount, 0.0);
+
+	parallelFor(scheduler, chunkCount, 1, [&](u32 chunkBegin, u32 chunkEnd)
+	{
+		for (u32 chunk = chunkBegin; chunk < chunkEnd; ++chunk)
+		{
+			const u32 primBegin = chunk * chunkSize;
+			const u32 primEnd = min(primBegin + chunkSize, primCount);
+
+			double overlapArea = 0.0;
+			double triangleArea = 0.0;
+
+			for (u32 prim = primBegin; prim < primEnd; ++prim)
+			{
+				const Vec3 v0(vertices + stride * indices[prim * 3 + 0]);
+				const Vec3 v1(vertices + stride * indices[prim * 3 + 1]);
+				const Vec3 v2(vertices + stride * indices[prim * 3 + 2]);
+
+				const float area = length(cross(v1 - v0, v2 - v0)) * 0.5f;
+				if (area == 0.0f)
+				{
+					continue;
+				}
+
+				triangleArea += area;
+
+				const Vec3 bboxMin(min(min(v0.x, v1.x), v2.x), min(min(v0.y, v1.y), v2.y), min(min(v0.z, v1.z), v2.z));
+				const Vec3 bboxMax(max(max(v0.x, v1.x), v2.x), max(max(v0.y, v1.y), v2.y), max(max(v0.z, v1.z), v2.z));
+
+				const u32* leavesBegin = primLeaves.data() + primLeafOffsets[prim];
+				const u32* leavesEnd = primLeaves.data() + primLeafOffsets[prim + 1];
+
+				u32 nodeId = 0;
+				while (nodeId != BVHNode::InvalidMask)
+				{
+					const BVHNode& node = nodes[nodeId];
+
+					if (!bboxOverlaps(bboxMin, bboxMax, node.bboxMin, node.bboxMax))
+					{
+						nodeId = node.next;
+						continue;
+					}
+
+					const u32 subtreeBegin = depthFirstIndices[nodeId];
+					const u32 subtreeEnd = node.next == BVHNode::InvalidMask ? nodeCount : depthFirstIndices[node.next];
+
+					bool referenced = false;
+					for (const u32* leaf = leavesBegin; leaf != leavesEnd && !referenced; ++leaf)
+					{
+						referenced = *leaf >= subtreeBegin && *leaf < subtreeEnd;
+					}
+
+					if (!referenced)
+					{
+						const bool contained = bboxContains(node.bboxMin, node.bboxMax, bboxMin, bboxMax);
+						overlapArea += nodeCosts[nodeId] * (contained ? area : calculateClippedTriangleArea(v0, v1, v2, node.bboxMin, node.bboxMax));
+					}
+
+					nodeId = node.isLeaf() ? node.next : nodeId + 1;
+				}
+			}
+
+			chunkOverlapAreas[chunk] = overlapArea;
+			chunkTriangleAreas[chunk] = triangleArea;
+		}
+	});
+
+	double totalOverlapArea = 0.0;
+	double totalTriangleArea = 0.0;
+	for (u32 chunk = 0; chunk < chunkCount; ++chunk)
+	{
+		totalOverlapArea += chunkOverlapAreas[chunk];
+		totalTriangleArea += chunkTriangleAreas[chunk];
+	}
+
+	epoCost = totalTriangleArea > 0.0 ? float(totalOverlapArea / totalTriangleArea) : 0.0f;
+}
+
+void BVHStats::log() const
+{
+	Log::message("BVH SAH cost: %f, EPO cost: %f, sibling overlap: %f", sahCost, epoCost, siblingOverlap);
+
+	Log::message("BVH nodes: %d (internal: %d, leaves: %d), primitive references: %d",
+		(int)nodeCount, (int)internalNodeCount, (int)leafCount, (int)primReferenceCount);
+
+	Log::message("BVH leaf depth: min %d, avg %.2f, max %d", (int)minLeafDepth, averageLeafDepth, (int)maxLeafDepth);
+
+	std::string histogram;
+	for (u32 i = 1; i <= BVHBuilderSettings::MaxLeafSize; ++i)
+	{
+		if (leafSizeHistogram[i])
+		{
+			char entry[32];
+			snprintf(entry, sizeof(entry), "%s%d: %d", histogram.empty() ? "" : ", ", (int)i, (int)leafSizeHistogram[i]);
+			histogram += entry;
+		}
+	}
+	Log::message("BVH leaf sizes: %s", histogram.c_str());
+
+	Log::message("BVH memory: packed nodes %d KB, packed triangles %d KB, nodes %d KB, leaf primitives %d KB, positions %d KB",
+		(int)(packedNodeBytes / 1024),
+		(int)(packedTriangleBytes / 1024),
+		(int)(nodeBytes / 1024),
+		(int)(leafPrimBytes / 1024),
+		(int)(positionVertexBytes / 1024));
+}
+
+bool BVHStats::writeJson(const char* filename) const
+{
+	FILE* f = fopen(filename, "w");
+	if (!f)
+	{
+		return false;
+	}
+
+	fprintf(f, "{\n");
+	fprintf(f, "\t\"sahCost\": %.9g,\n", sahCost);
+	fprintf(f, "\t\"epoCost\": %.9g,\n", epoCost);
+	fprintf(f, "\t\"siblingOverlap\": %.9g,\n", siblingOverlap);
+	fprintf(f, "\t\"nodeCount\": %u,\n", nodeCount);
+	fprintf(f, "\t\"internalNodeCount\": %u,\n", internalNodeCount);
+	fprintf(f, "\t\"leafCount\": %u,\n", leafCount);
+	fprintf(f, "\t\"primReferenceCount\": %u,\n", primReferenceCount);
+	fprintf(f, "\t\"leafDepth\": { \"min\": %u, \"avg\": %.9g, \"max\": %u },\n", minLeafDepth, averageLeafDepth, maxLeafDepth);
+
+	// Element i is the number of leaves with i primitives
+	u32 histogramSize = BVHBuilderSettings::MaxLeafSize + 1;
+	while (histogramSize > 1 && !leafSizeHistogram[histogramSize - 1])
+	{
+		--histogramSize;
+	}
+
+	fprintf(f, "\t\"leafSizeHistogram\": [");
+	for (u32 i = 0; i < histogramSize; ++i)
+	{
+		fprintf(f, i ? ", %u" : "%u", leafSizeHistogram[i]);
+	}
+	fprintf(f, "],\n");
+
+	fprintf(f, "\t\"memory\": {\n");
+	fprintf(f, "\t\t\"packedNodes\": %llu,\n", (unsigned long long)packedNodeBytes);
+	fprintf(f, "\t\t\"packedTriangles\": %llu,\n", (unsigned long long)packedTriangleBytes);
+	fprintf(f, "\t\t\"nodes\": %llu,\n", (unsigned long long)nodeBytes);
+	fprintf(f, "\t\t\"leafPrims\": %llu,\n", (unsigned long long)leafPrimBytes);
+	fprintf(f, "\t\t\"positionVertices\": %llu\n", (unsigned long long)positionVertexBytes);
+	fprintf(f, "\t}\n");
+	fprintf(f, "}\n");
+
+	return fclose(f) == 0;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "BVHBuilder.h"
+
+class TaskScheduler;
+
+// Quality metrics and memory usage of a binary BVH produced by BVHBuilder
+struct BVHStats
+{
+	// Surface area heuristic cost, same as BVHBuilder::calculateSahCost()
+	float sahCost = 0.0f;
+
+	// End-point overlap: surface area of triangles that intersect a node, but are not referenced by its subtree,
+	// weighted by node cost and normalized by total triangle surface area [Aila et al. 2013]
+	float epoCost = 0.0f;
+
+	// Surface area of child bounds intersection summed over internal nodes, normalized by root surface area
+	float siblingOverlap = 0.0f;
+
+	u32 nodeCount = 0;
+	u32 internalNodeCount = 0;
+	u32 leafCount = 0;
+	u32 primReferenceCount = 0; // May exceed triangle count with spatial splits or pre-splitting
+
+	u32 minLeafDepth = 0;
+	u32 maxLeafDepth = 0;
+	float averageLeafDepth = 0.0f;
+
+	// Number of leaves with the given primitive count
+	u32 leafSizeHistogram[BVHBuilderSettings::MaxLeafSize + 1] = {};
+
+	// Sizes in bytes. Packed node data is split into node array and triangle data that follows it.
+	u64 packedNodeBytes = 0;
+	u64 packedTriangleBytes = 0;
+	u64 nodeBytes = 0;
+	u64 leafPrimBytes = 0;
+	u64 positionVertexBytes = 0;
+
+	// Vertices and indices must be the same as used to build the BVH
+	void calculate(const BVHBuilder& bvh, const float* vertices, u32 stride, const u32* indices,
+		float traversalCost = 1.0f, float intersectionCost = 1.0f, TaskScheduler* scheduler = nullptr);
+
+	void log() const;
+
+	bool writeJson(const char* filename) const;
+};
@@ -0,0 +1,632 @@
+#include "BVHStreamBuilder.h"
+#include "BVHCache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+namespace
+{
+
+static const u32 CellBits = 7; // Per axis, triangles are counted in a grid of 128^3 cells
+static const u32 CellCount = 1u << (CellBits * 3);
+
+struct BucketTriangle
+{
+	Vec3 vertices[3];
+	u32 prim; // Index in the stream
+};
+
+struct Bucket
+{
+	u32 primCount = 0;
+	u32 assignedPrimCount = 0;
+	u32 writtenPrimCount = 0;
+	u64 triangleOffset = 0; // In triangles, from the start of the triangle scratch file
+	std::vector<BucketTriangle> buffer;
+
+	u64 resultOffset = 0; // In bytes, from the start of the result scratch file
+	u32 nodeCount = 0;
+	u32 leafPrimCount = 0;
+	Box3 bounds;
+};
+
+// Subtree of a bucket. Nodes, leaf primitives and triangle records are stored with local indices in the result
+// scratch file and are converted to indices of the final tree when they are loaded.
+struct BucketResult
+{
+	std::vector<BVHNode> nodes;
+	std::vector<u32> leafPrims;
+	std::vector<BVHPackedNode> packedNodes; // Two per node
+	std::vector<BVHPackedNode> triangleRecords; // Two per leaf primitive
+	std::vector<u32> prims; // Stream index of every triangle of the bucket
+};
+
+// Temporary file that is deleted when closed
+class ScratchFile
+{
+	RUSH_DISALLOW_COPY_AND_ASSIGN(ScratchFile);
+
+public:
+
+	ScratchFile() = default;
+	~ScratchFile() { close(); }
+
+	bool open(const std::string& filename)
+	{
+		m_filename = filename;
+		m_file = fopen(filename.c_str(), "w+b");
+		return m_file != nullptr;
+	}
+
+	void close()
+	{
+		if (m_file)
+		{
+			fclose(m_file);
+			remove(m_filename.c_str());
+			m_file = nullptr;
+		}
+	}
+
+	bool seek(u64 offset)
+	{
+#ifdef _WIN32
+		return _fseeki64(m_file, (long long)offset, SEEK_SET) == 0;
+#else
+		return fseeko(m_file, (off_t)offset, SEEK_SET) == 0;
+#endif
+	}
+
+	bool write(const void* data, u64 size)
+	{
+		return size == 0 || fwrite(data, 1, (size_t)size, m_file) == size;
+	}
+
+	bool read(void* data, u64 size)
+	{
+		return size == 0 || fread(data, 1, (size_t)size, m_file) == size;
+	}
+
+	template <typename T>
+	bool readArray(std::vector<T>& outData, u64 count)
+	{
+		outData.resize((size_t)count);
+		return read(outData.data(), count * sizeof(T));
+	}
+
+	template <typename T>
+	bool writeArray(const T* data, u64 count)
+	{
+		return write(data, count * sizeof(T));
+	}
+
+private:
+
+	FILE* m_file = nullptr;
+	std::string m_filename;
+};
+
+inline Vec3 getCentroid(const Vec3* vertices)
+{
+	return (vertices[0] + vertices[1] + vertices[2]) * (1.0f / 3.0f);
+}
+
+inline u32 expandBits10(u32 v)
+{
+	v &= 0x3ff;
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+inline u32 quantizeCellCoordinate(float value, float minValue, float extent)
+{
+	const float t = extent > 0.0f ? (value - minValue) / extent : 0.0f;
+	return min((u32)max(t * float(1u << CellBits), 0.0f), (1u << CellBits) - 1);
+}
+
+// Morton order index of the grid cell that contains the centroid
+inline u32 calculateCell(const Vec3& centroid, const Box3& bounds)
+{
+	const Vec3 extents = bounds.m_max - bounds.m_min;
+	const u32 x = quantizeCellCoordinate(centroid.x, bounds.m_min.x, extents.x);
+	const u32 y = quantizeCellCoordinate(centroid.y, bounds.m_min.y, extents.y);
+	const u32 z = quantizeCellCoordinate(centroid.z, bounds.m_min.z, extents.z);
+	return (expandBits10(x) << 2) | (expandBits10(y) << 1) | expandBits10(z);
+}
+
+bool flushBucket(ScratchFile& file, Bucket& bucket)
+{
+	const bool success = file.seek((bucket.triangleOffset + bucket.writtenPrimCount) * sizeof(BucketTriangle))
+		&& file.writeArray(bucket.buffer.data(), bucket.buffer.size());
+
+	bucket.writtenPrimCount += (u32)bucket.buffer.size();
+	bucket.buffer.clear();
+
+	return success;
+}
+
+}
+
+BVHMeshTriangleStream::BVHMeshTriangleStream(const float* vertices, u32 stride, const u32* indices, u32 primCount)
+	: m_vertices(vertices)
+	, m_stride(stride)
+	, m_indices(indices)
+	, m_primCount(primCount)
+{
+}
+
+u32 BVHMeshTriangleStream::read(Vec3* outVertices, u32 maxCount)
+{
+	const u32 count = min(maxCount, m_primCount - m_position);
+
+	for (u32 i = 0; i < count * 3; ++i)
+	{
+		outVertices[i] = Vec3(m_vertices + m_stride * m_indices[m_position * 3 + i]);
+	}
+
+	m_position += count;
+
+	return count;
+}
+
+bool BVHStreamBuilder::build(BVHTriangleStream& stream, const char* filename, u64 key, const BVHBuilderSettings& inSettings,
+	const BVHStreamBuilderSettings& streamSettings)
+{
+	m_primCount = 0;
+	m_nodeCount = 0;
+	m_bucketCount = 0;
+	m_maxBucketPrimCount = 0;
+
+	BVHBuilderSettings settings = inSettings;
+	settings.triangleFormat = BVHTriangleFormat::Edges;
+
+	const u32 chunkPrimCount = max(1u, streamSettings.chunkPrimCount);
+	const u32 bucketPrimCount = max(1u, streamSettings.bucketPrimCount);
+	const u32 bucketBufferPrimCount = max(1u, streamSettings.bucketBufferPrimCount);
+
+	std::vector<Vec3> chunk(chunkPrimCount * 3);
+
+	// Centroid bounds
+
+	u64 streamPrimCount = 0;
+	Box3 centroidBounds;
+	centroidBounds.expandInit();
+
+	stream.rewind();
+	while (const u32 count = stream.read(chunk.data(), chunkPrimCount))
+	{
+		for (u32 i = 0; i < count; ++i)
+		{
+			centroidBounds.expand(getCentroid(&chunk[i * 3]));
+		}
+		streamPrimCount += count;
+	}
+
+	// Every triangle needs a vertex record and either a leaf node or a triangle record of two packed nodes
+	if (streamPrimCount == 0 || !BVHBuilder::validatePackedNodeCount(streamPrimCount * 3))
+	{
+		return false;
+	}
+
+	const u32 primCount = (u32)streamPrimCount;
+
+	// Triangle count per cell, then index of the first bucket of every cell
+
+	std::vector<u32> cells(CellCount, 0);
+
+	stream.rewind();
+	while (const u32 count = stream.read(chunk.data(), chunkPrimCount))
+	{
+		for (u32 i = 0; i < count; ++i)
+		{
+			++cells[calculateCell(getCentroid(&chunk[i * 3]), centroidBounds)];
+		}
+	}
+
+	std::vector<Bucket> buckets(1);
+
+	for (u32 cell = 0; cell < CellCount; ++cell)
+	{
+		u32 cellPrimCount = cells[cell];
+		if (cellPrimCount == 0)
+		{
+			continue;
+		}
+
+		if (buckets.back().primCount != 0 && buckets.back().primCount + cellPrimCount > bucketPrimCount)
+		{
+			buckets.push_back(Bucket());
+		}
+
+		cells[cell] = (u32)buckets.size() - 1;
+
+		while (buckets.back().primCount + cellPrimCount > bucketPrimCount)
+		{
+			const u32 bucketFreeCount = bucketPrimCount - buckets.back().primCount;
+			buckets.back().primCount += bucketFreeCount;
+			cellPrimCount -= bucketFreeCount;
+			buckets.push_back(Bucket());
+		}
+
+		buckets.back().primCount += cellPrimCount;
+	}
+
+	const u32 bucketCount = (u32)buckets.size();
+
+	u64 triangleOffset = 0;
+	for (Bucket& bucket : buckets)
+	{
+		bucket.triangleOffset = triangleOffset;
+		bucket.buffer.reserve(min(bucket.primCount, bucketBufferPrimCount));
+		triangleOffset += bucket.primCount;
+	}
+
+	// Triangles are sorted into buckets and first vertices are stored in stream order, as in the final vertex records
+
+	const std::string scratchFilename = filename;
+
+	ScratchFile triangleFile;
+	ScratchFile vertexFile;
+	ScratchFile resultFile;
+
+	if (!triangleFile.open(scratchFilename + ".triangles.tmp")
+		|| !vertexFile.open(scratchFilename + ".vertices.tmp")
+		|| !resultFile.open(scratchFilename + ".buckets.tmp"))
+	{
+		return false;
+	}
+
+	std::vector<BVHPackedNode> vertexRecords(chunkPrimCount);
+	u32 streamPrim = 0;
+
+	stream.rewind();
+	while (const u32 count = stream.read(chunk.data(), chunkPrimCount))
+	{
+		if (count > primCount - streamPrim)
+		{
+			return false; // Stream changed between passes
+		}
+
+		for (u32 i = 0; i < count; ++i)
+		{
+			const Vec3* vertices = &chunk[i * 3];
+
+			// Cells that are split into several buckets fill them in order
+			u32& bucketIndex = cells[calculateCell(getCentroid(vertices), centroidBounds)];
+			while (buckets[bucketIndex].assignedPrimCount == buckets[bucketIndex].primCount)
+			{
+				++bucketIndex;
+			}
+
+			Bucket& bucket = buckets[bucketIndex];
+
+			BucketTriangle triangle;
+			triangle.vertices[0] = vertices[0];
+			triangle.vertices[1] = vertices[1];
+			triangle.vertices[2] = vertices[2];
+			triangle.prim = streamPrim + i;
+
+			bucket.buffer.push_back(triangle);
+			++bucket.assignedPrimCount;
+
+			if (bucket.buffer.size() == bucketBufferPrimCount && !flushBucket(triangleFile, bucket))
+			{
+				return false;
+			}
+
+			vertexRecords[i] = {};
+			memcpy(&vertexRecords[i], &vertices[0], sizeof(Vec3));
+		}
+
+		if (!vertexFile.writeArray(vertexRecords.data(), count))
+		{
+			return false;
+		}
+
+		streamPrim += count;
+	}
+
+	if (streamPrim != primCount)
+	{
+		return false;
+	}
+
+	for (Bucket& bucket : buckets)
+	{
+		if (!flushBucket(triangleFile, bucket))
+		{
+			return false;
+		}
+		std::vector<BucketTriangle>().swap(bucket.buffer);
+	}
+
+	// Bucket subtrees
+
+	std::vector<BucketTriangle> triangles;
+	std::vector<float> positions;
+	std::vector<u32> indices;
+	std::vector<u32> prims;
+
+	u64 resultOffset = 0;
+
+	for (Bucket& bucket : buckets)
+	{
+		const u32 bucketTriangleCount = bucket.primCount;
+
+		if (!triangleFile.seek(bucket.triangleOffset * sizeof(BucketTriangle))
+			|| !triangleFile.readArray(triangles, bucketTriangleCount))
+		{
+			return false;
+		}
+
+		positions.resize(bucketTriangleCount * 9);
+		indices.resize(bucketTriangleCount * 3);
+		prims.resize(bucketTriangleCount);
+
+		for (u32 i = 0; i < bucketTriangleCount; ++i)
+		{
+			memcpy(&positions[i * 9], triangles[i].vertices, sizeof(float) * 9);
+			indices[i * 3 + 0] = i * 3 + 0;
+			indices[i * 3 + 1] = i * 3 + 1;
+			indices[i * 3 + 2] = i * 3 + 2;
+			prims[i] = triangles[i].prim;
+		}
+
+		BVHBuilder builder;
+		builder.build(positions.data(), 3, indices.data(), bucketTriangleCount, settings);
+
+		const u32 nodeCount = (u32)builder.m_nodes.size();
+		const u32 leafPrimCount = (u32)builder.m_leafPrims.size();
+
+		bucket.resultOffset = resultOffset;
+		bucket.nodeCount = nodeCount;
+		bucket.leafPrimCount = leafPrimCount;
+		bucket.bounds.m_min = builder.m_nodes[0].bboxMin;
+		bucket.bounds.m_max = builder.m_nodes[0].bboxMax;
+
+		// Vertex records of the bucket are skipped, they are written in stream order instead
+		const BVHPackedNode* triangleRecords = builder.m_packedNodes.data() + nodeCount * 2 + bucketTriangleCount;
+
+		if (!resultFile.writeArray(builder.m_nodes.data(), nodeCount)
+			|| !resultFile.writeArray(builder.m_leafPrims.data(), leafPrimCount)
+			|| !resultFile.writeArray(builder.m_packedNodes.data(), nodeCount * 2)
+			|| !resultFile.writeArray(triangleRecords, leafPrimCount * 2)
+			|| !resultFile.writeArray(prims.data(), bucketTriangleCount))
+		{
+			return false;
+		}
+
+		resultOffset += u64(nodeCount) * sizeof(BVHNode)
+			+ u64(leafPrimCount) * sizeof(u32)
+			+ u64(nodeCount) * 2 * sizeof(BVHPackedNode)
+			+ u64(leafPrimCount) * 2 * sizeof(BVHPackedNode)
+			+ u64(bucketTriangleCount) * sizeof(u32);
+
+		m_maxBucketPrimCount = max(m_maxBucketPrimCount, bucketTriangleCount);
+	}
+
+	triangleFile.close();
+	std::vector<BucketTriangle>().swap(triangles);
+	std::vector<float>().swap(positions);
+	std::vector<u32>().swap(indices);
+	std::vector<u32>().swap(prims);
+
+	// Top level over bucket bounds. Every top-level leaf is replaced by the bucket subtree, so node indices of the final
+	// tree are offset by the size of preceding subtrees.
+
+	std::vector<Box3> bucketBounds(bucketCount);
+	for (u32 i = 0; i < bucketCount; ++i)
+	{
+		bucketBounds[i] = buckets[i].bounds;
+	}
+
+	BVHBuilderSettings topLevelSettings = settings;
+	topLevelSettings.maxLeafSize = 1;
+
+	BVHBuilder topLevel;
+	topLevel.build(bucketBounds.data(), bucketCount, topLevelSettings);
+
+	const std::vector<BVHNode>& topLevelNodes = topLevel.m_nodes;
+	const u32 topLevelNodeCount = (u32)topLevelNodes.size();
+
+	std::vector<u32> finalNodeIndices(topLevelNodeCount);
+	std::vector<u32> bucketLeafPrimOffsets(bucketCount);
+
+	u64 nodeCount = 0;
+	u64 leafPrimCount = 0;
+
+	for (u32 i = 0; i < topLevelNodeCount; ++i)
+	{
+		finalNodeIndices[i] = (u32)nodeCount;
+
+		if (topLevelNodes[i].isLeaf())
+		{
+			const Bucket& bucket = buckets[topLevelNodes[i].prim];
+			bucketLeafPrimOffsets[topLevelNodes[i].prim] = (u32)leafPrimCount;
+			nodeCount += bucket.nodeCount;
+			leafPrimCount += bucket.leafPrimCount;
+		}
+		else
+		{
+			nodeCount += 1;
+		}
+	}
+
+	if (!BVHBuilder::validatePackedNodeCount(nodeCount * 2 + primCount + leafPrimCount * 2))
+	{
+		return false;
+	}
+
+	const u32 vertexRecordOffset = (u32)nodeCount * 2;
+	const u32 triangleRecordOffset = vertexRecordOffset + primCount;
+
+	auto getFinalNext = [&](u32 topLevelNode)
+	{
+		const u32 next = topLevelNodes[topLevelNode].next;
+		return next == BVHNode::InvalidMask ? next : finalNodeIndices[next];
+	};
+
+	BucketResult result;
+
+	// Loads a bucket subtree and converts it to node, primitive and record indices of the final tree
+	auto loadBucket = [&](u32 topLevelNode)
+	{
+		const u32 bucketIndex = topLevelNodes[topLevelNode].prim;
+		const Bucket& bucket = buckets[bucketIndex];
+
+		if (!resultFile.seek(bucket.resultOffset)
+			|| !resultFile.readArray(result.nodes, bucket.nodeCount)
+			|| !resultFile.readArray(result.leafPrims, bucket.leafPrimCount)
+			|| !resultFile.readArray(result.packedNodes, u64(bucket.nodeCount) * 2)
+			|| !resultFile.readArray(result.triangleRecords, u64(bucket.leafPrimCount) * 2)
+			|| !resultFile.readArray(result.prims, bucket.primCount))
+		{
+			return false;
+		}
+
+		const u32 nodeOffset = finalNodeIndices[topLevelNode];
+		const u32 leafPrimOffset = bucketLeafPrimOffsets[bucketIndex];
+		const u32 subtreeNext = getFinalNext(topLevelNode);
+
+		for (u32 i = 0; i < bucket.nodeCount; ++i)
+		{
+			BVHNode& node = result.nodes[i];
+			BVHPackedNode* packedNode = &result.packedNodes[i * 2];
+
+			// Nodes on the right spine of the subtree skip to the node that follows the top-level leaf
+			node.next = node.next == BVHNode::InvalidMask ? subtreeNext : nodeOffset + node.next;
+			packedNode[1].d = node.next;
+
+			if (!node.isLeaf())
+			{
+				continue;
+			}
+
+			if (node.prim & BVHNode::LeafMask)
+			{
+				node.prim = BVHNode::LeafMask | (leafPrimOffset + (node.prim & ~BVHNode::LeafMask));
+				packedNode[0].d = BVHNode::LeafMask | (triangleRecordOffset + (node.prim & ~BVHNode::LeafMask) * 2);
+			}
+			else
+			{
+				node.prim = result.prims[node.prim];
+				packedNode[0].d = vertexRecordOffset + node.prim;
+			}
+		}
+
+		for (u32& leafPrim : result.leafPrims)
+		{
+			leafPrim = result.prims[leafPrim & ~BVHNode::LeafMask] | (leafPrim & BVHNode::LeafMask);
+		}
+
+		for (u32 i = 0; i < bucket.leafPrimCount; ++i)
+		{
+			BVHPackedNode& record = result.triangleRecords[i * 2];
+			record.d = vertexRecordOffset + result.prims[record.d - bucket.nodeCount * 2];
+		}
+
+		return true;
+	};
+
+	auto getTopLevelInternalNode = [&](u32 topLevelNode)
+	{
+		BVHNode node = topLevelNodes[topLevelNode];
+		node.next = getFinalNext(topLevelNode);
+		return node;
+	};
+
+	BVHCacheWriter writer;
+
+	if (!writer.open(filename, key, BVHTriangleFormat::Edges, 0.0f,
+		nodeCount * 2 + primCount + leafPrimCount * 2, nodeCount, leafPrimCount, 0))
+	{
+		return false;
+	}
+
+	// Packed nodes, with the same layout as BVHBuilder::m_packedNodes
+
+	for (u32 i = 0; i < topLevelNodeCount; ++i)
+	{
+		if (!topLevelNodes[i].isLeaf())
+		{
+			static_assert(sizeof(BVHNode) == 2 * sizeof(BVHPackedNode), "Internal node must occupy two packed nodes");
+			const BVHNode node = getTopLevelInternalNode(i);
+			if (!writer.write(&node, sizeof(node)))
+			{
+				return false;
+			}
+		}
+		else if (!loadBucket(i) || !writer.write(result.packedNodes.data(), result.packedNodes.size() * sizeof(BVHPackedNode)))
+		{
+			return false;
+		}
+	}
+
+	if (!vertexFile.seek(0))
+	{
+		return false;
+	}
+
+	for (u32 i = 0; i < primCount; i += chunkPrimCount)
+	{
+		const u32 count = min(chunkPrimCount, primCount - i);
+		if (!vertexFile.read(vertexRecords.data(), u64(count) * sizeof(BVHPackedNode))
+			|| !writer.write(vertexRecords.data(), u64(count) * sizeof(BVHPackedNode)))
+		{
+			return false;
+		}
+	}
+
+	vertexFile.close();
+
+	for (u32 i = 0; i < topLevelNodeCount; ++i)
+	{
+		if (topLevelNodes[i].isLeaf()
+			&& (!loadBucket(i) || !writer.write(result.triangleRecords.data(), result.triangleRecords.size() * sizeof(BVHPackedNode))))
+		{
+			return false;
+		}
+	}
+
+	// Nodes and multi-primitive leaf primitives, with the same layout as BVHBuilder::m_nodes and m_leafPrims
+
+	for (u32 i = 0; i < topLevelNodeCount; ++i)
+	{
+		if (!topLevelNodes[i].isLeaf())
+		{
+			const BVHNode node = getTopLevelInternalNode(i);
+			if (!writer.write(&node, sizeof(node)))
+			{
+				return false;
+			}
+		}
+		else if (!loadBucket(i) || !writer.write(result.nodes.data(), result.nodes.size() * sizeof(BVHNode)))
+		{
+			return false;
+		}
+	}
+
+	for (u32 i = 0; i < topLevelNodeCount; ++i)
+	{
+		if (topLevelNodes[i].isLeaf()
+			&& (!loadBucket(i) || !writer.write(result.leafPrims.data(), result.leafPrims.size() * sizeof(u32))))
+		{
+			return false;
+		}
+	}
+
+	if (!writer.close())
+	{
+		return false;
+	}
+
+	m_primCount = primCount;
+	m_nodeCount = (u32)nodeCount;
+	m_bucketCount = bucketCount;
+
+	return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "BVHBuilder.h"
+
+// Sequential source of triangles for BVHStreamBuilder, which reads the stream several times
+class BVHTriangleStream
+{
+public:
+
+	virtual ~BVHTriangleStream() = default;
+
+	virtual void rewind() = 0;
+
+	// Writes up to maxCount triangles as three vertex positions each. Returns the number of triangles read,
+	// which is zero at the end of the stream.
+	virtual u32 read(Vec3* outVertices, u32 maxCount) = 0;
+};
+
+// Triangles of an indexed mesh in memory. The mesh stays resident, so only memory used by the builder is bounded.
+class BVHMeshTriangleStream : public BVHTriangleStream
+{
+public:
+
+	BVHMeshTriangleStream(const float* vertices, u32 stride, const u32* indices, u32 primCount);
+
+	void rewind() override { m_position = 0; }
+	u32 read(Vec3* outVertices, u32 maxCount) override;
+
+private:
+
+	const float* m_vertices;
+	u32 m_stride;
+	const u32* m_indices;
+	u32 m_primCount;
+	u32 m_position = 0;
+};
+
+struct BVHStreamBuilderSettings
+{
+	// Triangles of a bucket are built in memory as one subtree, so this bounds peak memory usage of the build
+	u32 bucketPrimCount = 1u << 20;
+
+	u32 chunkPrimCount = 1u << 16; // Triangles read from the stream at a time
+	u32 bucketBufferPrimCount = 256; // Triangles buffered per bucket before they are written to the scratch file
+};
+
+// Out-of-core build of BVHs that do not fit in memory, written directly to a BVHCache file.
+// Memory used by the build is bounded by the bucket size, memory used by the stream is up to the caller:
+// 1. Triangles are counted in a grid of cells over the bounds of their centroids.
+// 2. Consecutive cells along the Morton curve are grouped into buckets of up to bucketPrimCount triangles. Cells with
+//    more triangles are split into several buckets in stream order.
+// 3. Triangles are sorted into buckets in a scratch file next to the output.
+// 4. Every bucket is built with BVHBuilder and the result is stored in a second scratch file.
+// 5. Top-level BVH is built over bucket bounds and the cache file is written with bucket subtrees in place of
+//    top-level leaves.
+// Primitive indices are positions of triangles in the stream, so the cache can be used with the same mesh in memory.
+// Output always uses BVHTriangleFormat::Edges. Node layout and treelet optimization only apply within buckets.
+struct BVHStreamBuilder
+{
+	u32 m_primCount = 0;
+	u32 m_nodeCount = 0;
+	u32 m_bucketCount = 0;
+	u32 m_maxBucketPrimCount = 0; // Largest bucket, which determines peak memory usage
+
+	// Returns false if the stream is empty, the output is too large for the packed format or a file operation failed.
+	// Output that exceeds BVHBuilder::MaxPackedNodeCount is also reported as an error.
+	bool build(BVHTriangleStream& stream, const char* filename, u64 key, const BVHBuilderSettings& settings = BVHBuilderSettings(),
+		const BVHStreamBuilderSettings& streamSettings = BVHStreamBuilderSettings());
+};
@@ -0,0 +1,672 @@
+#include "BVHWide.h"
+
+#include <math.h>
+#include <string.h>
+#include <xmmintrin.h>
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define BVH_TARGET_AVX
+#else
+#define BVH_TARGET_AVX __attribute__((target("avx")))
+#endif
+
+namespace
+{
+
+inline float bboxSurfaceArea(const BVHNode& node)
+{
+	Vec3 extents = node.bboxMax - node.bboxMin;
+	return (extents.x * extents.y + extents.y * extents.z + extents.z * extents.x) * 2.0f;
+}
+
+bool isAvxSupported()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	const bool avx = (info[2] & (1 << 28)) != 0;
+	return osxsave && avx && (_xgetbv(0) & 6) == 6;
+#else
+	return __builtin_cpu_supports("avx") != 0;
+#endif
+}
+
+struct TriangleList
+{
+	const float* vertices;
+	u32 stride;
+	const u32* indices;
+
+	Vec3 getVertex(u32 prim, u32 corner) const
+	{
+		return Vec3(vertices + stride * indices[prim * 3 + corner]);
+	}
+};
+
+template <u32 Width>
+struct CollapseContext
+{
+	const BVHBuilder& bvh;
+	const TriangleList& triangles;
+	BVHWide<Width>& output;
+};
+
+template <u32 Width>
+void addTriangle(CollapseContext<Width>& context, u32 prim, bool last)
+{
+	const Vec3 v0 = context.triangles.getVertex(prim, 0);
+	const Vec3 v1 = context.triangles.getVertex(prim, 1);
+	const Vec3 v2 = context.triangles.getVertex(prim, 2);
+
+	BVHWideTriangle triangle;
+	triangle.v0 = v0;
+	triangle.prim = prim;
+	triangle.edge0 = v1 - v0;
+	triangle.last = last ? 1 : 0;
+	triangle.edge1 = v2 - v0;
+	triangle.padding = 0;
+
+	context.output.m_triangles.push_back(triangle);
+}
+
+// Returns index of the first triangle of the leaf
+template <u32 Width>
+u32 addLeafTriangles(CollapseContext<Width>& context, const BVHNode& leaf)
+{
+	const u32 firstTriangle = (u32)context.output.m_triangles.size();
+
+	if (leaf.prim & BVHNode::LeafMask)
+	{
+		const std::vector<u32>& leafPrims = context.bvh.m_leafPrims;
+		for (u32 i = leaf.prim & ~BVHNode::LeafMask; ; ++i)
+		{
+			const bool last = (leafPrims[i] & BVHNode::LeafMask) != 0;
+			addTriangle(context, leafPrims[i] & ~BVHNode::LeafMask, last);
+			if (last)
+			{
+				break;
+			}
+		}
+	}
+	else
+	{
+		addTriangle(context, leaf.prim, true);
+	}
+
+	return firstTriangle;
+}
+
+struct CollapseItem
+{
+	u32 binaryNodeId;
+	u32 parentId; // Wide node that references this item, InvalidMask for the root
+	u32 childSlot;
+	u32 depth;
+	bool leaf;
+};
+
+// Left child of a binary node directly follows it and right child is the miss link of the left child.
+// Children are pushed in reverse order, so nodes and triangles are emitted in depth-first order.
+template <u32 Width>
+void collapseNodes(CollapseContext<Width>& context)
+{
+	const std::vector<BVHNode>& nodes = context.bvh.m_nodes;
+	std::vector<typename BVHWide<Width>::Node>& wideNodes = context.output.m_nodes;
+
+	std::vector<CollapseItem> stack;
+	stack.push_back({ 0, BVHNode::InvalidMask, 0, 0, false });
+
+	while (!stack.empty())
+	{
+		const CollapseItem item = stack.back();
+		stack.pop_back();
+
+		if (item.leaf)
+		{
+			wideNodes[item.parentId].children[item.childSlot] =
+			    BVHNode::LeafMask | addLeafTriangles(context, nodes[item.binaryNodeId]);
+			continue;
+		}
+
+		u32 children[Width];
+		u32 childCount = 0;
+
+		if (nodes[item.binaryNodeId].isLeaf())
+		{
+			children[childCount++] = item.binaryNodeId;
+		}
+		else
+		{
+			children[childCount++] = item.binaryNodeId + 1;
+			children[childCount++] = nodes[item.binaryNodeId + 1].next;
+		}
+
+		while (childCount < Width)
+		{
+			u32 bestIndex = BVHNode::InvalidMask;
+			float bestSurfaceArea = -1.0f;
+
+			for (u32 i = 0; i < childCount; ++i)
+			{
+				const BVHNode& child = nodes[children[i]];
+				const float surfaceArea = bboxSurfaceArea(child);
+				if (!child.isLeaf() && surfaceArea > bestSurfaceArea)
+				{
+					bestIndex = i;
+					bestSurfaceArea = surfaceArea;
+				}
+			}
+
+			if (bestIndex == BVHNode::InvalidMask)
+			{
+				break;
+			}
+
+			const u32 expandedId = children[bestIndex];
+			children[bestIndex] = expandedId + 1;
+			children[childCount++] = nodes[expandedId + 1].next;
+		}
+
+		const u32 wideNodeId = (u32)wideNodes.size();
+		context.output.m_maxDepth = max(context.output.m_maxDepth, item.depth);
+
+		if (item.parentId != BVHNode::InvalidMask)
+		{
+			wideNodes[item.parentId].children[item.childSlot] = wideNodeId;
+		}
+
+		typename BVHWide<Width>::Node wideNode;
+
+		for (u32 i = 0; i < Width; ++i)
+		{
+			if (i >= childCount)
+			{
+				wideNode.bboxMinX[i] = FLT_MAX;
+				wideNode.bboxMinY[i] = FLT_MAX;
+				wideNode.bboxMinZ[i] = FLT_MAX;
+				wideNode.bboxMaxX[i] = -FLT_MAX;
+				wideNode.bboxMaxY[i] = -FLT_MAX;
+				wideNode.bboxMaxZ[i] = -FLT_MAX;
+				wideNode.children[i] = BVHNode::InvalidMask;
+				continue;
+			}
+
+			const BVHNode& child = nodes[children[i]];
+
+			wideNode.bboxMinX[i] = child.bboxMin.x;
+			wideNode.bboxMinY[i] = child.bboxMin.y;
+			wideNode.bboxMinZ[i] = child.bboxMin.z;
+			wideNode.bboxMaxX[i] = child.bboxMax.x;
+			wideNode.bboxMaxY[i] = child.bboxMax.y;
+			wideNode.bboxMaxZ[i] = child.bboxMax.z;
+
+			// Child links are written when the child item is popped
+			wideNode.children[i] = BVHNode::InvalidMask;
+		}
+
+		wideNodes.push_back(wideNode);
+
+		for (u32 i = childCount; i-- > 0;)
+		{
+			stack.push_back({ children[i], wideNodeId, i, item.depth + 1, nodes[children[i]].isLeaf() });
+		}
+	}
+}
+
+// Leaf children are changed to point to the first vec4 of the triangle record in the packed buffer
+template <typename NodeType, u32 ChildCount>
+void packNodes(const std::vector<NodeType>& nodes, const std::vector<BVHWideTriangle>& triangles,
+	std::vector<BVHPackedNode>& outPackedNodes)
+{
+	static_assert(sizeof(NodeType) % sizeof(BVHPackedNode) == 0, "Node must consist of whole vec4 elements");
+	static_assert(sizeof(BVHWideTriangle) == sizeof(BVHPackedNode) * 3, "Triangle record must consist of 3 vec4 elements");
+
+	const u32 nodeSize = sizeof(NodeType) / sizeof(BVHPackedNode);
+	const u32 triangleOffset = (u32)nodes.size() * nodeSize;
+
+	outPackedNodes.resize(triangleOffset + triangles.size() * 3);
+
+	for (u32 i = 0; i < (u32)nodes.size(); ++i)
+	{
+		NodeType packedNode = nodes[i];
+		for (u32 j = 0; j < ChildCount; ++j)
+		{
+			const u32 child = packedNode.children[j];
+			if (child != BVHNode::InvalidMask && (child & BVHNode::LeafMask))
+			{
+				packedNode.children[j] = BVHNode::LeafMask | (triangleOffset + (child & ~BVHNode::LeafMask) * 3);
+			}
+		}
+		memcpy(&outPackedNodes[i * nodeSize], &packedNode, sizeof(packedNode));
+	}
+
+	if (!triangles.empty())
+	{
+		memcpy(&outPackedNodes[triangleOffset], triangles.data(), triangles.size() * sizeof(BVHWideTriangle));
+	}
+}
+
+inline float exponentToScale(u32 biasedExponent)
+{
+	const u32 bits = biasedExponent << 23;
+	float result;
+	memcpy(&result, &bits, sizeof(result));
+	return result;
+}
+
+// Finds the smallest power of two scale that covers the extent with 255 steps
+u32 findQuantizationExponent(float boundsMin, float boundsMax)
+{
+	int exponent;
+	frexpf((boundsMax - boundsMin) / 255.0f, &exponent);
+
+	u32 biasedExponent = (u32)max(1, min(254, exponent + 126));
+	while (biasedExponent > 1 && boundsMin + 255.0f * exponentToScale(biasedExponent - 1) >= boundsMax)
+	{
+		--biasedExponent;
+	}
+	while (biasedExponent < 254 && boundsMin + 255.0f * exponentToScale(biasedExponent) < boundsMax)
+	{
+		++biasedExponent;
+	}
+
+	return biasedExponent;
+}
+
+// Decoding uses the same floating point operations, so the result can be adjusted until it is conservative
+u8 quantizeMin(float value, float origin, float scale)
+{
+	int q = max(0, min(255, (int)floorf((value - origin) / scale)));
+	while (q > 0 && origin + float(q) * scale > value)
+	{
+		--q;
+	}
+	return (u8)q;
+}
+
+u8 quantizeMax(float value, float origin, float scale)
+{
+	int q = max(0, min(255, (int)ceilf((value - origin) / scale)));
+	while (q < 255 && origin + float(q) * scale < value)
+	{
+		++q;
+	}
+	return (u8)q;
+}
+
+inline __m128 loadQuantized(const u8* data)
+{
+	u32 packed;
+	memcpy(&packed, data, sizeof(packed));
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bytes = _mm_cvtsi32_si128((int)packed);
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero));
+}
+
+inline bool intersectTriangle(const BVHWideTriangle& triangle, const Vec3& origin, const Vec3& direction, float maxT)
+{
+	const Vec3 s1 = cross(direction, triangle.edge1);
+	const float invd = 1.0f / dot(s1, triangle.edge0);
+	const Vec3 d = origin - triangle.v0;
+	const float b1 = dot(d, s1) * invd;
+	const Vec3 s2 = cross(d, triangle.edge0);
+	const float b2 = dot(direction, s2) * invd;
+	const float t = dot(triangle.edge1, s2) * invd;
+
+	return !(b1 < 0.0f || b1 > 1.0f || b2 < 0.0f || b1 + b2 > 1.0f || t < 0.0f || t > maxT);
+}
+
+inline bool intersectLeaf(const std::vector<BVHWideTriangle>& triangles, u32 firstTriangle,
+	const Vec3& origin, const Vec3& direction, float maxT)
+{
+	for (u32 i = firstTriangle; ; ++i)
+	{
+		if (intersectTriangle(triangles[i], origin, direction, maxT))
+		{
+			return true;
+		}
+
+		if (triangles[i].last)
+		{
+			return false;
+		}
+	}
+}
+
+// Traversal stack is large enough for any path from the root to a leaf
+struct TraversalStack
+{
+	TraversalStack(u32 maxDepth, u32 width)
+	{
+		const u32 requiredSize = (maxDepth + 1) * (width - 1) + 1;
+		if (requiredSize > LocalSize)
+		{
+			heapData.resize(requiredSize);
+			data = heapData.data();
+		}
+	}
+
+	static const u32 LocalSize = 256;
+	u32 localData[LocalSize];
+	std::vector<u32> heapData;
+	u32* data = localData;
+	u32 size = 0;
+};
+
+struct RaySse
+{
+	RaySse(const Vec3& origin, const Vec3& direction, float maxT)
+	{
+		originX = _mm_set1_ps(origin.x);
+		originY = _mm_set1_ps(origin.y);
+		originZ = _mm_set1_ps(origin.z);
+		invDirX = _mm_set1_ps(1.0f / direction.x);
+		invDirY = _mm_set1_ps(1.0f / direction.y);
+		invDirZ = _mm_set1_ps(1.0f / direction.z);
+		tMax = _mm_set1_ps(maxT);
+	}
+
+	__m128 originX, originY, originZ;
+	__m128 invDirX, invDirY, invDirZ;
+	__m128 tMax;
+};
+
+// Returns a bit mask of 4 children starting at offset whose bounds are hit by the ray
+template <u32 Width>
+inline u32 intersectChildrenSse(const BVHWideNode<Width>& node, u32 offset, const RaySse& ray)
+{
+	const __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bboxMinX + offset), ray.originX), ray.invDirX);
+	const __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bboxMinY + offset), ray.originY), ray.invDirY);
+	const __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bboxMinZ + offset), ray.originZ), ray.invDirZ);
+	const __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bboxMaxX + offset), ray.originX), ray.invDirX);
+	const __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bboxMaxY + offset), ray.originY), ray.invDirY);
+	const __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bboxMaxZ + offset), ray.originZ), ray.invDirZ);
+
+	__m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)), _mm_min_ps(t0z, t1z));
+	__m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)), _mm_max_ps(t0z, t1z));
+
+	tNear = _mm_max_ps(tNear, _mm_setzero_ps());
+	tFar = _mm_min_ps(tFar, ray.tMax);
+
+	return (u32)_mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+}
+
+template <u32 Width>
+bool intersectAnySse(const BVHWide<Width>& bvh, const Vec3& origin, const Vec3& direction, float maxT)
+{
+	const RaySse ray(origin, direction, maxT);
+
+	TraversalStack stack(bvh.m_maxDepth, Width);
+	stack.data[stack.size++] = 0;
+
+	while (stack.size)
+	{
+		const BVHWideNode<Width>& node = bvh.m_nodes[stack.data[--stack.size]];
+
+		u32 hitMask = 0;
+		for (u32 offset = 0; offset < Width; offset += 4)
+		{
+			hitMask |= intersectChildrenSse(node, offset, ray) << offset;
+		}
+
+		for (u32 i = 0; i < Width; ++i)
+		{
+			const u32 child = node.children[i];
+			if (!(hitMask & (1 << i)) || child == BVHNode::InvalidMask)
+			{
+				continue;
+			}
+
+			if (child & BVHNode::LeafMask)
+			{
+				if (intersectLeaf(bvh.m_triangles, child & ~BVHNode::LeafMask, origin, direction, maxT))
+				{
+					return true;
+				}
+			}
+			else
+			{
+				stack.data[stack.size++] = child;
+			}
+		}
+	}
+
+	return false;
+}
+
+// Same as intersectAnySse, but tests all 8 children with one set of AVX instructions
+BVH_TARGET_AVX bool intersectAnyAvx(const BVH8& bvh, const Vec3& origin, const Vec3& direction, float maxT)
+{
+	const __m256 originX = _mm256_set1_ps(origin.x);
+	const __m256 originY = _mm256_set1_ps(origin.y);
+	const __m256 originZ = _mm256_set1_ps(origin.z);
+	const __m256 invDirX = _mm256_set1_ps(1.0f / direction.x);
+	const __m256 invDirY = _mm256_set1_ps(1.0f / direction.y);
+	const __m256 invDirZ = _mm256_set1_ps(1.0f / direction.z);
+	const __m256 tMax = _mm256_set1_ps(maxT);
+
+	TraversalStack stack(bvh.m_maxDepth, 8);
+	stack.data[stack.size++] = 0;
+
+	while (stack.size)
+	{
+		const BVH8::Node& node = bvh.m_nodes[stack.data[--stack.size]];
+
+		const __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bboxMinX), originX), invDirX);
+		const __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bboxMinY), originY), invDirY);
+		const __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bboxMinZ), originZ), invDirZ);
+		const __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bboxMaxX), originX), invDirX);
+		const __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bboxMaxY), originY), invDirY);
+		const __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bboxMaxZ), originZ), invDirZ);
+
+		__m256 tNear = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)), _mm256_min_ps(t0z, t1z));
+		__m256 tFar = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)), _mm256_max_ps(t0z, t1z));
+
+		tNear = _mm256_max_ps(tNear, _mm256_setzero_ps());
+		tFar = _mm256_min_ps(tFar, tMax);
+
+		const u32 hitMask = (u32)_mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ));
+
+		for (u32 i = 0; i < 8; ++i)
+		{
+			const u32 child = node.children[i];
+			if (!(hitMask & (1 << i)) || child == BVHNode::InvalidMask)
+			{
+				continue;
+			}
+
+			if (child & BVHNode::LeafMask)
+			{
+				if (intersectLeaf(bvh.m_triangles, child & ~BVHNode::LeafMask, origin, direction, maxT))
+				{
+					return true;
+				}
+			}
+			else
+			{
+				stack.data[stack.size++] = child;
+			}
+		}
+	}
+
+	return false;
+}
+
+bool intersectAnyQuantized(const BVHQuantized& bvh, const Vec3& origin, const Vec3& direction, float maxT)
+{
+	const RaySse ray(origin, direction, maxT);
+
+	TraversalStack stack(bvh.m_maxDepth, 4);
+	stack.data[stack.size++] = 0;
+
+	while (stack.size)
+	{
+		const BVHQuantizedNode& node = bvh.m_nodes[stack.data[--stack.size]];
+
+		const __m128 originX = _mm_set1_ps(node.origin.x);
+		const __m128 originY = _mm_set1_ps(node.origin.y);
+		const __m128 originZ = _mm_set1_ps(node.origin.z);
+		const __m128 scaleX = _mm_set1_ps(exponentToScale(node.exponents[0]));
+		const __m128 scaleY = _mm_set1_ps(exponentToScale(node.exponents[1]));
+		const __m128 scaleZ = _mm_set1_ps(exponentToScale(node.exponents[2]));
+
+		const __m128 bboxMinX = _mm_add_ps(originX, _mm_mul_ps(loadQuantized(node.bboxMinX), scaleX));
+		const __m128 bboxMinY = _mm_add_ps(originY, _mm_mul_ps(loadQuantized(node.bboxMinY), scaleY));
+		const __m128 bboxMinZ = _mm_add_ps(originZ, _mm_mul_ps(loadQuantized(node.bboxMinZ), scaleZ));
+		const __m128 bboxMaxX = _mm_add_ps(originX, _mm_mul_ps(loadQuantized(node.bboxMaxX), scaleX));
+		const __m128 bboxMaxY = _mm_add_ps(originY, _mm_mul_ps(loadQuantized(node.bboxMaxY), scaleY));
+		const __m128 bboxMaxZ = _mm_add_ps(originZ, _mm_mul_ps(loadQuantized(node.bboxMaxZ), scaleZ));
+
+		const __m128 t0x = _mm_mul_ps(_mm_sub_ps(bboxMinX, ray.originX), ray.invDirX);
+		const __m128 t0y = _mm_mul_ps(_mm_sub_ps(bboxMinY, ray.originY), ray.invDirY);
+		const __m128 t0z = _mm_mul_ps(_mm_sub_ps(bboxMinZ, ray.originZ), ray.invDirZ);
+		const __m128 t1x = _mm_mul_ps(_mm_sub_ps(bboxMaxX, ray.originX), ray.invDirX);
+		const __m128 t1y = _mm_mul_ps(_mm_sub_ps(bboxMaxY, ray.originY), ray.invDirY);
+		const __m128 t1z = _mm_mul_ps(_mm_sub_ps(bboxMaxZ, ray.originZ), ray.invDirZ);
+
+		__m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)), _mm_min_ps(t0z, t1z));
+		__m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)), _mm_max_ps(t0z, t1z));
+
+		tNear = _mm_max_ps(tNear, _mm_setzero_ps());
+		tFar = _mm_min_ps(tFar, ray.tMax);
+
+		const u32 hitMask = (u32)_mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+
+		for (u32 i = 0; i < 4; ++i)
+		{
+			const u32 child = node.children[i];
+			if (!(hitMask & (1 << i)) || child == BVHNode::InvalidMask)
+			{
+				continue;
+			}
+
+			if (child & BVHNode::LeafMask)
+			{
+				if (intersectLeaf(bvh.m_triangles, child & ~BVHNode::LeafMask, origin, direction, maxT))
+				{
+					return true;
+				}
+			}
+			else
+			{
+				stack.data[stack.size++] = child;
+			}
+		}
+	}
+
+	return false;
+}
+
+}
+
+template <u32 Width>
+void BVHWide<Width>::build(const BVHBuilder& bvh, const float* vertices, u32 stride, const u32* indices)
+{
+	m_nodes.clear();
+	m_triangles.clear();
+	m_packedNodes.clear();
+	m_maxDepth = 0;
+
+	if (bvh.m_nodes.empty())
+	{
+		return;
+	}
+
+	const TriangleList triangles = { vertices, stride, indices };
+	CollapseContext<Width> context = { bvh, triangles, *this };
+
+	collapseNodes(context);
+
+	packNodes<Node, Width>(m_nodes, m_triangles, m_packedNodes);
+}
+
+template <>
+bool BVHWide<4>::intersectAny(const Vec3& origin, const Vec3& direction, float maxT) const
+{
+	return !m_nodes.empty() && intersectAnySse(*this, origin, direction, maxT);
+}
+
+template <>
+bool BVHWide<8>::intersectAny(const Vec3& origin, const Vec3& direction, float maxT) const
+{
+	static const bool avxSupported = isAvxSupported();
+
+	if (m_nodes.empty())
+	{
+		return false;
+	}
+	else if (avxSupported)
+	{
+		return intersectAnyAvx(*this, origin, direction, maxT);
+	}
+	else
+	{
+		return intersectAnySse(*this, origin, direction, maxT);
+	}
+}
+
+void BVHQuantized::build(const BVH4& bvh)
+{
+	m_nodes.resize(bvh.m_nodes.size());
+	m_triangles = bvh.m_triangles;
+	m_maxDepth = bvh.m_maxDepth;
+
+	for (u32 i = 0; i < (u32)bvh.m_nodes.size(); ++i)
+	{
+		const BVH4::Node& node = bvh.m_nodes[i];
+		BVHQuantizedNode& quantizedNode = m_nodes[i];
+
+		Box3 bounds;
+		bounds.expandInit();
+
+		for (u32 j = 0; j < 4; ++j)
+		{
+			if (node.children[j] != BVHNode::InvalidMask)
+			{
+				bounds.expand(Vec3(node.bboxMinX[j], node.bboxMinY[j], node.bboxMinZ[j]));
+				bounds.expand(Vec3(node.bboxMaxX[j], node.bboxMaxY[j], node.bboxMaxZ[j]));
+			}
+		}
+
+		quantizedNode = BVHQuantizedNode();
+		quantizedNode.origin = bounds.m_min;
+
+		Vec3 scale;
+		for (u32 axis = 0; axis < 3; ++axis)
+		{
+			quantizedNode.exponents[axis] = (u8)findQuantizationExponent(bounds.m_min[axis], bounds.m_max[axis]);
+			scale[axis] = exponentToScale(quantizedNode.exponents[axis]);
+		}
+
+		for (u32 j = 0; j < 4; ++j)
+		{
+			quantizedNode.children[j] = node.children[j];
+
+			if (node.children[j] == BVHNode::InvalidMask)
+			{
+				continue;
+			}
+
+			quantizedNode.bboxMinX[j] = quantizeMin(node.bboxMinX[j], bounds.m_min.x, scale.x);
+			quantizedNode.bboxMinY[j] = quantizeMin(node.bboxMinY[j], bounds.m_min.y, scale.y);
+			quantizedNode.bboxMinZ[j] = quantizeMin(node.bboxMinZ[j], bounds.m_min.z, scale.z);
+			quantizedNode.bboxMaxX[j] = quantizeMax(node.bboxMaxX[j], bounds.m_min.x, scale.x);
+			quantizedNode.bboxMaxY[j] = quantizeMax(node.bboxMaxY[j], bounds.m_min.y, scale.y);
+			quantizedNode.bboxMaxZ[j] = quantizeMax(node.bboxMaxZ[j], bounds.m_min.z, scale.z);
+		}
+	}
+
+	packNodes<BVHQuantizedNode, 4>(m_nodes, m_triangles, m_packedNodes);
+}
+
+bool BVHQuantized::intersectAny(const Vec3& origin, const Vec3& direction, float maxT) const
+{
+	return !m_nodes.empty() && intersectAnyQuantized(*this, origin, direction, maxT);
+}
+
+template struct BVHWide<4>;
+template struct BVHWide<8>;
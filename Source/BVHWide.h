@@ -0,0 +1,104 @@
+#pragma once
+
+#include "BVHBuilder.h"
+
+// Node of a BVH with up to Width children.
+// Child bounds are stored as structure of arrays, so that a ray can be tested against all children at once using SIMD.
+template <u32 Width>
+struct BVHWideNode
+{
+	float bboxMinX[Width];
+	float bboxMinY[Width];
+	float bboxMinZ[Width];
+	float bboxMaxX[Width];
+	float bboxMaxY[Width];
+	float bboxMaxZ[Width];
+
+	// Wide node index for internal children, LeafMask | first triangle index for leaves, InvalidMask for empty slots
+	u32 children[Width];
+};
+
+// Triangles of a leaf are stored contiguously. The last triangle of each leaf is marked by a non-zero last field.
+struct BVHWideTriangle
+{
+	Vec3 v0;
+	u32 prim;
+	Vec3 edge0;
+	u32 last;
+	Vec3 edge1;
+	u32 padding;
+};
+
+template <u32 Width>
+struct BVHWide
+{
+	static_assert(Width == 4 || Width == 8, "Only 4-wide and 8-wide BVH is supported");
+
+	typedef BVHWideNode<Width> Node;
+
+	std::vector<Node> m_nodes;
+	std::vector<BVHWideTriangle> m_triangles;
+
+	// Same layout as m_nodes, followed by m_triangles, in vec4 units. Used to report the memory size, since
+	// no shader traverses this format. Leaf children point to the first vec4 of the triangle record.
+	std::vector<BVHPackedNode> m_packedNodes;
+
+	u32 m_maxDepth = 0; // Used to size the traversal stack
+
+	// Collapses a binary BVH. Internal nodes of the binary tree with largest surface area are expanded first
+	// until the wide node is full or only leaves remain.
+	void build(const BVHBuilder& bvh, const float* vertices, u32 stride, const u32* indices);
+
+	// Any-hit shadow ray query. Returns true if any triangle is hit between the ray origin and maxT.
+	bool intersectAny(const Vec3& origin, const Vec3& direction, float maxT) const;
+};
+
+typedef BVHWide<4> BVH4;
+typedef BVHWide<8> BVH8;
+
+// 4-wide node with child bounds quantized to 8 bits relative to the node bounds.
+// Decoded child bounds are origin + q * 2^(exponent - 127) and are rounded outwards, so they always contain
+// the original bounds. Node is 64 bytes, compared to 112 bytes of BVHWideNode<4>.
+struct BVHQuantizedNode
+{
+	Vec3 origin;
+	u8 exponents[3]; // Biased by 127, same as exponent of a float
+	u8 padding0;
+
+	u8 bboxMinX[4];
+	u8 bboxMinY[4];
+	u8 bboxMinZ[4];
+	u8 bboxMaxX[4];
+	u8 bboxMaxY[4];
+	u8 bboxMaxZ[4];
+
+	// Same as BVHWideNode::children
+	u32 children[4];
+
+	u32 padding1[2];
+};
+
+struct BVHQuantized
+{
+	std::vector<BVHQuantizedNode> m_nodes;
+	std::vector<BVHWideTriangle> m_triangles;
+
+	// GPU buffer with the same layout as m_nodes, followed by m_triangles.
+	// Leaf children point to the first vec4 of the triangle record instead of the triangle index.
+	std::vector<BVHPackedNode> m_packedNodes;
+
+	u32 m_maxDepth = 0; // Used to size the traversal stack
+
+	// Quantizes child bounds of a 4-wide BVH. Topology and triangles are the same.
+	void build(const BVH4& bvh);
+
+	// Any-hit shadow ray query. Returns true if any triangle is hit between the ray origin and maxT.
+	bool intersectAny(const Vec3& origin, const Vec3& direction, float maxT) const;
+};
+
+// Children are tested with SSE in 4-wide nodes and with AVX in 8-wide nodes when supported by the CPU
+template <> bool BVHWide<4>::intersectAny(const Vec3& origin, const Vec3& direction, float maxT) const;
+template <> bool BVHWide<8>::intersectAny(const Vec3& origin, const Vec3& direction, float maxT) const;
+
+extern template struct BVHWide<4>;
+extern template struct BVHWide<8>;
@@ -4,10 +4,22 @@
 #include "VkRaytracing.h"
 #endif // USE_VK_RAYTRACING
 
+#include "BVHCache.h"
+#include "BVHInstanced.h"
+#include "BVHStats.h"
+#include "BVHStreamBuilder.h"
+#include "BVHWide.h"
+#include "TaskScheduler.h"
+
 #include <Rush/UtilFile.h>
 #include <Rush/UtilLog.h>
 #include <Rush/MathTypes.h>
 
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
@@ -73,6 +85,8 @@ RayTracedShadowsApp::RayTracedShadowsApp()
 	Gfx_SetPresentInterval(m_presentInterval);
 
 #if USE_VK_RAYTRACING
+	m_maxStorageBufferSize = VkRaytracing::getMaxStorageBufferRange();
+
 	const GfxCapability& caps = Gfx_GetCapability();
 	if (caps.rayTracing)
 	{
@@ -153,7 +167,22 @@ RayTracedShadowsApp::RayTracedShadowsApp()
 		bindings.descriptorSets[0].textures = 1;
 		bindings.descriptorSets[0].rwImages = 1;
 		bindings.descriptorSets[0].rwBuffers = 1;
+
+		GfxOwn<GfxComputeShader> csQuantized;
+		csQuantized = Gfx_CreateComputeShader(shaderFromFile(MAKE_SHADER_NAME("Shaders/RayTracedShadowsQuantized.comp")));
+		m_techniqueRayTracedShadowsQuantized = Gfx_CreateTechnique(GfxTechniqueDesc(csQuantized.get(), bindings, {8, 8, 1}));
+
+		GfxOwn<GfxComputeShader> csInstanced;
+		csInstanced = Gfx_CreateComputeShader(shaderFromFile(MAKE_SHADER_NAME("Shaders/RayTracedShadowsInstanced.comp")));
+		m_techniqueRayTracedShadowsInstanced = Gfx_CreateTechnique(GfxTechniqueDesc(csInstanced.get(), bindings, {8, 8, 1}));
+
+		// Nodes and triangle data are bound separately, so that octant ordered node buffers can share triangle data
+		bindings.descriptorSets[0].rwBuffers = 2;
 		m_techniqueRayTracedShadows = Gfx_CreateTechnique(GfxTechniqueDesc(cs.get(), bindings, {8, 8, 1}));
+
+		GfxOwn<GfxComputeShader> csIndexed;
+		csIndexed = Gfx_CreateComputeShader(shaderFromFile(MAKE_SHADER_NAME("Shaders/RayTracedShadowsIndexed.comp")));
+		m_techniqueRayTracedShadowsIndexed = Gfx_CreateTechnique(GfxTechniqueDesc(csIndexed.get(), bindings, {8, 8, 1}));
 	}
 
 	{
@@ -209,9 +238,11 @@ RayTracedShadowsApp::RayTracedShadowsApp()
 		m_rayTracingConstantBuffer= Gfx_CreateBuffer(cbDesc);
 	}
 
-	if (g_appConfig.argc >= 2)
+	parseCommandLine(g_appConfig.argc, g_appConfig.argv);
+
+	if (m_modelFilename)
 	{
-		const char* modelFilename = g_appConfig.argv[1];
+		const char* modelFilename = m_modelFilename;
 		m_statusString = std::string("Model: ") + modelFilename;
 		m_valid = loadModel(modelFilename);
 
@@ -232,7 +263,7 @@ RayTracedShadowsApp::RayTracedShadowsApp()
 	}
 	else
 	{
-		m_statusString = "Usage: RayTracedShadows <filename.obj>";
+		m_statusString = "Usage: RayTracedShadows [--bvh-method=topdown|linear|hlbvh|ploc|sbvh] [--bvh-morton-bits=30|63] [--bvh-cluster-bits=N] [--bvh-ploc-radius=N] [--bvh-split-budget=F] [--bvh-split=sweep|binned|presorted] [--bvh-bins=N] [--bvh-threads=N] [--bvh-presplit=F] [--bvh-treelet-passes=N] [--bvh-leaf-size=N] [--bvh-traversal-cost=F] [--bvh-intersection-cost=F] [--bvh-width=4|8] [--bvh-quantized] [--bvh-indexed] [--bvh-layout=depthfirst|treelet] [--bvh-layout-treelet-size=N] [--bvh-octant-order] [--instances=N] [--bvh-no-cache] [--bvh-streaming] [--bvh-stats] [--bvh-stats-json=FILE] <filename.obj>";
 	}
 
 	float aspect = m_window->getAspect();
@@ -408,6 +439,172 @@ const char* toString(ShadowRenderMode mode)
 	}
 }
 
+const char* toString(BVHBuildMethod method)
+{
+	switch (method)
+	{
+	case BVHBuildMethod::TopDown: return "TopDown";
+	case BVHBuildMethod::Linear: return "Linear";
+	case BVHBuildMethod::HierarchicalLinear: return "HierarchicalLinear";
+	case BVHBuildMethod::Ploc: return "PLOC";
+	case BVHBuildMethod::SpatialSplit: return "SpatialSplit";
+	default:
+		RUSH_BREAK;
+		return "unknown";
+	}
+}
+
+const char* toString(BVHNodeLayout layout)
+{
+	switch (layout)
+	{
+	case BVHNodeLayout::DepthFirst: return "DepthFirst";
+	case BVHNodeLayout::Treelet: return "Treelet";
+	default:
+		RUSH_BREAK;
+		return "unknown";
+	}
+}
+
+// Shadow rays from random points inside the bounding box in random directions
+template <typename BVHType>
+double measureShadowRayThroughput(const BVHType& bvh, const Box3& bounds)
+{
+	const u32 rayCount = 100000;
+
+	u32 seed = 1;
+	auto random = [&seed]()
+	{
+		seed = seed * 1664525u + 1013904223u;
+		return float(seed >> 8) / float(1 << 24);
+	};
+
+	std::vector<Vec3> origins(rayCount);
+	std::vector<Vec3> directions(rayCount);
+
+	const Vec3 dimensions = bounds.dimensions();
+	for (u32 i = 0; i < rayCount; ++i)
+	{
+		origins[i] = bounds.m_min + Vec3(random(), random(), random()) * dimensions;
+		directions[i] = normalize(Vec3(random(), random(), random()) * 2.0f - Vec3(1.0f));
+	}
+
+	Timer timer;
+
+	for (u32 i = 0; i < rayCount; ++i)
+	{
+		bvh.intersectAny(origins[i], directions[i], FLT_MAX);
+	}
+
+	return rayCount / timer.time();
+}
+
+// Stackless traversal of the binary nodes on the CPU, used as a baseline for wide BVH throughput.
+// Reads triangles from the source mesh, so it works with any packed triangle format.
+struct BinaryBVHTraversal
+{
+	const BVHBuilder& bvh;
+	const float* vertices;
+	u32 stride;
+	const u32* indices;
+
+	Vec3 getVertex(u32 prim, u32 corner) const
+	{
+		return Vec3(vertices + stride * indices[prim * 3 + corner]);
+	}
+
+	bool intersectTriangle(u32 prim, const Vec3& origin, const Vec3& direction, float maxT) const
+	{
+		const Vec3 v0 = getVertex(prim, 0);
+		const Vec3 edge0 = getVertex(prim, 1) - v0;
+		const Vec3 edge1 = getVertex(prim, 2) - v0;
+
+		const Vec3 s1 = cross(direction, edge1);
+		const float invd = 1.0f / dot(s1, edge0);
+		const Vec3 d = origin - v0;
+		const float b1 = dot(d, s1) * invd;
+		const Vec3 s2 = cross(d, edge0);
+		const float b2 = dot(direction, s2) * invd;
+		const float t = dot(edge1, s2) * invd;
+
+		return !(b1 < 0.0f || b1 > 1.0f || b2 < 0.0f || b1 + b2 > 1.0f || t < 0.0f || t > maxT);
+	}
+
+	bool intersectAny(const Vec3& origin, const Vec3& direction, float maxT) const
+	{
+		const Vec3 invDir = Vec3(1.0f) / direction;
+
+		u32 nodeIndex = bvh.m_nodes.empty() ? BVHNode::InvalidMask : 0;
+
+		while (nodeIndex != BVHNode::InvalidMask)
+		{
+			const BVHNode& node = bvh.m_nodes[nodeIndex];
+
+			const Vec3 t0 = (node.bboxMin - origin) * invDir;
+			const Vec3 t1 = (node.bboxMax - origin) * invDir;
+			const float tNear = max(max(min(t0.x, t1.x), min(t0.y, t1.y)), max(min(t0.z, t1.z), 0.0f));
+			const float tFar = min(min(max(t0.x, t1.x), max(t0.y, t1.y)), min(max(t0.z, t1.z), maxT));
+
+			if (tNear <= tFar)
+			{
+				if (!node.isLeaf())
+				{
+					++nodeIndex;
+					continue;
+				}
+
+				if (node.prim & BVHNode::LeafMask)
+				{
+					for (u32 i = node.prim & ~BVHNode::LeafMask; ; ++i)
+					{
+						const u32 prim = bvh.m_leafPrims[i];
+						if (intersectTriangle(prim & ~BVHNode::LeafMask, origin, direction, maxT))
+						{
+							return true;
+						}
+
+						if (prim & BVHNode::LeafMask)
+						{
+							break;
+						}
+					}
+				}
+				else if (intersectTriangle(node.prim, origin, direction, maxT))
+				{
+					return true;
+				}
+			}
+
+			nodeIndex = node.next;
+		}
+
+		return false;
+	}
+};
+
+template <u32 Width>
+void logWideBVHStats(const BVHBuilder& bvhBuilder, const float* vertices, u32 stride, const u32* indices,
+	const Box3& bounds)
+{
+	Timer timer;
+
+	BVHWide<Width> wideBVH;
+	wideBVH.build(bvhBuilder, vertices, stride, indices);
+
+	Log::message("Wide BVH collapsed in %f sec. (nodes: %d, size: %d KB, max depth: %d)",
+		timer.time(),
+		(int)wideBVH.m_nodes.size(),
+		(int)(wideBVH.m_packedNodes.size() * sizeof(BVHPackedNode) / 1024),
+		(int)wideBVH.m_maxDepth);
+
+	const BinaryBVHTraversal binaryBVH = { bvhBuilder, vertices, stride, indices };
+
+	Log::message("CPU shadow rays: %.2f MRays / sec (binary BVH), %.2f MRays / sec (BVH%d)",
+		measureShadowRayThroughput(binaryBVH, bounds) / 1000000.0,
+		measureShadowRayThroughput(wideBVH, bounds) / 1000000.0,
+		(int)Width);
+}
+
 void RayTracedShadowsApp::render()
 {
 #if USE_VK_RAYTRACING
@@ -485,6 +682,8 @@ void RayTracedShadowsApp::render()
 			"Draw calls: %d\n"
 			"Vertices: %d\n"
 			"Mode: %s\n"
+			"BVH: %s\n"
+			"BVH layout: %s\n"
 			"GPU shadows: %.2f ms\n"
 			"MRays / sec: %.4f\n"
 			"GPU total: %.2f ms\n"
@@ -495,6 +694,8 @@ void RayTracedShadowsApp::render()
 			stats.drawCalls,
 			stats.vertices,
 			toString(m_mode),
+			m_bvhQuantized ? "Quantized BVH4" : (m_bvhSettings.triangleFormat == BVHTriangleFormat::Indexed ? "Binary, indexed" : (m_bvhInstanced ? "Binary, two-level" : "Binary")),
+			m_bvhQuantized ? "N/A" : (!m_bvhOctantBuffers.empty() ? "Light octant order" : toString(m_bvhSettings.nodeLayout)),
 			m_stats.gpuShadows.get() * 1000.0f,
 			raysPerSecond / 1000000.0,
 			m_stats.gpuTotal.get() * 1000.0f,
@@ -528,8 +729,6 @@ void RayTracedShadowsApp::renderGbuffer()
 	constants.matWorld = m_worldTransform.transposed();
 	constants.cameraPosition = Vec4(m_interpolatedCamera.getPosition(), 0.0f);
 
-	Gfx_UpdateBuffer(m_ctx, m_modelGlobalConstantBuffer, &constants, sizeof(constants));
-
 	Gfx_SetViewport(m_ctx, GfxViewport(m_window->getSize()));
 	Gfx_SetScissorRect(m_ctx, m_window->getSize());
 
@@ -544,22 +743,28 @@ void RayTracedShadowsApp::renderGbuffer()
 		Gfx_SetTechnique(m_ctx, m_techniqueModel);
 		Gfx_SetVertexStream(m_ctx, 0, m_vertexBuffer);
 		Gfx_SetIndexStream(m_ctx, m_indexBuffer);
-		Gfx_SetConstantBuffer(m_ctx, 0, m_modelGlobalConstantBuffer);
 
-		for (const MeshSegment& segment : m_segments)
+		for (const Mat4& instanceTransform : m_instanceTransforms)
 		{
-			GfxTexture texture = m_defaultWhiteTexture.get();
+			constants.matWorld = (instanceTransform * m_worldTransform).transposed();
+			Gfx_UpdateBuffer(m_ctx, m_modelGlobalConstantBuffer, &constants, sizeof(constants));
+			Gfx_SetConstantBuffer(m_ctx, 0, m_modelGlobalConstantBuffer);
 
-			const Material& material = (segment.material == 0xFFFFFFFF) ? m_defaultMaterial : m_materials[segment.material];
-			if (material.albedoTexture.valid())
+			for (const MeshSegment& segment : m_segments)
 			{
-				texture = material.albedoTexture.get();
-			}
-			Gfx_SetConstantBuffer(m_ctx, 1, material.constantBuffer);
+				GfxTexture texture = m_defaultWhiteTexture.get();
+
+				const Material& material = (segment.material == 0xFFFFFFFF) ? m_defaultMaterial : m_materials[segment.material];
+				if (material.albedoTexture.valid())
+				{
+					texture = material.albedoTexture.get();
+				}
+				Gfx_SetConstantBuffer(m_ctx, 1, material.constantBuffer);
 
-			Gfx_SetSampler(m_ctx, 0, m_samplerStates.anisotropicWrap);
-			Gfx_SetTexture(m_ctx, 0, texture);
-			Gfx_DrawIndexed(m_ctx, segment.indexCount, segment.indexOffset, 0, m_vertexCount);
+				Gfx_SetSampler(m_ctx, 0, m_samplerStates.anisotropicWrap);
+				Gfx_SetTexture(m_ctx, 0, texture);
+				Gfx_DrawIndexed(m_ctx, segment.indexCount, segment.indexOffset, 0, m_vertexCount);
+			}
 		}
 	}
 
@@ -584,13 +789,60 @@ void RayTracedShadowsApp::renderShadowMaskCompute()
 	Gfx_SetSampler(m_ctx, 0, m_samplerStates.pointClamp);
 	Gfx_SetTexture(m_ctx, 0, m_gbufferPosition);
 	Gfx_SetStorageImage(m_ctx, 0, m_shadowMask);
-	Gfx_SetStorageBuffer(m_ctx, 0, m_bvhBuffer);
-	Gfx_SetTechnique(m_ctx, m_techniqueRayTracedShadows);
+
+	if (!m_bvhOctantBuffers.empty())
+	{
+		const Vec3 lightDirection = m_lightCamera.getForward();
+		const u32 octant = (lightDirection.x < 0.0f ? 1 : 0) | (lightDirection.y < 0.0f ? 2 : 0) | (lightDirection.z < 0.0f ? 4 : 0);
+		Gfx_SetStorageBuffer(m_ctx, 0, m_bvhOctantBuffers[octant]);
+	}
+	else
+	{
+		Gfx_SetStorageBuffer(m_ctx, 0, m_bvhBuffer);
+	}
+
+	if (!m_bvhQuantized && !m_bvhInstanced)
+	{
+		Gfx_SetStorageBuffer(m_ctx, 1, m_bvhBuffer);
+	}
+
+	if (m_bvhQuantized)
+	{
+		Gfx_SetTechnique(m_ctx, m_techniqueRayTracedShadowsQuantized);
+	}
+	else if (m_bvhSettings.triangleFormat == BVHTriangleFormat::Indexed)
+	{
+		Gfx_SetTechnique(m_ctx, m_techniqueRayTracedShadowsIndexed);
+	}
+	else if (m_bvhInstanced)
+	{
+		Gfx_SetTechnique(m_ctx, m_techniqueRayTracedShadowsInstanced);
+	}
+	else
+	{
+		Gfx_SetTechnique(m_ctx, m_techniqueRayTracedShadows);
+	}
 
 	u32 w = divUp(desc.width, 8);
 	u32 h = divUp(desc.height, 8);
 	Gfx_Dispatch(m_ctx, w, h, 1);
 
+	// Remaining BVH segments only trace pixels that are not shadowed by previous ones
+	if (!m_bvhSegmentBuffers.empty())
+	{
+		constants.cameraPosition.w = 1.0f;
+		Gfx_UpdateBufferT(m_ctx, m_rayTracingConstantBuffer, constants);
+		Gfx_SetConstantBuffer(m_ctx, 0, m_rayTracingConstantBuffer);
+
+		for (const GfxOwn<GfxBuffer>& segmentBuffer : m_bvhSegmentBuffers)
+		{
+			Gfx_AddFullPipelineBarrier(m_ctx);
+			Gfx_SetStorageBuffer(m_ctx, 0, segmentBuffer);
+			Gfx_SetStorageBuffer(m_ctx, 1, segmentBuffer);
+			Gfx_Dispatch(m_ctx, w, h, 1);
+		}
+	}
+
 	Gfx_EndTimer(m_ctx, Timestamp_Shadows);
 }
 
@@ -652,6 +904,152 @@ void RayTracedShadowsApp::renderShadowMaskHardwareInline()
 #endif // USE_VK_RAYTRACING
 }
 
+void RayTracedShadowsApp::parseCommandLine(int argc, char** argv)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		const char* arg = argv[i];
+
+		if (strncmp(arg, "--", 2) != 0)
+		{
+			m_modelFilename = arg;
+		}
+		else if (!strcmp(arg, "--bvh-method=topdown"))
+		{
+			m_bvhSettings.method = BVHBuildMethod::TopDown;
+		}
+		else if (!strcmp(arg, "--bvh-method=linear"))
+		{
+			m_bvhSettings.method = BVHBuildMethod::Linear;
+		}
+		else if (!strcmp(arg, "--bvh-method=hlbvh"))
+		{
+			m_bvhSettings.method = BVHBuildMethod::HierarchicalLinear;
+		}
+		else if (!strcmp(arg, "--bvh-method=ploc"))
+		{
+			m_bvhSettings.method = BVHBuildMethod::Ploc;
+		}
+		else if (!strncmp(arg, "--bvh-ploc-radius=", 18))
+		{
+			m_bvhSettings.plocRadius = (u32)atoi(arg + 18);
+		}
+		else if (!strcmp(arg, "--bvh-method=sbvh"))
+		{
+			m_bvhSettings.method = BVHBuildMethod::SpatialSplit;
+		}
+		else if (!strncmp(arg, "--bvh-split-budget=", 19))
+		{
+			m_bvhSettings.spatialSplitBudget = (float)atof(arg + 19);
+		}
+		else if (!strcmp(arg, "--bvh-quantized"))
+		{
+			m_bvhQuantized = true;
+		}
+		else if (!strcmp(arg, "--bvh-indexed"))
+		{
+			m_bvhSettings.triangleFormat = BVHTriangleFormat::Indexed;
+		}
+		else if (!strcmp(arg, "--bvh-layout=depthfirst"))
+		{
+			m_bvhSettings.nodeLayout = BVHNodeLayout::DepthFirst;
+		}
+		else if (!strcmp(arg, "--bvh-layout=treelet"))
+		{
+			m_bvhSettings.nodeLayout = BVHNodeLayout::Treelet;
+		}
+		else if (!strncmp(arg, "--bvh-layout-treelet-size=", 26))
+		{
+			m_bvhSettings.layoutTreeletSize = (u32)atoi(arg + 26);
+		}
+		else if (!strcmp(arg, "--bvh-octant-order"))
+		{
+			m_bvhOctantOrder = true;
+		}
+		else if (!strncmp(arg, "--instances=", 12))
+		{
+			m_instanceCount = max<u32>(1, (u32)atoi(arg + 12));
+		}
+		else if (!strcmp(arg, "--bvh-no-cache"))
+		{
+			m_bvhCacheEnabled = false;
+		}
+		else if (!strcmp(arg, "--bvh-streaming"))
+		{
+			m_bvhStreaming = true;
+		}
+		else if (!strcmp(arg, "--bvh-stats"))
+		{
+			m_bvhStatsEnabled = true;
+		}
+		else if (!strncmp(arg, "--bvh-stats-json=", 17))
+		{
+			m_bvhStatsEnabled = true;
+			m_bvhStatsFilename = arg + 17;
+		}
+		else if (!strcmp(arg, "--bvh-width=4"))
+		{
+			m_bvhWidth = 4;
+		}
+		else if (!strcmp(arg, "--bvh-width=8"))
+		{
+			m_bvhWidth = 8;
+		}
+		else if (!strncmp(arg, "--bvh-leaf-size=", 16))
+		{
+			m_bvhSettings.maxLeafSize = (u32)atoi(arg + 16);
+		}
+		else if (!strncmp(arg, "--bvh-traversal-cost=", 21))
+		{
+			m_bvhSettings.traversalCost = (float)atof(arg + 21);
+		}
+		else if (!strncmp(arg, "--bvh-intersection-cost=", 24))
+		{
+			m_bvhSettings.intersectionCost = (float)atof(arg + 24);
+		}
+		else if (!strncmp(arg, "--bvh-treelet-passes=", 21))
+		{
+			m_bvhSettings.treeletPasses = (u32)atoi(arg + 21);
+		}
+		else if (!strncmp(arg, "--bvh-presplit=", 15))
+		{
+			m_bvhSettings.presplitBudget = (float)atof(arg + 15);
+		}
+		else if (!strncmp(arg, "--bvh-cluster-bits=", 19))
+		{
+			m_bvhSettings.clusterBits = (u32)atoi(arg + 19);
+		}
+		else if (!strncmp(arg, "--bvh-morton-bits=", 18))
+		{
+			m_bvhSettings.mortonCodeBits = (u32)atoi(arg + 18);
+		}
+		else if (!strcmp(arg, "--bvh-split=sweep"))
+		{
+			m_bvhSettings.splitMode = BVHSplitMode::Sweep;
+		}
+		else if (!strcmp(arg, "--bvh-split=binned"))
+		{
+			m_bvhSettings.splitMode = BVHSplitMode::Binned;
+		}
+		else if (!strcmp(arg, "--bvh-split=presorted"))
+		{
+			m_bvhSettings.splitMode = BVHSplitMode::PresortedSweep;
+		}
+		else if (!strncmp(arg, "--bvh-bins=", 11))
+		{
+			m_bvhSettings.binCount = (u32)atoi(arg + 11);
+		}
+		else if (!strncmp(arg, "--bvh-threads=", 14))
+		{
+			m_bvhSettings.threadCount = (u32)atoi(arg + 14);
+		}
+		else
+		{
+			Log::warning("Unknown command line option '%s'", arg);
+		}
+	}
+}
+
 static std::string directoryFromFilename(const std::string& filename)
 {
 	size_t pos = filename.find_last_of("/\\");
@@ -1005,6 +1403,14 @@ bool RayTracedShadowsApp::loadModel(const char* filename)
 
 	const double timeObjParseEnd = m_timer.time();
 
+	// Vertex and index counts are 32 bit in GPU buffers and draw calls, which also bounds the triangle count of the BVH
+	if (vertices.size() > 0xFFFFFFFF || indices.size() > 0xFFFFFFFF)
+	{
+		Log::error("Could not load model from '%s' (%llu vertices, %llu indices exceed 32 bit counts)",
+			filename, (unsigned long long)vertices.size(), (unsigned long long)indices.size());
+		return false;
+	}
+
 	m_vertexCount = (u32)vertices.size();
 	m_indexCount = (u32)indices.size();
 
@@ -1024,24 +1430,315 @@ bool RayTracedShadowsApp::loadModel(const char* filename)
 	GfxBufferDesc ibDesc(GfxBufferFlags::Index, GfxFormat_R32_Uint, m_indexCount, 4);
 	m_indexBuffer = Gfx_CreateBuffer(ibDesc, indices.data());
 
+	// Copies are rotated by multiples of 90 degrees around the model center, so that instances differ by more than
+	// a translation. First instance is not transformed.
+	m_instanceTransforms.assign(m_instanceCount, Mat4::identity());
+	{
+		const Vec3 center = m_boundingBox.center();
+		const Vec3 dimensions = m_boundingBox.dimensions();
+		const float spacing = max(max(dimensions.x, dimensions.z) * 1.25f, 1.0f);
+		const u32 columnCount = (u32)ceilf(sqrtf((float)m_instanceCount));
+
+		static const float cosTable[4] = { 1.0f, 0.0f, -1.0f, 0.0f };
+		static const float sinTable[4] = { 0.0f, 1.0f, 0.0f, -1.0f };
+
+		Box3 instanceBounds;
+		instanceBounds.expandInit();
+
+		for (u32 i = 0; i < m_instanceCount; ++i)
+		{
+			const float c = cosTable[i % 4];
+			const float s = sinTable[i % 4];
+			const Vec3 offset = Vec3(float(i % columnCount), 0.0f, float(i / columnCount)) * spacing;
+			const Vec3 rotatedCenter(center.x * c + center.z * s, center.y, center.z * c - center.x * s);
+
+			Mat4& transform = m_instanceTransforms[i];
+			transform.rows[0] = Vec4(c, 0.0f, -s, 0.0f);
+			transform.rows[2] = Vec4(s, 0.0f, c, 0.0f);
+			transform.rows[3] = Vec4(center - rotatedCenter + offset, 1.0f);
+
+			for (u32 j = 0; j < 8; ++j)
+			{
+				const Vec3 corner(
+					(j & 1) ? m_boundingBox.m_max.x : m_boundingBox.m_min.x,
+					(j & 2) ? m_boundingBox.m_max.y : m_boundingBox.m_min.y,
+					(j & 4) ? m_boundingBox.m_max.z : m_boundingBox.m_min.z);
+				instanceBounds.expand(transform * corner);
+			}
+		}
+
+		m_boundingBox = instanceBounds;
+	}
+
+	if (m_instanceCount > 1 && (m_bvhQuantized || m_bvhOctantOrder || m_bvhSettings.triangleFormat == BVHTriangleFormat::Indexed))
+	{
+		Log::warning("Instancing requires binary BVH with edge triangle format, ignoring --bvh-quantized, --bvh-octant-order and --bvh-indexed");
+		m_bvhQuantized = false;
+		m_bvhOctantOrder = false;
+		m_bvhSettings.triangleFormat = BVHTriangleFormat::Edges;
+	}
+
+	if (m_bvhStreaming && m_bvhSettings.triangleFormat == BVHTriangleFormat::Indexed)
+	{
+		Log::warning("Streaming BVH build only supports edge triangle format, ignoring --bvh-indexed");
+		m_bvhSettings.triangleFormat = BVHTriangleFormat::Edges;
+	}
+
 	const double timeBufferCreateEnd = m_timer.time();
 
 	Log::message("Building BVH ...");
 
+	m_bvhSegmentBuffers.clear();
+
+	// Index count was validated above, so the triangle count fits in 32 bits
+	const u32 primCount = u32(indices.size() / 3);
+
+	if (primCount > getMaxBVHPrimCount())
 	{
+		buildBVHSegments(filename, reinterpret_cast<float*>(vertices.data()), sizeof(Vertex) / sizeof(float),
+			(u32)vertices.size(), indices.data(), primCount);
+	}
+	else
+	{
+		const float* vertexData = reinterpret_cast<float*>(vertices.data());
+		const u32 vertexStride = sizeof(Vertex) / sizeof(float);
+
 		BVHBuilder bvhBuilder;
-		bvhBuilder.build(
-			reinterpret_cast<float*>(vertices.data()),
-			sizeof(Vertex) / sizeof(float),
-			indices.data(),
-			(u32)indices.size() / 3);
+		BVHCache bvhCache;
+
+		const std::string cacheFilename = std::string(filename) + ".bvhcache";
+		const u64 cacheKey = m_bvhCacheEnabled || m_bvhStreaming
+			? BVHCache::calculateKey(vertexData, vertexStride, (u32)vertices.size(), indices.data(), primCount, m_bvhSettings)
+			: 0;
+
+		// Streaming builds always write a file, which is temporary when the cache is disabled
+		const std::string streamFilename = m_bvhCacheEnabled ? cacheFilename : cacheFilename + ".tmp";
+		const u64 streamKey = BVHCache::calculateStreamedKey(cacheKey);
+
+		bool cacheHit = m_bvhCacheEnabled && bvhCache.open(cacheFilename.c_str(), m_bvhStreaming ? streamKey : cacheKey);
+
+		if (cacheHit)
+		{
+			Log::message("BVH loaded from cache '%s' in %f sec. (nodes: %d, size: %d KB)",
+				cacheFilename.c_str(),
+				m_timer.time() - timeBufferCreateEnd,
+				(int)bvhCache.getNodeCount(),
+				(int)(bvhCache.getPackedNodeCount() * sizeof(BVHPackedNode) / 1024));
+		}
+		else if (m_bvhStreaming)
+		{
+			// Only one bucket of the BVH is built in memory at a time, the result is used from the cache file.
+			// Triangles come from the mesh loaded for rasterization, so peak memory still includes the whole mesh.
+			BVHMeshTriangleStream stream(vertexData, vertexStride, indices.data(), primCount);
+			BVHStreamBuilder streamBuilder;
+
+			if (streamBuilder.build(stream, streamFilename.c_str(), streamKey, m_bvhSettings)
+				&& bvhCache.open(streamFilename.c_str(), streamKey))
+			{
+				Log::message("BVH constructed out of core in %f sec. (buckets: %d, largest bucket: %d triangles, nodes: %d, size: %d KB)",
+					m_timer.time() - timeBufferCreateEnd,
+					(int)streamBuilder.m_bucketCount,
+					(int)streamBuilder.m_maxBucketPrimCount,
+					(int)bvhCache.getNodeCount(),
+					(int)(bvhCache.getPackedNodeCount() * sizeof(BVHPackedNode) / 1024));
+
+				cacheHit = true;
+			}
+			else
+			{
+				Log::warning("Streaming BVH build into '%s' failed, building in memory", streamFilename.c_str());
+			}
+		}
+
+		if (cacheHit)
+		{
+			// Binary BVH is uploaded directly from the mapped file, builder data is only needed for statistics,
+			// node reordering or to collapse it into a wide BVH
+			if (m_bvhStatsEnabled || m_bvhOctantOrder || m_bvhWidth != 2 || m_bvhQuantized)
+			{
+				bvhCache.load(bvhBuilder);
+			}
+		}
+		else
+		{
+			bvhBuilder.build(vertexData, vertexStride, indices.data(), primCount, m_bvhSettings);
+
+			const double timeBVHConstructionEnd = m_timer.time();
+
+			Log::message("BVH constructed in %f sec. (method: %s, layout: %s, SAH cost: %f)",
+				timeBVHConstructionEnd - timeBufferCreateEnd,
+				toString(m_bvhSettings.method),
+				toString(m_bvhSettings.nodeLayout),
+				bvhBuilder.calculateSahCost(m_bvhSettings.traversalCost, m_bvhSettings.intersectionCost));
+
+			Log::message("BVH nodes: %d, size: %d KB",
+				(int)bvhBuilder.m_nodes.size(),
+				(int)(bvhBuilder.m_packedNodes.size() * sizeof(BVHPackedNode) / 1024));
+
+			if (m_bvhSettings.triangleFormat == BVHTriangleFormat::Indexed)
+			{
+				Log::message("BVH unique vertex positions: %d (%d triangles)",
+					(int)bvhBuilder.m_positionVertices.size(),
+					(int)primCount);
+			}
+
+			if (m_bvhSettings.treeletPasses != 0)
+			{
+				Log::message("BVH SAH cost before treelet optimization: %f", bvhBuilder.m_unoptimizedSahCost);
+			}
+
+			if (m_bvhCacheEnabled && !BVHCache::write(cacheFilename.c_str(), cacheKey, bvhBuilder))
+			{
+				Log::warning("Failed to write BVH cache '%s'", cacheFilename.c_str());
+			}
+		}
+
+		if (m_bvhStatsEnabled)
+		{
+			TaskScheduler scheduler(m_bvhSettings.threadCount);
+
+			BVHStats stats;
+			stats.calculate(bvhBuilder, vertexData, vertexStride, indices.data(),
+				m_bvhSettings.traversalCost, m_bvhSettings.intersectionCost, &scheduler);
+			stats.log();
+
+			if (m_bvhStatsFilename && !stats.writeJson(m_bvhStatsFilename))
+			{
+				Log::warning("Failed to write BVH statistics '%s'", m_bvhStatsFilename);
+			}
+		}
+
+		if (m_bvhWidth == 4)
+		{
+			logWideBVHStats<4>(bvhBuilder, vertexData, vertexStride, indices.data(), m_boundingBox);
+		}
+		else if (m_bvhWidth == 8)
+		{
+			logWideBVHStats<8>(bvhBuilder, vertexData, vertexStride, indices.data(), m_boundingBox);
+		}
+
+		const BVHPackedNode* packedNodes = cacheHit ? bvhCache.getPackedNodes() : bvhBuilder.m_packedNodes.data();
+		u32 packedNodeCount = cacheHit ? bvhCache.getPackedNodeCount() : (u32)bvhBuilder.m_packedNodes.size();
+
+		BVH4 bvh4;
+		BVHQuantized quantizedBVH;
+
+		if (m_bvhQuantized)
+		{
+			bvh4.build(bvhBuilder, vertexData, vertexStride, indices.data());
+			quantizedBVH.build(bvh4);
+
+			// Must match traversal stack size in RayTracedShadowsQuantized.comp
+			const u32 shaderStackSize = 128;
+
+			if ((quantizedBVH.m_maxDepth + 1) * 3 + 1 > shaderStackSize)
+			{
+				Log::warning("Quantized BVH is too deep for GPU traversal (depth: %d), using binary BVH",
+					(int)quantizedBVH.m_maxDepth);
+				m_bvhQuantized = false;
+			}
+			else
+			{
+				packedNodes = quantizedBVH.m_packedNodes.data();
+				packedNodeCount = (u32)quantizedBVH.m_packedNodes.size();
+			}
+
+			Log::message("Quantized BVH4 node size: %d KB (BVH4: %d KB, binary BVH: %d KB)",
+				(int)(quantizedBVH.m_nodes.size() * sizeof(BVHQuantizedNode) / 1024),
+				(int)(bvh4.m_nodes.size() * sizeof(BVH4::Node) / 1024),
+				(int)(bvhBuilder.m_nodes.size() * sizeof(BVHNode) / 1024));
+
+			Log::message("Quantized BVH4 total size: %d KB, saved %d KB",
+				(int)(quantizedBVH.m_packedNodes.size() * sizeof(BVHPackedNode) / 1024),
+				(int)(((i64)bvhBuilder.m_packedNodes.size() - (i64)quantizedBVH.m_packedNodes.size()) * (i64)sizeof(BVHPackedNode) / 1024));
+
+			Log::message("CPU shadow rays: %.2f MRays / sec (BVH4), %.2f MRays / sec (quantized BVH4)",
+				measureShadowRayThroughput(bvh4, m_boundingBox) / 1000000.0,
+				measureShadowRayThroughput(quantizedBVH, m_boundingBox) / 1000000.0);
+		}
+
+		BVHInstanced instancedBVH;
+		m_bvhInstanced = false;
+
+		if (m_instanceCount > 1)
+		{
+			Timer timer;
+
+			BVHInstancedMesh mesh;
+			mesh.packedNodes = packedNodes;
+			mesh.packedNodeCount = packedNodeCount;
+
+			std::vector<BVHInstance> instances(m_instanceCount);
+			for (u32 i = 0; i < m_instanceCount; ++i)
+			{
+				instances[i].transform = m_instanceTransforms[i];
+			}
+
+			instancedBVH.build(&mesh, 1, instances.data(), m_instanceCount, m_bvhSettings);
+
+			Log::message("Two-level BVH built in %f sec. (instances: %d, top-level nodes: %d, size: %d KB, without instancing: %d KB)",
+				timer.time(),
+				(int)m_instanceCount,
+				(int)instancedBVH.m_nodes.size(),
+				(int)(instancedBVH.m_packedNodes.size() * sizeof(BVHPackedNode) / 1024),
+				(int)(u64(packedNodeCount) * m_instanceCount * sizeof(BVHPackedNode) / 1024));
+
+			Log::message("CPU shadow rays: %.2f MRays / sec (two-level BVH)",
+				measureShadowRayThroughput(instancedBVH, m_boundingBox) / 1000000.0);
+
+#if USE_VK_RAYTRACING
+			Log::warning("Hardware ray tracing modes only trace the first instance");
+#endif // USE_VK_RAYTRACING
+
+			packedNodes = instancedBVH.m_packedNodes.data();
+			packedNodeCount = (u32)instancedBVH.m_packedNodes.size();
+			m_bvhInstanced = true;
+		}
 
 		GfxBufferDesc desc;
 		desc.flags = GfxBufferFlags::Storage;
 		desc.format = GfxFormat_Unknown;
-		desc.stride = sizeof(bvhBuilder.m_packedNodes[0]);
-		desc.count = (u32)bvhBuilder.m_packedNodes.size();
-		m_bvhBuffer = Gfx_CreateBuffer(desc, bvhBuilder.m_packedNodes.data());
+		desc.stride = sizeof(BVHPackedNode);
+		desc.count = packedNodeCount;
+
+		m_bvhBuffer = Gfx_CreateBuffer(desc, packedNodes);
+
+		// Nodes are reordered for every light direction octant up front, so that a moving light only switches buffers.
+		// Octant buffers only hold node records, triangle data is read from m_bvhBuffer.
+		m_bvhOctantBuffers.clear();
+		if (m_bvhOctantOrder && !m_bvhQuantized)
+		{
+			const double timeSortBegin = m_timer.time();
+
+			const u32 nodeRecordCount = bvhBuilder.getPackedNodeRecordCount();
+			const std::vector<BVHNode> originalNodes = bvhBuilder.m_nodes;
+			const std::vector<BVHPackedNode> originalNodeRecords(
+				bvhBuilder.m_packedNodes.begin(), bvhBuilder.m_packedNodes.begin() + nodeRecordCount);
+
+			GfxBufferDesc nodeDesc = desc;
+			nodeDesc.count = nodeRecordCount;
+
+			for (u32 octant = 0; octant < 8; ++octant)
+			{
+				// Every octant is sorted from the original order, so that ties keep the order chosen by the builder
+				bvhBuilder.m_nodes = originalNodes;
+				std::copy(originalNodeRecords.begin(), originalNodeRecords.end(), bvhBuilder.m_packedNodes.begin());
+
+				bvhBuilder.sortChildren(octant);
+				m_bvhOctantBuffers.push_back(Gfx_CreateBuffer(nodeDesc, bvhBuilder.m_packedNodes.data()));
+			}
+
+			Log::message("BVH nodes reordered for all ray direction octants in %f sec. (node buffer size: %d KB)",
+				m_timer.time() - timeSortBegin,
+				(int)(u64(nodeRecordCount) * sizeof(BVHPackedNode) / 1024));
+		}
+
+		// Temporary output of a streaming build is not needed once the BVH is uploaded
+		if (m_bvhStreaming && !m_bvhCacheEnabled)
+		{
+			bvhCache.close();
+			remove(streamFilename.c_str());
+		}
 	}
 
 #if USE_VK_RAYTRACING
@@ -1054,3 +1751,122 @@ bool RayTracedShadowsApp::loadModel(const char* filename)
 
 	return true;
 }
+
+u32 RayTracedShadowsApp::getMaxBVHPrimCount() const
+{
+	// Every BVH has to fit into the packed index range and, when the device reports it, into a single storage buffer
+	const u64 maxPackedNodeCount = m_maxStorageBufferSize != 0
+		? m_maxStorageBufferSize / sizeof(BVHPackedNode)
+		: BVHBuilder::MaxPackedNodeCount;
+
+	return BVHBuilder::getMaxPrimCount(m_bvhSettings, maxPackedNodeCount);
+}
+
+void RayTracedShadowsApp::buildBVHSegments(const char* filename, const float* vertices, u32 stride, u32 vertexCount,
+	const u32* indices, u32 primCount)
+{
+	// Consecutive triangles usually belong to the same part of the model, which keeps segment bounds compact
+	const u32 segmentPrimCount = getMaxBVHPrimCount();
+	const u32 segmentCount = divUp(primCount, segmentPrimCount);
+
+	Log::warning("Model has %d triangles, which exceeds the BVH buffer limit of %d. "
+		"Building %d BVH segments that are traced in sequence, wide, quantized, octant ordered and instanced BVHs are disabled.",
+		(int)primCount, (int)segmentPrimCount, (int)segmentCount);
+
+	m_bvhQuantized = false;
+	m_bvhInstanced = false;
+	m_bvhOctantBuffers.clear();
+
+	// Segments are cached in separate files, keyed by the whole model and the triangle range of the segment
+	const u64 cacheKey = m_bvhCacheEnabled
+		? BVHCache::calculateKey(vertices, stride, vertexCount, indices, primCount, m_bvhSettings)
+		: 0;
+
+	for (u32 i = 0; i < segmentCount; ++i)
+	{
+		const u32 firstPrim = i * segmentPrimCount;
+		const u32 segmentPrims = min(segmentPrimCount, primCount - firstPrim);
+		const u32* segmentIndices = indices + size_t(firstPrim) * 3;
+
+		Timer timer;
+
+		BVHBuilder bvhBuilder;
+		BVHCache bvhCache;
+
+		const std::string cacheFilename = std::string(filename) + ".bvhcache." + std::to_string(i);
+		const u64 segmentKey = BVHCache::calculateSegmentKey(cacheKey, firstPrim, segmentPrims);
+
+		const bool cacheHit = m_bvhCacheEnabled && bvhCache.open(cacheFilename.c_str(), segmentKey);
+
+		if (cacheHit)
+		{
+			Log::message("BVH segment %d loaded from cache '%s' in %f sec. (triangles: %d, nodes: %d, size: %d KB)",
+				(int)i, cacheFilename.c_str(), timer.time(), (int)segmentPrims,
+				(int)bvhCache.getNodeCount(),
+				(int)(bvhCache.getPackedNodeCount() * sizeof(BVHPackedNode) / 1024));
+
+			if (m_bvhStatsEnabled)
+			{
+				bvhCache.load(bvhBuilder);
+			}
+		}
+		else
+		{
+			bvhBuilder.build(vertices, stride, segmentIndices, segmentPrims, m_bvhSettings);
+
+			Log::message("BVH segment %d constructed in %f sec. (triangles: %d, nodes: %d, size: %d KB)",
+				(int)i, timer.time(), (int)segmentPrims,
+				(int)bvhBuilder.m_nodes.size(),
+				(int)(bvhBuilder.m_packedNodes.size() * sizeof(BVHPackedNode) / 1024));
+
+			if (m_bvhCacheEnabled && !BVHCache::write(cacheFilename.c_str(), segmentKey, bvhBuilder))
+			{
+				Log::warning("Failed to write BVH cache '%s'", cacheFilename.c_str());
+			}
+		}
+
+		if (m_bvhStatsEnabled)
+		{
+			TaskScheduler scheduler(m_bvhSettings.threadCount);
+
+			BVHStats stats;
+			stats.calculate(bvhBuilder, vertices, stride, segmentIndices,
+				m_bvhSettings.traversalCost, m_bvhSettings.intersectionCost, &scheduler);
+
+			Log::message("BVH segment %d statistics:", (int)i);
+			stats.log();
+
+			if (m_bvhStatsFilename)
+			{
+				// Every segment is written to its own file, with the segment index appended to the name
+				const std::string statsFilename = std::string(m_bvhStatsFilename) + "." + std::to_string(i);
+				if (!stats.writeJson(statsFilename.c_str()))
+				{
+					Log::warning("Failed to write BVH statistics '%s'", statsFilename.c_str());
+				}
+			}
+		}
+
+		GfxBufferDesc desc;
+		desc.flags = GfxBufferFlags::Storage;
+		desc.format = GfxFormat_Unknown;
+		desc.stride = sizeof(BVHPackedNode);
+		desc.count = cacheHit ? bvhCache.getPackedNodeCount() : (u32)bvhBuilder.m_packedNodes.size();
+
+		const BVHPackedNode* packedNodes = cacheHit ? bvhCache.getPackedNodes() : bvhBuilder.m_packedNodes.data();
+
+		if (i == 0)
+		{
+			m_bvhBuffer = Gfx_CreateBuffer(desc, packedNodes);
+		}
+		else
+		{
+			m_bvhSegmentBuffers.push_back(Gfx_CreateBuffer(desc, packedNodes));
+		}
+	}
+
+	if (m_instanceCount > 1)
+	{
+		Log::warning("Instancing is not supported with BVH segments, compute shadows only trace the first instance");
+	}
+}
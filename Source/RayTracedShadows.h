@@ -55,7 +55,7 @@ private:
 
 	struct RayTracingConstants
 	{
-		Vec4 cameraPosition;
+		Vec4 cameraPosition; // position in XYZ, W is non-zero when shadows of previous BVH segments are accumulated
 		Vec4 cameraDirection;
 		Vec4 lightDirection; // direction in XYZ, bias in W
 		Vec4 renderTargetSize;
@@ -65,7 +65,11 @@ private:
 	void renderShadowMaskHardware();
 	void renderShadowMaskHardwareInline();
 
+	void parseCommandLine(int argc, char** argv);
 	bool loadModel(const char* filename);
+	u32 getMaxBVHPrimCount() const;
+	void buildBVHSegments(const char* filename, const float* vertices, u32 stride, u32 vertexCount,
+		const u32* indices, u32 primCount);
 	GfxRef<GfxTexture> loadTexture(const std::string& filename);
 
 	Timer m_timer;
@@ -89,6 +93,9 @@ private:
 	GfxOwn<GfxTechnique> m_techniqueModel;
 	GfxOwn<GfxTechnique> m_techniqueRayTracedShadows;
 	GfxOwn<GfxTechnique> m_techniqueRayTracedShadowsInline;
+	GfxOwn<GfxTechnique> m_techniqueRayTracedShadowsQuantized;
+	GfxOwn<GfxTechnique> m_techniqueRayTracedShadowsIndexed;
+	GfxOwn<GfxTechnique> m_techniqueRayTracedShadowsInstanced;
 	GfxOwn<GfxTechnique> m_techniqueCombine;
 
 	GfxOwn<GfxTexture> m_defaultWhiteTexture;
@@ -115,6 +122,9 @@ private:
 
 	Mat4 m_worldTransform = Mat4::identity();
 
+	u32 m_instanceCount = 1; // Model is replicated on a grid, compute shadows use a two-level BVH over the copies
+	std::vector<Mat4> m_instanceTransforms;
+
 	Box3 m_boundingBox;
 
 	struct Vertex
@@ -164,6 +174,19 @@ private:
 	float m_cameraScale = 1.0f;
 
 	GfxOwn<GfxBuffer> m_bvhBuffer;
+	u64 m_maxStorageBufferSize = 0; // Limits the size of each BVH buffer, zero when the device does not report it
+	std::vector<GfxOwn<GfxBuffer>> m_bvhSegmentBuffers; // BVHs of triangles beyond BVHBuilder::getMaxPrimCount(), traced after m_bvhBuffer
+	BVHBuilderSettings m_bvhSettings;
+	u32 m_bvhWidth = 2; // 4 or 8 also collapses the BVH into a wide tree for CPU traversal
+	bool m_bvhQuantized = false; // Compute shader uses 4-wide BVH with quantized child bounds
+	bool m_bvhInstanced = false; // Compute shader traverses a top-level BVH over model instances
+	bool m_bvhOctantOrder = false; // Children are visited front-to-back along the light direction octant
+	std::vector<GfxOwn<GfxBuffer>> m_bvhOctantBuffers; // Node records for each light direction octant, triangle data stays in m_bvhBuffer
+	bool m_bvhCacheEnabled = true; // Built BVH is stored next to the model and reused by later runs
+	bool m_bvhStreaming = false; // BVH is built out of core into the cache file, which is used memory-mapped
+	bool m_bvhStatsEnabled = false; // Tree quality metrics are written to the log after loading, this needs builder data on cache hits
+	const char* m_bvhStatsFilename = nullptr; // Optional JSON output of tree quality metrics
+	const char* m_modelFilename = nullptr;
 
 	Vec2 m_prevMousePos = Vec2(0.0f);
 
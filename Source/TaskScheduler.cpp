@@ -0,0 +1,159 @@
+#include "TaskScheduler.h"
+
+#include <algorithm>
+
+namespace
+{
+thread_local const TaskScheduler* t_scheduler = nullptr;
+thread_local u32 t_queueIndex = 0;
+}
+
+TaskScheduler::TaskScheduler(u32 threadCount)
+{
+	if (threadCount == 0)
+	{
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	m_queues.resize(threadCount);
+	for (auto& queue : m_queues)
+	{
+		queue.reset(new TaskQueue);
+	}
+
+	for (u32 i = 1; i < threadCount; ++i)
+	{
+		m_threads.emplace_back(&TaskScheduler::workerThread, this, i);
+	}
+}
+
+TaskScheduler::~TaskScheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_sleepMutex);
+		m_stop = true;
+	}
+
+	m_sleepCondition.notify_all();
+
+	for (std::thread& thread : m_threads)
+	{
+		thread.join();
+	}
+}
+
+u32 TaskScheduler::getQueueIndex() const
+{
+	return t_scheduler == this ? t_queueIndex : 0;
+}
+
+void TaskScheduler::run(TaskGroup& group, std::function<void()> function)
+{
+	if (m_threads.empty())
+	{
+		function();
+		return;
+	}
+
+	group.pendingCount++;
+
+	{
+		TaskQueue& queue = *m_queues[getQueueIndex()];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.emplace_back();
+		queue.tasks.back().function = std::move(function);
+		queue.tasks.back().group = &group;
+	}
+
+	m_queuedCount++;
+
+	{
+		// Synchronize with workers that are about to go to sleep
+		std::lock_guard<std::mutex> lock(m_sleepMutex);
+	}
+
+	m_sleepCondition.notify_one();
+}
+
+void TaskScheduler::wait(TaskGroup& group)
+{
+	const u32 queueIndex = getQueueIndex();
+
+	while (group.pendingCount.load() != 0)
+	{
+		Task task;
+		if (popTask(queueIndex, task))
+		{
+			execute(task);
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+bool TaskScheduler::popTask(u32 queueIndex, Task& outTask)
+{
+	if (m_queuedCount.load() == 0)
+	{
+		return false;
+	}
+
+	{
+		TaskQueue& queue = *m_queues[queueIndex];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.tasks.empty())
+		{
+			outTask = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+			m_queuedCount--;
+			return true;
+		}
+	}
+
+	const u32 queueCount = (u32)m_queues.size();
+	for (u32 i = 1; i < queueCount; ++i)
+	{
+		TaskQueue& queue = *m_queues[(queueIndex + i) % queueCount];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.tasks.empty())
+		{
+			outTask = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+			m_queuedCount--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void TaskScheduler::execute(Task& task)
+{
+	task.function();
+	task.group->pendingCount--;
+}
+
+void TaskScheduler::workerThread(u32 queueIndex)
+{
+	t_scheduler = this;
+	t_queueIndex = queueIndex;
+
+	for (;;)
+	{
+		Task task;
+		if (popTask(queueIndex, task))
+		{
+			execute(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_sleepMutex);
+		m_sleepCondition.wait(lock, [this]() { return m_stop || m_queuedCount.load() != 0; });
+		if (m_stop)
+		{
+			break;
+		}
+	}
+}
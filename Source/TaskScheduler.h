@@ -0,0 +1,93 @@
+#pragma once
+
+#include <Rush/Rush.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Minimal work-stealing task pool.
+// Each worker owns a task queue. Tasks spawned from a worker go into its own queue
+// and are executed in LIFO order, while idle workers steal the oldest tasks from other queues.
+// Threads that wait for a task group help executing pending tasks instead of blocking.
+
+class TaskScheduler
+{
+	RUSH_DISALLOW_COPY_AND_ASSIGN(TaskScheduler);
+
+public:
+
+	struct TaskGroup
+	{
+		std::atomic<u32> pendingCount = {0};
+	};
+
+	// Zero thread count uses all available hardware threads
+	TaskScheduler(u32 threadCount = 0);
+	~TaskScheduler();
+
+	void run(TaskGroup& group, std::function<void()> function);
+	void wait(TaskGroup& group);
+
+	// Total number of threads that execute tasks, including the thread that waits for them
+	u32 getThreadCount() const { return (u32)m_threads.size() + 1; }
+
+private:
+
+	struct Task
+	{
+		std::function<void()> function;
+		TaskGroup* group = nullptr;
+	};
+
+	struct TaskQueue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	u32 getQueueIndex() const;
+	bool popTask(u32 queueIndex, Task& outTask);
+	void execute(Task& task);
+	void workerThread(u32 queueIndex);
+
+	// Queue 0 is shared by all threads that are not owned by the scheduler
+	std::vector<std::unique_ptr<TaskQueue>> m_queues;
+	std::vector<std::thread> m_threads;
+
+	std::atomic<u32> m_queuedCount = {0};
+	std::mutex m_sleepMutex;
+	std::condition_variable m_sleepCondition;
+	bool m_stop = false;
+};
+
+// Calls function(begin, end) for sub-ranges of [0, count) of up to grainSize elements.
+// Runs on the calling thread if scheduler is null or the range is small.
+template <typename Function>
+void parallelFor(TaskScheduler* scheduler, u32 count, u32 grainSize, const Function& function)
+{
+	if (!scheduler || count <= grainSize)
+	{
+		if (count)
+		{
+			function(0u, count);
+		}
+		return;
+	}
+
+	TaskScheduler::TaskGroup taskGroup;
+	for (u32 begin = 0; begin < count; begin += grainSize)
+	{
+		const u32 end = begin + grainSize < count ? begin + grainSize : count;
+		scheduler->run(taskGroup, [&function, begin, end]()
+		{
+			function(begin, end);
+		});
+	}
+	scheduler->wait(taskGroup);
+}
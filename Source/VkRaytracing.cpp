@@ -3,6 +3,17 @@
 #include <Rush/MathCommon.h>
 #include <Rush/UtilArray.h>
 
+u64 VkRaytracing::getMaxStorageBufferRange()
+{
+	// Storage buffer limits are not part of GfxCapability, so they are read from the physical device
+	GfxDevice* device = Platform_GetGfxDevice();
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(device->m_physicalDevice, &properties);
+
+	return properties.limits.maxStorageBufferRange;
+}
+
 void VkRaytracing::createPipeline(const GfxShaderSource& rgen, const GfxShaderSource& rmiss)
 {
 	GfxDevice* device = Platform_GetGfxDevice();
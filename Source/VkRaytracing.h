@@ -10,6 +10,9 @@ public:
 
 	~VkRaytracing() { reset(); }
 
+	// Largest range of a storage buffer that compute shaders can bind on the current device, in bytes
+	static u64 getMaxStorageBufferRange();
+
 	void createPipeline(const GfxShaderSource& rgen, const GfxShaderSource& rmiss);
 
 	void build(GfxContext* ctx,